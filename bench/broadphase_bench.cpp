@@ -0,0 +1,171 @@
+#include "game/grid.h"
+#include "utils/aabb_tree.h"
+#include "utils/spatial_hash.h"
+
+// A headless benchmark comparing `AabbTree` and `SpatialHash`, as used by `GridManager` (see `IMP_GRID_MANAGER_SPATIAL_HASH`).
+// Generates random moving boxes from a seed, and runs the same operations on both structures each tick:
+// updating the moved nodes, querying the swept AABB of each box, and finding all overlapping pairs.
+// Both structures must find the same number of overlaps, otherwise the benchmark fails.
+//
+// Usage: `broadphase-bench [params]`, where `params` is `Params` below in the reflection syntax, e.g. `"{boxes=50000,large_fraction=0.02}"`.
+// The omitted parameters get the default values. The defaults are the debris-heavy scenario, add `large_fraction` for a mix of sizes.
+
+SIMPLE_STRUCT( Params
+    // The random seed for the scenario.
+    DECL(std::uint32_t INIT=1 ATTR Refl::Optional) seed
+    DECL(int INIT=20000 ATTR Refl::Optional) boxes
+    DECL(int INIT=200 ATTR Refl::Optional) ticks
+    // The box size in tiles is random, in range `[1, max_size]` on each axis.
+    DECL(int INIT=2 ATTR Refl::Optional) max_size
+    // The chance for each box to be large, with the size in range `[max_size, large_size]` instead.
+    DECL(float INIT=0 ATTR Refl::Optional) large_fraction
+    DECL(int INIT=40 ATTR Refl::Optional) large_size
+    // The velocity components are in range `[-velocity, velocity]`, in pixels per tick.
+    DECL(int INIT=3 ATTR Refl::Optional) velocity
+    // The world is a square with this much area per box, in pixels. The boxes bounce off its borders.
+    DECL(int INIT=2500 ATTR Refl::Optional) area_per_box
+    // The `SpatialHash` cell size, in tiles.
+    DECL(int INIT=4 ATTR Refl::Optional) cell_size
+    // The `AabbTree` margin, in pixels.
+    DECL(int INIT=tile_size ATTR Refl::Optional) tree_margin
+)
+
+struct Box
+{
+    ivec2 pos;
+    ivec2 size;
+    ivec2 vel;
+    int node = 0;
+};
+
+// Time spent in each operation, in seconds.
+struct Timings
+{
+    double update = 0;
+    double queries = 0;
+    double pairs = 0;
+};
+
+[[nodiscard]] static std::vector<Box> GenerateBoxes(const Params &params, int &world_size)
+{
+    Random::DefaultGenerator generator(params.seed);
+    Random::DefaultInterfaces<Random::DefaultGenerator> ra(generator);
+
+    world_size = int(std::sqrt(double(params.boxes) * params.area_per_box));
+
+    std::vector<Box> ret(params.boxes);
+    for (Box &box : ret)
+    {
+        bool large = params.large_fraction > 0 && (0 <= ra.f < 1) < params.large_fraction;
+        box.size = (large ? max(params.max_size, 1) <= ra.ivec2 <= max(params.large_size, 1) : 1 <= ra.ivec2 <= max(params.max_size, 1)) * tile_size;
+        box.pos = 0 <= ra.ivec2 <= max(world_size - box.size, 0);
+        box.vel = ra.ivec2.abs() <= params.velocity;
+    }
+    return ret;
+}
+
+// Runs the scenario on `broadphase`. Returns the total number of overlaps found by the queries and by the pair search.
+template <typename T>
+[[nodiscard]] static std::pair<std::uint64_t, std::uint64_t> Run(T &broadphase, std::vector<Box> boxes, int world_size, int ticks, Timings &timings)
+{
+    auto GetAabb = [](const Box &box){return typename T::Aabb{box.pos, box.pos + box.size};};
+
+    for (int i = 0; i < int(boxes.size()); i++)
+        boxes[i].node = broadphase.AddNode(GetAabb(boxes[i]), i);
+    // Like after loading a snapshot in `GridManager`, this gives the tree a good starting point.
+    broadphase.Rebuild();
+
+    std::uint64_t query_overlaps = 0, pair_overlaps = 0;
+
+    for (int t = 0; t < ticks; t++)
+    {
+        auto time_a = std::chrono::steady_clock::now();
+
+        for (Box &box : boxes)
+        {
+            box.pos += box.vel;
+            for (int i = 0; i < 2; i++)
+            {
+                if (box.pos[i] < 0 || box.pos[i] + box.size[i] > world_size)
+                    box.vel[i] = -box.vel[i];
+            }
+            broadphase.ModifyNode(box.node, GetAabb(box), box.vel);
+        }
+
+        auto time_b = std::chrono::steady_clock::now();
+
+        for (const Box &box : boxes)
+        {
+            typename T::Aabb swept = GetAabb(box).ExpandInDir(box.vel).Expand(ivec2(1));
+            broadphase.CollideAabb(swept, [&](int node)
+            {
+                const Box &other = boxes[broadphase.GetNodeUserData(node)];
+                query_overlaps += &other != &box && swept.Intersects(GetAabb(other));
+                return false;
+            });
+        }
+
+        auto time_c = std::chrono::steady_clock::now();
+
+        broadphase.CollidePairs([&](int node_a, int node_b)
+        {
+            pair_overlaps += GetAabb(boxes[broadphase.GetNodeUserData(node_a)]).Intersects(GetAabb(boxes[broadphase.GetNodeUserData(node_b)]));
+            return false;
+        });
+
+        auto time_d = std::chrono::steady_clock::now();
+
+        timings.update += std::chrono::duration<double>(time_b - time_a).count();
+        timings.queries += std::chrono::duration<double>(time_c - time_b).count();
+        timings.pairs += std::chrono::duration<double>(time_d - time_c).count();
+    }
+
+    return {query_overlaps, pair_overlaps};
+}
+
+static void PrintTimings(std::string_view name, const Timings &timings, int ticks)
+{
+    ticks = max(ticks, 1);
+    std::cout << FMT("{}, ms per tick: update {:.3f}, queries {:.3f}, pairs {:.3f}, total {:.3f}\n", name,
+        timings.update * 1000 / ticks, timings.queries * 1000 / ticks, timings.pairs * 1000 / ticks,
+        (timings.update + timings.queries + timings.pairs) * 1000 / ticks
+    );
+}
+
+IMP_MAIN(argc, argv)
+{
+    if (argc > 2)
+    {
+        std::cout << "Expected at most one argument.\n";
+        return 1;
+    }
+
+    Params params;
+    if (argc == 2)
+        params = Refl::FromString<Params>(argv[1]);
+
+    int world_size = 0;
+    std::vector<Box> boxes = GenerateBoxes(params, world_size);
+
+    std::cout << "Scenario: " << Refl::ToString(params) << '\n';
+    std::cout << FMT("World size: {} px\n", world_size);
+
+    Timings tree_timings, hash_timings;
+
+    AabbTree<ivec2, int> tree(ivec2(params.tree_margin));
+    auto tree_overlaps = Run(tree, boxes, world_size, params.ticks, tree_timings);
+
+    SpatialHash<ivec2, int> hash(ivec2(params.cell_size * tile_size));
+    auto hash_overlaps = Run(hash, boxes, world_size, params.ticks, hash_timings);
+
+    PrintTimings("AabbTree   ", tree_timings, params.ticks);
+    PrintTimings("SpatialHash", hash_timings, params.ticks);
+
+    std::cout << FMT("Overlaps: {} from queries, {} pairs\n", tree_overlaps.first, tree_overlaps.second);
+    if (tree_overlaps != hash_overlaps)
+    {
+        std::cout << FMT("Mismatch! The spatial hash found {} from queries, {} pairs.\n", hash_overlaps.first, hash_overlaps.second);
+        return 1;
+    }
+    return 0;
+}
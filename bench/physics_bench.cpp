@@ -0,0 +1,154 @@
+#include "game/grid_manager.h"
+#include "game/main.h"
+
+// A headless benchmark for `GridManager::TickPhysics()`.
+// Generates a random scenario from a seed, runs it for a fixed number of ticks, then prints the timings and the hash of the final state.
+// The hash doesn't depend on the thread count, so comparing it between runs catches nondeterminism.
+// Since we use the standard random distributions, the scenarios (and the hashes) are only reproducible with the same standard library.
+//
+// Usage: `physics-bench [params]`, where `params` is `Params` below in the reflection syntax, e.g. `"{grids=1000,ticks=100,threads=0}"`.
+// The omitted parameters get the default values.
+
+// The physics code references some of the game globals for rendering. We never render, so they stay empty.
+const ivec2 screen_size = ivec2(480, 270);
+Graphics::TextureAtlas texture_atlas;
+Render r;
+
+SIMPLE_STRUCT( Params
+    // The random seed for the scenario.
+    DECL(std::uint32_t INIT=1 ATTR Refl::Optional) seed
+    // The number of grids. The empty ones are skipped, so the actual number can be smaller.
+    DECL(int INIT=400 ATTR Refl::Optional) grids
+    DECL(int INIT=500 ATTR Refl::Optional) ticks
+    // The number of worker threads, in addition to the main thread. -1 means `std::thread::hardware_concurrency() - 1`.
+    DECL(int INIT=-1 ATTR Refl::Optional) threads
+    // The grid size in tiles is random, in range `[1, max_size]` on each axis.
+    DECL(int INIT=6 ATTR Refl::Optional) max_size
+    // The chance for each tile to be non-empty.
+    DECL(float INIT=0.7f ATTR Refl::Optional) density
+    // The fraction of the non-empty tiles that are diagonal, the rest are full walls.
+    DECL(float INIT=0.8f ATTR Refl::Optional) diagonal_fraction
+    // The velocity components are in range `[-velocity, velocity]`.
+    DECL(float INIT=3 ATTR Refl::Optional) velocity
+    // The chance for each grid to be parked, with zero velocity. Those fall asleep until something hits them.
+    DECL(float INIT=0 ATTR Refl::Optional) parked_fraction
+    // The chance for each grid to have an infinite mass.
+    DECL(float INIT=0.05f ATTR Refl::Optional) infinite_mass_fraction
+    // The grids are placed on a square lattice with this step in pixels, with some jitter.
+    DECL(int INIT=90 ATTR Refl::Optional) spacing
+    // Whether the grids are randomly rotated.
+    DECL(bool INIT=true ATTR Refl::Optional) rotate
+    // Whether the grids use the chunked storage mode.
+    DECL(bool INIT=false ATTR Refl::Optional) chunked
+)
+
+// Fills the grid manager with a random scenario.
+static void GenerateScenario(GridManager &manager, const Params &params)
+{
+    Random::DefaultGenerator generator(params.seed);
+    Random::DefaultInterfaces<Random::DefaultGenerator> ra(generator);
+
+    int side = max(1, int(std::sqrt(params.grids)));
+
+    for (int i = 0; i < params.grids; i++)
+    {
+        GridObject obj;
+        obj.grid.SetChunked(params.chunked);
+
+        ivec2 size = 1 <= ra.ivec2 <= max(params.max_size, 1);
+        obj.grid.ModifyRegion(ivec2(), size, [&](auto &&cell)
+        {
+            for (ivec2 pos : vector_range(size))
+            {
+                if ((0 <= ra.f < 1) >= params.density)
+                    continue;
+                if ((0 <= ra.f < 1) < params.diagonal_fraction)
+                    cell(pos).mid.tile = Tile(int(Tile::wall_a) + ra.index(4));
+                else
+                    cell(pos).mid.tile = Tile::wall;
+            }
+        });
+        if (obj.grid.IsEmpty())
+            continue;
+
+        obj.grid.xf.pos = ivec2(i % side, i / side) * params.spacing + (ra.ivec2.abs() <= params.spacing / 16);
+        obj.grid.xf.rot = params.rotate ? ra.index(4) : 0;
+        obj.vel = ra.fvec2.abs() <= params.velocity;
+        if (params.parked_fraction > 0 && (0 <= ra.f < 1) < params.parked_fraction)
+            obj.vel = fvec2();
+        obj.infinite_mass = (0 <= ra.f < 1) < params.infinite_mass_fraction;
+        manager.AddGrid(std::move(obj));
+    }
+}
+
+// Hashes the positions and velocities of all grids.
+[[nodiscard]] static std::size_t StateHash(const GridManager &manager)
+{
+    std::size_t ret = 0;
+    for (int i = 0; i < manager.GridCount(); i++)
+    {
+        GridId id = manager.GetGridId(i);
+        GridObjectView obj = manager.GetGrid(id);
+        Hash::Append(ret, {
+            Hash::Compute(id.index),
+            Hash::Compute(obj.grid.xf.pos.x), Hash::Compute(obj.grid.xf.pos.y), Hash::Compute(obj.grid.xf.rot),
+            Hash::Compute(std::bit_cast<std::uint32_t>(obj.vel.x)), Hash::Compute(std::bit_cast<std::uint32_t>(obj.vel.y)),
+            Hash::Compute(obj.vel_owed.x), Hash::Compute(obj.vel_owed.y),
+        });
+    }
+    return ret;
+}
+
+IMP_MAIN(argc, argv)
+{
+    if (argc > 2)
+    {
+        std::cout << "Expected at most one argument.\n";
+        return 1;
+    }
+
+    Params params;
+    if (argc == 2)
+        params = Refl::FromString<Params>(argv[1]);
+
+    ThreadPool pool(params.threads < 0 ? int(std::thread::hardware_concurrency()) - 1 : params.threads);
+
+    GridManager manager;
+    manager.SetThreadPool(&pool);
+    GenerateScenario(manager, params);
+
+    std::cout << "Scenario: " << Refl::ToString(params) << '\n';
+    std::cout << FMT("Grids: {}, threads: {}\n", manager.GridCount(), pool.ThreadCount());
+
+    GridManager::PhysicsTimings total_timings;
+    auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < params.ticks; i++)
+    {
+        manager.TickPhysics();
+
+        const GridManager::PhysicsTimings &timings = manager.LastPhysicsTimings();
+        total_timings.candidates += timings.candidates;
+        total_timings.pixel_advance += timings.pixel_advance;
+        total_timings.circular += timings.circular;
+        total_timings.aabb_update += timings.aabb_update;
+        total_timings.impulse_transfer += timings.impulse_transfer;
+        total_timings.sleeping += timings.sleeping;
+        total_timings.aabb_validation += timings.aabb_validation;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int ticks = max(params.ticks, 1);
+
+    std::cout << FMT("Ticks: {} in {:.3f} s, {:.1f} ticks/s\n", params.ticks, seconds, params.ticks / seconds);
+    std::cout << "Phases, ms per tick:\n";
+    std::cout << FMT("  candidates:       {:.3f}\n", total_timings.candidates * 1000 / ticks);
+    std::cout << FMT("  pixel advance:    {:.3f}\n", total_timings.pixel_advance * 1000 / ticks);
+    std::cout << FMT("  circular:         {:.3f}\n", total_timings.circular * 1000 / ticks);
+    std::cout << FMT("  aabb update:      {:.3f}\n", total_timings.aabb_update * 1000 / ticks);
+    std::cout << FMT("  impulse transfer: {:.3f}\n", total_timings.impulse_transfer * 1000 / ticks);
+    std::cout << FMT("  sleeping:         {:.3f}\n", total_timings.sleeping * 1000 / ticks);
+    std::cout << FMT("Of those, AABB tree validation: {:.3f}\n", total_timings.aabb_validation * 1000 / ticks);
+    std::cout << FMT("Final state hash: {:016x}\n", StateHash(manager));
+    return 0;
+}
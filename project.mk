@@ -61,6 +61,29 @@ $(call ProjectSetting,pch,src/game/*->src/game/master.hpp)
 $(call ProjectSetting,libs,*)
 $(call ProjectSetting,bad_lib_flags,-Dmain=%>>>-DIMP_ENTRY_POINT_OVERRIDE=%)
 
+# A headless benchmark for the grid physics. Run with `make run-physics-bench`, see `bench/physics_bench.cpp` for the parameters.
+# Uses everything except the game itself, plus the physics code.
+$(call Project,exe,physics-bench)
+$(call ProjectSetting,source_dirs,lib $(filter-out src/game,$(wildcard src/*)))
+$(call ProjectSetting,sources,bench/physics_bench.cpp src/game/grid.cpp src/game/grid_manager.cpp)
+$(call ProjectSetting,common_flags,$(_proj_commonflags))
+$(call ProjectSetting,cxxflags,$(_proj_cxxflags))
+$(call ProjectSetting,flags_func,_file_cxxflags)
+$(call ProjectSetting,pch,src/game/*;bench/*->src/game/master.hpp)
+$(call ProjectSetting,libs,*)
+$(call ProjectSetting,bad_lib_flags,-Dmain=%>>>-DIMP_ENTRY_POINT_OVERRIDE=%)
+
+# A headless benchmark comparing `AabbTree` and `SpatialHash`. Run with `make run-broadphase-bench`, see `bench/broadphase_bench.cpp` for the parameters.
+$(call Project,exe,broadphase-bench)
+$(call ProjectSetting,source_dirs,lib $(filter-out src/game,$(wildcard src/*)))
+$(call ProjectSetting,sources,bench/broadphase_bench.cpp)
+$(call ProjectSetting,common_flags,$(_proj_commonflags))
+$(call ProjectSetting,cxxflags,$(_proj_cxxflags))
+$(call ProjectSetting,flags_func,_file_cxxflags)
+$(call ProjectSetting,pch,bench/*->src/game/master.hpp)
+$(call ProjectSetting,libs,*)
+$(call ProjectSetting,bad_lib_flags,-Dmain=%>>>-DIMP_ENTRY_POINT_OVERRIDE=%)
+
 
 # --- Codegen ---
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <concepts>
 #include <cstddef>
@@ -13,11 +14,18 @@
 #include "meta/lists.h"
 #include "meta/type_info.h"
 #include "program/errors.h"
+#include "macros/finally.h"
 #include "reflection/full.h"
 #include "strings/format.h"
 #include "utils/robust_math.h"
 #include "utils/simple_iterator.h"
 #include "utils/sparse_set.h"
+#include "utils/thread_pool.h"
+
+// If enabled, the entity lists check their consistency after every change. This is O(n) per change, so it's disabled by default.
+#ifndef IMP_ENT_VALIDATE_LISTS
+#define IMP_ENT_VALIDATE_LISTS 0
+#endif
 
 namespace Ent
 {
@@ -390,32 +398,97 @@ namespace Ent
     concept ListType = Meta::cv_unqualified<T> && std::derived_from<T, List<Tag>> && !std::is_abstract_v<T>;
 
     // An implemenetation of `ListBase` based on a sparse set.
-    // NOTE: Deleting an element makes the pointers/iterators that were pointing to it point to the next element.
+    // In the unordered mode, erasing an element moves the last element to its place.
+    // In the ordered mode, erasing an element leaves a null tombstone in its place, which makes erasing O(1).
+    // The tombstones are skipped when iterating, and removed in bulk by `Insert()` when there are too many of them, which is amortized O(1).
+    // NOTE: Erasing elements while iterating is allowed. In the ordered mode this never skips the remaining elements,
+    // but in the unordered mode erasing the current element makes the iteration skip the element that was moved into its place.
+    // Inserting elements while iterating is not allowed.
     template <TagType Tag, bool Ordered>
     class BasicSparseSet : public List<Tag>
     {
         using index_t = typename Tag::entity_index_t;
 
+        // In the ordered mode, this can contain nulls (tombstones).
         std::vector<Entity<Tag> *> dense;
         std::vector<index_t> sparse;
 
+        // The number of nulls in `dense`. Always zero in the unordered mode.
+        std::size_t num_tombstones = 0;
+
         struct IterState
         {
-            typename decltype(dense)::const_iterator vec_iter{};
+            const BasicSparseSet *set = nullptr;
+            std::size_t pos = 0;
 
-            bool operator==(const IterState &) const = default;
+            // Skips the tombstones, starting from the current position.
+            void SkipTombstones()
+            {
+                if constexpr (Ordered)
+                {
+                    while (pos < set->dense.size() && !set->dense[pos])
+                        pos++;
+                }
+            }
+
+            // All iterators past the end are equal, because the dense array can shrink while iterating.
+            bool operator==(const IterState &other) const
+            {
+                bool a_at_end = !set || pos >= set->dense.size();
+                bool b_at_end = !other.set || other.pos >= other.set->dense.size();
+                return a_at_end && b_at_end ? true : pos == other.pos;
+            }
 
             Entity<Tag> &operator()(std::false_type) const
             {
-                return **vec_iter;
+                return *set->dense[pos];
             }
 
             void operator()(std::true_type)
             {
-                vec_iter++;
+                pos++;
+                SkipTombstones();
             }
         };
 
+        // Removes the tombstones, preserving the order of the remaining elements.
+        void RemoveTombstones()
+        {
+            std::size_t j = 0;
+            for (std::size_t i = 0; i < dense.size(); i++)
+            {
+                if (!dense[i])
+                    continue;
+                dense[j] = dense[i];
+                sparse[static_cast<impl::EntityHidden<Tag> *>(dense[j])->entity_index] = j;
+                j++;
+            }
+            dense.resize(j);
+            num_tombstones = 0;
+        }
+
+        void Validate() const
+        {
+            ASSERT_ALWAYS(
+                std::size_t(sparse.size() - std::count(sparse.begin(), sparse.end(), index_t(-1))) == dense.size() - num_tombstones,
+                "Internal error: Entity sparse set consistency check failed: Sparse and dense array sizes mismatch."
+            );
+            ASSERT_ALWAYS(
+                std::size_t(std::count(dense.begin(), dense.end(), nullptr)) == num_tombstones,
+                "Internal error: Entity sparse set consistency check failed: Wrong tombstone count."
+            );
+            ASSERT_ALWAYS(
+                std::all_of(dense.begin(), dense.end(), [&](Entity<Tag> *e)
+                {
+                    if (!e)
+                        return true;
+                    auto i = static_cast<impl::EntityHidden<Tag> *>(e)->entity_index;
+                    return i == static_cast<impl::EntityHidden<Tag> *>(dense[sparse[i]])->entity_index;
+                }),
+                "Internal error: Entity sparse set consistency check failed: Sparse and dense roundtrip failed."
+            );
+        }
+
       public:
         void IncreaseCapacity(std::size_t new_capacity) override
         {
@@ -427,24 +500,42 @@ namespace Ent
             auto entity_index = static_cast<impl::EntityHidden<Tag> &>(entity).entity_index;
             ASSERT(Robust::less(entity_index, sparse.size()), "Internal error: Entity sparse set is too small.");
             ASSERT(sparse[entity_index] == index_t(-1), "Internal error: Entity already exists in the sparse set.");
+
+            // Each removal happens after at least `dense.size() / 2` erasures, so it's amortized O(1).
+            if constexpr (Ordered)
+            {
+                if (num_tombstones > 0 && num_tombstones >= dense.size() / 2)
+                    RemoveTombstones();
+            }
+
             sparse[entity_index] = dense.size();
             dense.push_back(&entity);
+
+            #if IMP_ENT_VALIDATE_LISTS
+            Validate();
+            #endif
         }
 
         void Erase(Entity<Tag> &entity) noexcept override
         {
             auto entity_index = static_cast<impl::EntityHidden<Tag> &>(entity).entity_index;
             ASSERT(Robust::less(entity_index, sparse.size()), "Internal error: Entity sparse set is too small.");
-            ASSERT(sparse[entity_index] != index_t(-1), "Internal error: Entity already exists in the sparse set.");
+            ASSERT(sparse[entity_index] != index_t(-1), "Internal error: Entity doesn't exist in the sparse set.");
             std::size_t dense_index = sparse[entity_index];
             ASSERT(Robust::less(dense_index, dense.size()), "Internal error: Index in the sparse array in the entity sparse set is too small.");
 
             if constexpr (Ordered)
             {
                 sparse[entity_index] = index_t(-1);
-                dense.erase(dense.begin() + dense_index);
-                for (std::size_t i = dense_index; i < dense.size(); i++)
-                    sparse[static_cast<impl::EntityHidden<Tag> *>(dense[i])->entity_index] = i;
+                dense[dense_index] = nullptr;
+                num_tombstones++;
+
+                // Erasing the last element is common, so we pop the trailing tombstones right away.
+                while (!dense.empty() && !dense.back())
+                {
+                    dense.pop_back();
+                    num_tombstones--;
+                }
             }
             else
             {
@@ -454,33 +545,129 @@ namespace Ent
                 dense.pop_back();
             }
 
-            ASSERT(
-                sparse.size() - std::count(sparse.begin(), sparse.end(), index_t(-1)) == dense.size(),
-                "Internal error: Entity sparse set consistency check failed: Sparse and dense array sizes mismatch."
-            );
-            ASSERT(
-                std::all_of(dense.begin(), dense.end(), [&](Entity<Tag> *e)
-                {
-                    auto i = static_cast<impl::EntityHidden<Tag> *>(e)->entity_index;
-                    return i == static_cast<impl::EntityHidden<Tag> *>(dense[sparse[i]])->entity_index;
-                }),
-                "Internal error: Entity sparse set consistency check failed: Sparse and dense roundtrip failed."
-            );
+            #if IMP_ENT_VALIDATE_LISTS
+            Validate();
+            #endif
         }
 
         // Return the current list size.
         [[nodiscard]] std::size_t size() const
+        {
+            return dense.size() - num_tombstones;
+        }
+
+        // Random access, for `ParallelForEach()`. Returns the size of the dense array, which can be larger than `size()` in the ordered mode.
+        [[nodiscard]] std::size_t SlotCount() const
         {
             return dense.size();
         }
+        // Returns the element at `index`, which must be less than `SlotCount()`. Returns null for the tombstones in the ordered mode.
+        [[nodiscard]] Entity<Tag> *Slot(std::size_t index) const
+        {
+            ASSERT(index < dense.size(), "Entity sparse set index is out of range.");
+            return dense[index];
+        }
 
-        [[nodiscard]] auto begin() const {return SimpleIterator::Forward(IterState{dense.begin()});}
-        [[nodiscard]] auto end  () const {return SimpleIterator::Forward(IterState{dense.end  ()});}
+        [[nodiscard]] auto begin() const
+        {
+            IterState state{this, 0};
+            state.SkipTombstones();
+            return SimpleIterator::Forward<IterState>(state);
+        }
+        [[nodiscard]] auto end() const
+        {
+            return SimpleIterator::Forward(IterState{this, dense.size()});
+        }
     };
 
     template <TagType Tag> using SparseSetOrdered = BasicSparseSet<Tag, true>;
     template <TagType Tag> using SparseSetUnordered = BasicSparseSet<Tag, false>;
 
+    // An implemenetation of `ListBase` that groups the entities by their types.
+    // This is what `Controller::View()` uses, since all entities in a group have the same layout.
+    // The order of entities is unspecified.
+    // NOTE: Deleting an element makes the pointers/iterators that were pointing to it point to the last element of the same group.
+    template <TagType Tag>
+    class GroupedByType : public List<Tag>
+    {
+        using index_t = typename Tag::entity_index_t;
+
+      public:
+        struct Group
+        {
+            // The entity type.
+            const typename Entity<Tag>::Desc *desc = nullptr;
+            // The entities of this type.
+            std::vector<Entity<Tag> *> entities;
+        };
+
+      private:
+        // Empty groups are not removed.
+        std::vector<Group> groups;
+
+        struct Location
+        {
+            index_t group = index_t(-1);
+            index_t pos = index_t(-1);
+        };
+        std::vector<Location> sparse;
+
+        std::size_t num_entities = 0;
+
+      public:
+        void IncreaseCapacity(std::size_t new_capacity) override
+        {
+            sparse.resize(new_capacity);
+        }
+
+        void Insert(Entity<Tag> &entity) override
+        {
+            auto entity_index = static_cast<impl::EntityHidden<Tag> &>(entity).entity_index;
+            ASSERT(Robust::less(entity_index, sparse.size()), "Internal error: Entity grouped list is too small.");
+            ASSERT(sparse[entity_index].group == index_t(-1), "Internal error: Entity already exists in the grouped list.");
+
+            const typename Entity<Tag>::Desc *desc = &entity.Description();
+            auto group_iter = std::find_if(groups.begin(), groups.end(), [&](const Group &group){return group.desc == desc;});
+            if (group_iter == groups.end())
+            {
+                groups.emplace_back().desc = desc;
+                group_iter = groups.end() - 1;
+            }
+
+            group_iter->entities.push_back(&entity);
+            sparse[entity_index] = {index_t(group_iter - groups.begin()), index_t(group_iter->entities.size() - 1)};
+            num_entities++;
+        }
+
+        void Erase(Entity<Tag> &entity) noexcept override
+        {
+            auto entity_index = static_cast<impl::EntityHidden<Tag> &>(entity).entity_index;
+            ASSERT(Robust::less(entity_index, sparse.size()), "Internal error: Entity grouped list is too small.");
+            Location &loc = sparse[entity_index];
+            ASSERT(loc.group != index_t(-1), "Internal error: Entity doesn't exist in the grouped list.");
+
+            std::vector<Entity<Tag> *> &entities = groups[loc.group].entities;
+            ASSERT(entities[loc.pos] == &entity, "Internal error: Entity grouped list consistency check failed.");
+            sparse[static_cast<impl::EntityHidden<Tag> *>(entities.back())->entity_index].pos = loc.pos;
+            entities[loc.pos] = entities.back();
+            entities.pop_back();
+            loc = {};
+            num_entities--;
+        }
+
+        // Return the current list size.
+        [[nodiscard]] std::size_t size() const
+        {
+            return num_entities;
+        }
+
+        // Returns the groups, some of which can be empty.
+        [[nodiscard]] const std::vector<Group> &Groups() const
+        {
+            return groups;
+        }
+    };
+
     // An implemenetation of `ListBase` that can only hold a single entity.
     template <TagType Tag>
     class Single : public List<Tag>
@@ -530,6 +717,25 @@ namespace Ent
         {
             return cur_entity;
         }
+
+        // Returns 1 if the entity exists, 0 otherwise.
+        [[nodiscard]] std::size_t size() const
+        {
+            return cur_entity ? 1 : 0;
+        }
+
+        // Random access, for `ParallelForEach()`. Same as `size()`.
+        [[nodiscard]] std::size_t SlotCount() const
+        {
+            return size();
+        }
+        // Returns the entity. `index` must be less than `SlotCount()`, i.e. zero.
+        [[nodiscard]] Entity<Tag> *Slot(std::size_t index) const
+        {
+            (void)index;
+            ASSERT(index < SlotCount(), "Single-entity list index is out of range.");
+            return cur_entity;
+        }
     };
 
 
@@ -566,6 +772,129 @@ namespace Ent
         }
     };
 
+    namespace impl
+    {
+        // The category used by `Controller::View()`.
+        template <TagType Tag, ComponentType ...C>
+        struct ViewCategory : Category<Tag, GroupedByType, C...> {};
+    }
+
+    // A typed view of all entities having components `C...`. Returned by `Controller::View()`.
+    // Since all entities in a group have the same type, the component offsets are computed once per group, and then the components are accessed directly,
+    // without virtual calls.
+    // Creating or destroying entities while iterating is not allowed.
+    template <TagType Tag, bool IsConst, ComponentType ...C>
+    class ComponentView
+    {
+        static_assert(sizeof...(C) > 0, "Expected at least one component.");
+
+        using list_t = GroupedByType<Tag>;
+        using entity_t = std::conditional_t<IsConst, const Entity<Tag>, Entity<Tag>>;
+        template <typename T> using component_t = std::conditional_t<IsConst, const T, T>;
+        using offsets_t = std::array<std::ptrdiff_t, sizeof...(C)>;
+
+        const list_t *list = nullptr;
+
+        [[nodiscard]] static offsets_t ComputeOffsets(const Entity<Tag> &e)
+        {
+            return [&]<std::size_t ...I>(std::index_sequence<I...>)
+            {
+                return offsets_t{(reinterpret_cast<const char *>(&e.template get<C>()) - reinterpret_cast<const char *>(&e))...};
+            }(std::index_sequence_for<C...>{});
+        }
+
+        template <typename T>
+        [[nodiscard]] static component_t<T> &GetComponent(Entity<Tag> *e, std::ptrdiff_t offset)
+        {
+            return *reinterpret_cast<component_t<T> *>(reinterpret_cast<char *>(e) + offset);
+        }
+
+        struct IterState
+        {
+            typename std::vector<typename list_t::Group>::const_iterator group_iter{}, group_end{};
+            std::size_t pos = 0;
+            offsets_t offsets{};
+
+            // Skips to the first non-empty group, starting from the current one.
+            void SkipEmptyGroups()
+            {
+                while (group_iter != group_end && group_iter->entities.empty())
+                    ++group_iter;
+                if (group_iter != group_end)
+                    offsets = ComputeOffsets(*group_iter->entities.front());
+            }
+
+            bool operator==(const IterState &other) const
+            {
+                return group_iter == other.group_iter && pos == other.pos;
+            }
+
+            std::tuple<component_t<C> &...> operator()(std::false_type) const
+            {
+                Entity<Tag> *e = group_iter->entities[pos];
+                return [&]<std::size_t ...I>(std::index_sequence<I...>) -> std::tuple<component_t<C> &...>
+                {
+                    return {GetComponent<C>(e, offsets[I])...};
+                }(std::index_sequence_for<C...>{});
+            }
+
+            void operator()(std::true_type)
+            {
+                if (++pos < group_iter->entities.size())
+                    return;
+                pos = 0;
+                ++group_iter;
+                SkipEmptyGroups();
+            }
+        };
+
+      public:
+        constexpr ComponentView() {}
+        explicit ComponentView(const list_t &list) : list(&list) {}
+
+        // Calls `func` for each entity, either as `func(C &...)` or `func(Entity<Tag> &, C &...)`.
+        // This is faster than iterating with `begin()` and `end()`.
+        template <typename F>
+        void ForEach(F &&func) const
+        {
+            for (const typename list_t::Group &group : list->Groups())
+            {
+                if (group.entities.empty())
+                    continue;
+
+                offsets_t offsets = ComputeOffsets(*group.entities.front());
+                for (Entity<Tag> *e : group.entities)
+                {
+                    [&]<std::size_t ...I>(std::index_sequence<I...>)
+                    {
+                        if constexpr (std::is_invocable_v<F &, entity_t &, component_t<C> &...>)
+                            func(static_cast<entity_t &>(*e), GetComponent<C>(e, offsets[I])...);
+                        else
+                            func(GetComponent<C>(e, offsets[I])...);
+                    }(std::index_sequence_for<C...>{});
+                }
+            }
+        }
+
+        // Returns the number of entities in the view.
+        [[nodiscard]] std::size_t size() const
+        {
+            return list->size();
+        }
+
+        // Those iterators yield `std::tuple<C &...>`, use them with structured bindings.
+        [[nodiscard]] auto begin() const
+        {
+            IterState state{list->Groups().begin(), list->Groups().end()};
+            state.SkipEmptyGroups();
+            return SimpleIterator::Input<IterState>(state);
+        }
+        [[nodiscard]] auto end() const
+        {
+            return SimpleIterator::Input<IterState>(IterState{list->Groups().end(), list->Groups().end()});
+        }
+    };
+
 
     namespace impl
     {
@@ -940,6 +1269,12 @@ namespace Ent
             // Manages entity indices. Should have the same capacity as the size of `entities`.
             SparseSet<typename Tag::entity_index_t> entity_indices;
 
+            // Used by `ParallelForEach()`. Null means running on the calling thread.
+            ThreadPool *thread_pool = nullptr;
+
+            // How many `ParallelForEach()` calls are running right now. Creating and destroying entities is not allowed if this is non-zero.
+            int parallel_depth = 0;
+
             // Returns the class from which the final entity type should be inherited, based on a specific component.
             template <ComponentEntityType C>
             using incomplete_entity_t = typename Tag::template EntityAdditions<
@@ -994,6 +1329,49 @@ namespace Ent
                 }
             };
 
+            // Returns the list used by `View<C...>()`.
+            template <ComponentType ...C>
+            [[nodiscard]] const GroupedByType<Tag> &GetViewList() const
+            {
+                using category_t = impl::ViewCategory<Tag, C...>;
+                (void)impl::TypeRegistrationHelper<CategoryRegistry<Tag>>::template register_type<category_t>;
+                return static_cast<const GroupedByType<Tag> &>(*lists[CategoryRegistry<Tag>::template Index<category_t>()]);
+            }
+
+            // Calls `func(chunk, entity)` for every entity in the category, in parallel. See `ParallelForEach()`.
+            // `chunk` is the index of the chunk of `grain_size` slots, each chunk runs on a single thread.
+            template <CategoryType<Tag> C>
+            void ParallelForEachChunk(C &category, std::size_t grain_size, auto &&func)
+            {
+                ASSERT(parallel_depth == 0, "Nested `ParallelForEach()` calls on the same controller are not allowed.");
+                const auto &list = operator()(category);
+                grain_size = std::max(grain_size, std::size_t(1));
+
+                parallel_depth++;
+                FINALLY{parallel_depth--;};
+
+                std::size_t num_chunks = (list.SlotCount() + grain_size - 1) / grain_size;
+                auto VisitChunk = [&](std::size_t chunk)
+                {
+                    std::size_t end = std::min(list.SlotCount(), (chunk + 1) * grain_size);
+                    for (std::size_t i = chunk * grain_size; i < end; i++)
+                    {
+                        // Some of the slots can be null, see `BasicSparseSet`.
+                        if (Entity<Tag> *e = list.Slot(i))
+                            func(chunk, *e);
+                    }
+                };
+
+                if (!thread_pool)
+                {
+                    for (std::size_t chunk = 0; chunk < num_chunks; chunk++)
+                        VisitChunk(chunk);
+                    return;
+                }
+
+                thread_pool->ParallelFor(num_chunks, VisitChunk);
+            }
+
           public:
             explicit constexpr ControllerBase() {}
             ControllerBase(ControllerBase &&) = default;
@@ -1038,6 +1416,7 @@ namespace Ent
             // Increases capacity. Can't increase it past `MaxPossibleCapacity()`.
             void IncreaseCapacity(std::size_t new_capacity)
             {
+                ASSERT(parallel_depth == 0, "Can't change the controller capacity during `ParallelForEach()`.");
                 new_capacity = std::min(new_capacity, MaxPossibleCapacity());
 
                 if (new_capacity <= Capacity())
@@ -1055,6 +1434,8 @@ namespace Ent
             template <ComponentEntityType C, Meta::deduce..., typename ...P>
             Entity<Tag> &Create(P &&... params)
             {
+                ASSERT(parallel_depth == 0, "Can't create entities during `ParallelForEach()`, use a `CommandBuffer`.");
+
                 if (EntityCount() >= Capacity()) [[unlikely]]
                     IncreaseCapacity(Capacity() * Tag::capacity_growth_num / Tag::capacity_growth_den + 1); // Note `+ 1`. We need to be able to handle zero capacity.
 
@@ -1089,6 +1470,7 @@ namespace Ent
             // Destroys an entity.
             void Destroy(Entity<Tag> &e) noexcept
             {
+                ASSERT(parallel_depth == 0, "Can't destroy entities during `ParallelForEach()`, use a `CommandBuffer`.");
                 static_cast<impl::EntityHidden<Tag> &>(e).Destroy(*this);
             }
             // Destroys an entity. Does nothing if the pointer is null.
@@ -1113,12 +1495,82 @@ namespace Ent
                 return static_cast<impl::ListFromCategory<C> &>(*lists[CategoryRegistry<Tag>::template Index<C>()]);
             }
 
+            // The pool must outlive this controller, or be unset before it's destroyed. Pass null to run everything on the calling thread.
+            void SetThreadPool(ThreadPool *new_thread_pool) {thread_pool = new_thread_pool;}
+            [[nodiscard]] ThreadPool *GetThreadPool() const {return thread_pool;}
+
+            // Calls `func(Entity<Tag> &)` for every entity in the category, in parallel on the pool set by `SetThreadPool()`.
+            // The entities are split into chunks of `grain_size`, each chunk runs on a single thread.
+            // Blocks until everything is done. Creating and destroying entities in `func` is not allowed (this is checked by assertions),
+            // record them in a `CommandBuffer` instead. Nested calls on the same controller are not allowed either.
+            // While waiting, the calling thread can run unrelated tasks from the same pool, so don't hold any locks that those might need.
+            template <CategoryType<Tag> C, typename F>
+            requires std::invocable<F &, Entity<Tag> &>
+            void ParallelForEach(C &category, F &&func, std::size_t grain_size = 64)
+            {
+                ParallelForEachChunk(category, grain_size, [&](std::size_t chunk, Entity<Tag> &e)
+                {
+                    (void)chunk;
+                    func(e);
+                });
+            }
+
+            // Same, but each chunk gets its own copy of `initial_state`, which is passed to `func(Entity<Tag> &, State &)`.
+            // Returns the states of all chunks in order, to be combined by the caller.
+            // The states are per chunk rather than per thread, because the pool can run the chunks on any thread,
+            // including other threads that are waiting on the same pool. This also makes the result independent of the pool.
+            template <CategoryType<Tag> C, typename State, typename F>
+            requires std::invocable<F &, Entity<Tag> &, State &>
+            [[nodiscard]] std::vector<State> ParallelForEach(C &category, const State &initial_state, F &&func, std::size_t grain_size = 64)
+            {
+                grain_size = std::max(grain_size, std::size_t(1));
+
+                // Padded to avoid false sharing between the threads.
+                struct alignas(64) PaddedState
+                {
+                    State value;
+                };
+                std::vector<PaddedState> states((operator()(category).SlotCount() + grain_size - 1) / grain_size, PaddedState{initial_state});
+
+                ParallelForEachChunk(category, grain_size, [&](std::size_t chunk, Entity<Tag> &e)
+                {
+                    func(e, states[chunk].value);
+                });
+
+                std::vector<State> ret;
+                ret.reserve(states.size());
+                for (PaddedState &state : states)
+                    ret.push_back(std::move(state.value));
+                return ret;
+            }
+
+            // Returns a typed view of all entities with components `C...`. See `ComponentView` for details.
+            // Touching this for a specific set of components adds a list for it to every controller with this tag.
+            template <ComponentType ...C>
+            [[nodiscard]] ComponentView<Tag, false, C...> View()
+            {
+                return ComponentView<Tag, false, C...>(GetViewList<C...>());
+            }
+            template <ComponentType ...C>
+            [[nodiscard]] ComponentView<Tag, true, C...> View() const
+            {
+                return ComponentView<Tag, true, C...>(GetViewList<C...>());
+            }
+
+            // Returns true if the entity belongs to this controller.
+            [[nodiscard]] bool Owns(const Entity<Tag> &e) const
+            {
+                auto index = static_cast<const impl::EntityHidden<Tag> &>(e).entity_index;
+                return index < entities.size() && entities[index].ptr.get() == &e;
+            }
+
             // Forms a pointer to an entity.
             [[nodiscard]] Pointer<Tag> operator()(Entity<Tag> &e) const
             {
                 Pointer<Tag> ret;
                 ret.index = static_cast<impl::EntityHidden<Tag> &>(e).entity_index;
                 ret.generation = entities[ret.index].generation;
+                return ret;
             }
             // Forms a const pointer to an entity.
             [[nodiscard]] ConstPointer<Tag> operator()(const Entity<Tag> &e) const
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "entities/base.h"
+#include "meta/common.h"
+
+namespace Ent
+{
+    namespace impl::Commands
+    {
+        // A batch of commands of the same kind and type.
+        template <TagType Tag>
+        struct Batch
+        {
+            virtual ~Batch() = default;
+
+            // Moves the commands from `other` to the end of this batch. `other` must have the same type.
+            virtual void Append(Batch &&other) = 0;
+
+            // Applies the commands to the controller.
+            virtual void Apply(Controller<Tag> &con) = 0;
+        };
+
+        // Creates entities based on component `C`, with constructor arguments `P...`.
+        template <TagType Tag, ComponentEntityType C, typename ...P>
+        struct CreateBatch : Batch<Tag>
+        {
+            inline static const char key{};
+
+            std::vector<std::tuple<P...>> commands;
+
+            void Append(Batch<Tag> &&other) override
+            {
+                auto &other_commands = static_cast<CreateBatch &>(other).commands;
+                commands.insert(commands.end(), std::make_move_iterator(other_commands.begin()), std::make_move_iterator(other_commands.end()));
+            }
+
+            void Apply(Controller<Tag> &con) override
+            {
+                // Reserve the capacity once for the whole batch, but still grow geometrically.
+                std::size_t needed = con.EntityCount() + commands.size();
+                if (needed > con.Capacity())
+                    con.IncreaseCapacity(std::max(needed, con.Capacity() * Tag::capacity_growth_num / Tag::capacity_growth_den + 1));
+
+                for (std::tuple<P...> &params : commands)
+                    std::apply([&](P &... p){(void)con.template Create<C>(std::move(p)...);}, params);
+            }
+        };
+
+        // Assigns component `C` to entities. The expired pointers are skipped.
+        template <TagType Tag, ComponentType C>
+        struct SetBatch : Batch<Tag>
+        {
+            inline static const char key{};
+
+            std::vector<std::pair<Pointer<Tag>, C>> commands;
+
+            void Append(Batch<Tag> &&other) override
+            {
+                auto &other_commands = static_cast<SetBatch &>(other).commands;
+                commands.insert(commands.end(), std::make_move_iterator(other_commands.begin()), std::make_move_iterator(other_commands.end()));
+            }
+
+            void Apply(Controller<Tag> &con) override
+            {
+                for (auto &[pointer, value] : commands)
+                {
+                    if (Entity<Tag> *e = con(pointer))
+                        e->set(std::move(value));
+                }
+            }
+        };
+
+        // A list of batches, each with a unique key, in the order of the first use.
+        template <TagType Tag>
+        using batch_list_t = std::vector<std::pair<const void *, std::unique_ptr<Batch<Tag>>>>;
+
+        // Returns the batch of type `T` from the list, adding it if it's not there yet.
+        template <typename T, TagType Tag>
+        [[nodiscard]] T &FindOrAddBatch(batch_list_t<Tag> &list)
+        {
+            auto it = std::find_if(list.begin(), list.end(), [](const auto &elem){return elem.first == &T::key;});
+            if (it == list.end())
+            {
+                list.emplace_back(&T::key, std::make_unique<T>());
+                it = list.end() - 1;
+            }
+            return static_cast<T &>(*it->second);
+        }
+
+        // Moves all batches from `source` into `target`, merging the ones with the same keys.
+        template <TagType Tag>
+        void MergeBatchLists(batch_list_t<Tag> &target, batch_list_t<Tag> &&source)
+        {
+            for (auto &[key, batch] : source)
+            {
+                auto it = std::find_if(target.begin(), target.end(), [&](const auto &elem){return elem.first == key;});
+                if (it == target.end())
+                    target.emplace_back(key, std::move(batch));
+                else
+                    it->second->Append(std::move(*batch));
+            }
+            source.clear();
+        }
+    }
+
+    // Records entity creation, destruction and component assignments, to apply them later in one `Flush()`.
+    // This lets you change entities while iterating over the lists, and from several threads at the same time.
+    // Recording is thread-safe. The threads write to separate shards, so they rarely contend.
+    // `Flush()` must not run at the same time as recording, or while iterating over the lists of the controller.
+    // The commands are applied in the following order: first the component assignments, then the destructions, then the creations.
+    // The order of the commands of the same kind and type recorded on the same thread is preserved, but otherwise the order is unspecified.
+    template <TagType Tag>
+    class CommandBuffer
+    {
+        static constexpr std::size_t num_shards = 16;
+
+        struct Shard
+        {
+            mutable std::mutex mutex;
+            std::vector<Pointer<Tag>> destroys;
+            impl::Commands::batch_list_t<Tag> sets;
+            impl::Commands::batch_list_t<Tag> creates;
+        };
+
+        Controller<Tag> *con = nullptr;
+        std::array<Shard, num_shards> shards;
+
+        // Returns the shard for the current thread.
+        [[nodiscard]] Shard &ThisShard()
+        {
+            static std::atomic<std::size_t> counter = 0;
+            thread_local std::size_t index = counter++ % num_shards;
+            return shards[index];
+        }
+
+      public:
+        explicit CommandBuffer(Controller<Tag> &con) : con(&con) {}
+
+        CommandBuffer(const CommandBuffer &) = delete;
+        CommandBuffer &operator=(const CommandBuffer &) = delete;
+
+        // Records creating an entity based on component `C`. The parameters are decay-copied.
+        template <ComponentEntityType C, Meta::deduce..., typename ...P>
+        void Create(P &&... params)
+        {
+            using batch_t = impl::Commands::CreateBatch<Tag, C, std::decay_t<P>...>;
+            Shard &shard = ThisShard();
+            std::lock_guard lock(shard.mutex);
+            impl::Commands::FindOrAddBatch<batch_t>(shard.creates).commands.emplace_back(std::forward<P>(params)...);
+        }
+
+        // Records destroying an entity. Null and expired pointers are ignored when flushing.
+        // Destroying the same entity several times is allowed.
+        void Destroy(const Pointer<Tag> &p)
+        {
+            if (!p.IsSet())
+                return;
+            Shard &shard = ThisShard();
+            std::lock_guard lock(shard.mutex);
+            shard.destroys.push_back(p);
+        }
+        // Records destroying an entity.
+        void Destroy(Entity<Tag> &e)
+        {
+            Destroy((*con)(e));
+        }
+
+        // Records assigning a component to an entity. Expired pointers are ignored when flushing.
+        // Throws when flushing if the entity doesn't have this component.
+        template <ComponentType C>
+        void Set(const Pointer<Tag> &p, C value)
+        {
+            if (!p.IsSet())
+                return;
+            Shard &shard = ThisShard();
+            std::lock_guard lock(shard.mutex);
+            impl::Commands::FindOrAddBatch<impl::Commands::SetBatch<Tag, C>>(shard.sets).commands.emplace_back(p, std::move(value));
+        }
+        // Records assigning a component to an entity.
+        template <ComponentType C>
+        void Set(Entity<Tag> &e, C value)
+        {
+            Set((*con)(e), std::move(value));
+        }
+
+        // Applies and removes all recorded commands.
+        // The buffer is emptied before applying anything, so if one of the commands throws, the remaining ones are lost.
+        void Flush()
+        {
+            std::vector<Pointer<Tag>> destroys;
+            impl::Commands::batch_list_t<Tag> sets, creates;
+
+            for (Shard &shard : shards)
+            {
+                std::lock_guard lock(shard.mutex);
+                destroys.insert(destroys.end(), shard.destroys.begin(), shard.destroys.end());
+                shard.destroys.clear();
+                impl::Commands::MergeBatchLists(sets, std::move(shard.sets));
+                impl::Commands::MergeBatchLists(creates, std::move(shard.creates));
+            }
+
+            for (auto &elem : sets)
+                elem.second->Apply(*con);
+
+            if (!destroys.empty())
+            {
+                // Resolve the pointers first, then group the entities by type, so the same lists are updated in a row.
+                // The types are ordered by their first appearance, and the entities within a type by their indices,
+                // rather than by addresses, to keep the resulting list order reproducible. This also removes the duplicates.
+                struct DestroyedEntity
+                {
+                    std::size_t group = 0;
+                    typename Tag::entity_index_t index = 0;
+                    Entity<Tag> *entity = nullptr;
+                };
+                std::vector<const typename Entity<Tag>::Desc *> groups;
+                std::vector<DestroyedEntity> entities;
+                entities.reserve(destroys.size());
+                for (const Pointer<Tag> &p : destroys)
+                {
+                    Entity<Tag> *e = (*con)(p);
+                    if (!e)
+                        continue;
+                    const typename Entity<Tag>::Desc *desc = &e->Description();
+                    std::size_t group = std::size_t(std::find(groups.begin(), groups.end(), desc) - groups.begin());
+                    if (group == groups.size())
+                        groups.push_back(desc);
+                    entities.push_back({group, p.GetIndex(), e});
+                }
+                std::sort(entities.begin(), entities.end(), [](const DestroyedEntity &a, const DestroyedEntity &b)
+                {
+                    return std::tie(a.group, a.index) < std::tie(b.group, b.index);
+                });
+                entities.erase(std::unique(entities.begin(), entities.end(), [](const DestroyedEntity &a, const DestroyedEntity &b){return a.index == b.index;}), entities.end());
+
+                for (const DestroyedEntity &elem : entities)
+                    con->Destroy(*elem.entity);
+            }
+
+            for (auto &elem : creates)
+                elem.second->Apply(*con);
+        }
+
+        // Returns true if there are no recorded commands.
+        // Shouldn't be called at the same time as recording.
+        [[nodiscard]] bool IsEmpty() const
+        {
+            for (const Shard &shard : shards)
+            {
+                std::lock_guard lock(shard.mutex);
+                if (!shard.destroys.empty() || !shard.sets.empty() || !shard.creates.empty())
+                    return false;
+            }
+            return true;
+        }
+    };
+}
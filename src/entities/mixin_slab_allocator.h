@@ -0,0 +1,339 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "entities/base.h"
+#include "macros/finally.h"
+#include "meta/common.h"
+#include "meta/type_info.h"
+#include "program/errors.h"
+
+namespace Ent::Mixins
+{
+    // Allocation statistics for a single entity type. See `SlabAllocator::SlabStatistics()`.
+    struct SlabStatistics
+    {
+        // The entity type name.
+        std::string_view type_name;
+
+        // The size of a single entity.
+        std::size_t object_size = 0;
+
+        // The number of live entities, and the max number of entities that were alive at once.
+        std::size_t live_objects = 0;
+        std::size_t peak_objects = 0;
+
+        // Same, but in bytes.
+        std::size_t live_bytes = 0;
+        std::size_t peak_bytes = 0;
+
+        // The total size of the chunks allocated for this type. Chunks are never freed.
+        std::size_t chunk_bytes = 0;
+    };
+
+    namespace impl::SlabAllocator
+    {
+        template <TagType Tag>
+        class Pool;
+
+        // Sits at the beginning of every chunk.
+        // Chunks are aligned to their size, so any object pointer can be rounded down to find its chunk.
+        template <TagType Tag>
+        struct ChunkHeader
+        {
+            Pool<Tag> *pool = nullptr;
+
+            // One bit per slot, set if the slot has a live object in it.
+            // Points into the same chunk, right after the header.
+            std::uint64_t *occupied = nullptr;
+        };
+
+        // A slab for a single entity type.
+        // This part doesn't depend on the type, the typed parts are in `TypedPool` below.
+        template <TagType Tag>
+        class Pool
+        {
+          protected:
+            std::string_view type_name;
+            const typename Entity<Tag>::Desc *desc = nullptr;
+            Entity<Tag> *(*to_entity)(void *object) = nullptr;
+
+            std::size_t slot_size = 0;
+            std::size_t slot_offset = 0; // Relative to the chunk start.
+            std::size_t slots_per_chunk = 0;
+
+            // Sorted by address.
+            std::vector<ChunkHeader<Tag> *> chunks;
+
+            // The free slots form a singly linked list, the next pointer is stored in the slot itself.
+            void *free_list = nullptr;
+
+            std::size_t live_objects = 0;
+            std::size_t peak_objects = 0;
+
+            Pool() {}
+
+            // Don't free the chunks, the entities can outlive the pool during static destruction.
+            ~Pool() = default;
+
+            [[nodiscard]] static ChunkHeader<Tag> *GetChunk(void *object)
+            {
+                return reinterpret_cast<ChunkHeader<Tag> *>(reinterpret_cast<std::uintptr_t>(object) & ~std::uintptr_t(Tag::slab_chunk_size - 1));
+            }
+
+            [[nodiscard]] std::size_t SlotIndex(const ChunkHeader<Tag> *chunk, const void *object) const
+            {
+                return std::size_t(static_cast<const char *>(object) - reinterpret_cast<const char *>(chunk) - slot_offset) / slot_size;
+            }
+
+            [[nodiscard]] void *SlotPtr(ChunkHeader<Tag> *chunk, std::size_t i) const
+            {
+                return reinterpret_cast<char *>(chunk) + slot_offset + i * slot_size;
+            }
+
+            // Allocates a new chunk and adds its slots to the free list.
+            void AddChunk()
+            {
+                void *memory = ::operator new(Tag::slab_chunk_size, std::align_val_t(Tag::slab_chunk_size));
+                FINALLY_ON_THROW{::operator delete(memory, std::align_val_t(Tag::slab_chunk_size));};
+
+                auto chunk = ::new(memory) ChunkHeader<Tag>;
+                chunk->pool = this;
+                chunk->occupied = ::new(static_cast<char *>(memory) + sizeof(ChunkHeader<Tag>)) std::uint64_t[(slots_per_chunk + 63) / 64]{};
+
+                chunks.insert(std::upper_bound(chunks.begin(), chunks.end(), chunk, std::less{}), chunk);
+
+                // In reverse order, to hand out the slots in the address order.
+                for (std::size_t i = slots_per_chunk; i-- > 0;)
+                {
+                    void *slot = SlotPtr(chunk, i);
+                    *static_cast<void **>(slot) = free_list;
+                    free_list = slot;
+                }
+            }
+
+            // Returns an uninitialized slot.
+            [[nodiscard]] void *AllocateSlot()
+            {
+                if (!free_list) [[unlikely]]
+                    AddChunk();
+
+                void *ret = free_list;
+                free_list = *static_cast<void **>(ret);
+                return ret;
+            }
+
+            // Returns a slot to the free list, without touching the occupancy bits and counters.
+            void ReturnSlot(void *slot) noexcept
+            {
+                *static_cast<void **>(slot) = free_list;
+                free_list = slot;
+            }
+
+            void MarkOccupied(void *object, bool occupied) noexcept
+            {
+                ChunkHeader<Tag> *chunk = GetChunk(object);
+                std::size_t i = SlotIndex(chunk, object);
+                std::uint64_t mask = std::uint64_t(1) << (i % 64);
+                ASSERT(bool(chunk->occupied[i / 64] & mask) != occupied, "Slab occupancy bit is already in the requested state.");
+                if (occupied)
+                    chunk->occupied[i / 64] |= mask;
+                else
+                    chunk->occupied[i / 64] &= ~mask;
+            }
+
+          public:
+            Pool(const Pool &) = delete;
+            Pool &operator=(const Pool &) = delete;
+
+            // All pools created for this tag, in the order of creation.
+            [[nodiscard]] static std::vector<Pool *> &AllPools()
+            {
+                static std::vector<Pool *> ret;
+                return ret;
+            }
+
+            // Destroys `memory` and frees its slot. `memory` can point to a base class of the actual allocated object.
+            template <typename T>
+            static void Free(T *memory) noexcept
+            {
+                void *object;
+                if constexpr (std::is_polymorphic_v<T>)
+                    object = dynamic_cast<void *>(memory);
+                else
+                    object = memory;
+
+                Pool &self = *GetChunk(object)->pool;
+
+                memory->~T();
+
+                self.MarkOccupied(object, false);
+                self.ReturnSlot(object);
+                self.live_objects--;
+            }
+
+            // Returns true if the entities of this type belong to `category`.
+            [[nodiscard]] bool BelongsTo(const Ent::impl::CategoryBase<Tag> &category) const
+            {
+                return category.ShouldContain(*desc);
+            }
+
+            // Calls `func(Entity<Tag> &)` for every live object, in the address order.
+            void ForEach(auto &&func) const
+            {
+                for (ChunkHeader<Tag> *chunk : chunks)
+                {
+                    for (std::size_t word = 0; word < (slots_per_chunk + 63) / 64; word++)
+                    {
+                        // Copy the word, in case `func` destroys the entity.
+                        std::uint64_t bits = chunk->occupied[word];
+                        while (bits)
+                        {
+                            std::size_t i = word * 64 + std::size_t(std::countr_zero(bits));
+                            bits &= bits - 1;
+                            func(*to_entity(SlotPtr(chunk, i)));
+                        }
+                    }
+                }
+            }
+
+            [[nodiscard]] SlabStatistics Statistics() const
+            {
+                SlabStatistics ret;
+                ret.type_name = type_name;
+                ret.object_size = slot_size;
+                ret.live_objects = live_objects;
+                ret.peak_objects = peak_objects;
+                ret.live_bytes = live_objects * slot_size;
+                ret.peak_bytes = peak_objects * slot_size;
+                ret.chunk_bytes = chunks.size() * Tag::slab_chunk_size;
+                return ret;
+            }
+        };
+
+        // A slab for entity type `T`.
+        template <TagType Tag, typename T>
+        class TypedPool : public Pool<Tag>
+        {
+            static_assert(std::has_single_bit(Tag::slab_chunk_size), "The slab chunk size must be a power of two.");
+
+            static constexpr std::size_t header_size = sizeof(ChunkHeader<Tag>);
+            static constexpr std::size_t object_size = sizeof(T) < sizeof(void *) ? sizeof(void *) : sizeof(T);
+            static_assert(alignof(T) >= alignof(void *), "The free list pointers are stored in the free slots.");
+
+            // Returns the offset of the first slot in a chunk with `n` slots.
+            [[nodiscard]] static constexpr std::size_t SlotOffset(std::size_t n)
+            {
+                std::size_t ret = header_size + (n + 63) / 64 * sizeof(std::uint64_t);
+                return (ret + alignof(T) - 1) / alignof(T) * alignof(T);
+            }
+
+            static constexpr std::size_t num_slots = []{
+                std::size_t n = Tag::slab_chunk_size / object_size;
+                while (n > 0 && SlotOffset(n) + n * object_size > Tag::slab_chunk_size)
+                    n--;
+                return n;
+            }();
+            static_assert(num_slots > 0, "The entity type is too large for a slab chunk. Increase `slab_chunk_size` in the tag.");
+
+            TypedPool()
+            {
+                this->type_name = Meta::TypeName<T>();
+                static const typename T::EntityDesc desc;
+                this->desc = &desc;
+                this->to_entity = [](void *object) -> Entity<Tag> * {return static_cast<T *>(object);};
+                this->slot_size = object_size;
+                this->slot_offset = SlotOffset(num_slots);
+                this->slots_per_chunk = num_slots;
+                Pool<Tag>::AllPools().push_back(this);
+            }
+
+          public:
+            // Returns the singleton. It's never destroyed, see the comment on `~Pool()`.
+            [[nodiscard]] static TypedPool &Get()
+            {
+                static TypedPool &ret = *new TypedPool;
+                return ret;
+            }
+
+            template <typename ...P>
+            [[nodiscard]] T *Allocate(P &&... params)
+            {
+                void *slot = this->AllocateSlot();
+                FINALLY_ON_THROW{this->ReturnSlot(slot);};
+                T *ret = ::new(slot) T(std::forward<P>(params)...);
+
+                this->MarkOccupied(slot, true);
+                this->live_objects++;
+                if (this->live_objects > this->peak_objects)
+                    this->peak_objects = this->live_objects;
+                return ret;
+            }
+        };
+    }
+
+    // Allocates the entities from per-type slabs, instead of using the global `new`.
+    // Each entity type gets its own chunks of `slab_chunk_size` bytes (aligned to their size), with a free list of slots.
+    // This makes spawning and destroying entities cheap, and keeps the entities of the same type close to each other in memory.
+    // The freed slots are reused in the LIFO order. The chunks are never returned to the system.
+    // The slabs are per tag, not per controller, so the controllers sharing a tag must not be used from different threads at the same time.
+    template <typename FinalTag, typename BaseMixin>
+    struct SlabAllocator : BaseMixin
+    {
+        // The slab chunk size in bytes, must be a power of two. Can be overridden in the final tag.
+        static constexpr std::size_t slab_chunk_size = 64 * 1024;
+
+        template <typename T, Meta::deduce..., typename ...P>
+        [[nodiscard]] static T *Allocate(Ent::impl::MemoryManagementTag, P &&... params)
+        {
+            return impl::SlabAllocator::TypedPool<FinalTag, T>::Get().Allocate(std::forward<P>(params)...);
+        }
+
+        template <Meta::deduce..., typename T>
+        static void Free(Ent::impl::MemoryManagementTag, T *memory) noexcept
+        {
+            impl::SlabAllocator::Pool<FinalTag>::Free(memory);
+        }
+
+        template <typename Base>
+        struct ControllerAdditions : BaseMixin::template ControllerAdditions<Base>
+        {
+            using BaseMixin::template ControllerAdditions<Base>::ControllerAdditions;
+
+            // Calls `func(Entity<FinalTag> &)` for each entity in the category, walking the slabs of each entity type in the address order.
+            // Unlike iterating over the list, this touches the memory sequentially.
+            // Destroying the current entity in `func` is allowed, but creating entities isn't.
+            // The slabs are shared by all controllers with the same tag, the entities of other controllers are skipped.
+            template <CategoryType<FinalTag> C>
+            void ForEachInSlabOrder(C &category, auto &&func) const
+            {
+                for (const impl::SlabAllocator::Pool<FinalTag> *pool : impl::SlabAllocator::Pool<FinalTag>::AllPools())
+                {
+                    if (!pool->BelongsTo(category))
+                        continue;
+                    pool->ForEach([&](Entity<FinalTag> &e)
+                    {
+                        if (this->Owns(e))
+                            func(e);
+                    });
+                }
+            }
+
+            // Returns the allocation statistics for each entity type that was allocated at least once.
+            [[nodiscard]] static std::vector<SlabStatistics> SlabAllocatorStatistics()
+            {
+                std::vector<SlabStatistics> ret;
+                for (const impl::SlabAllocator::Pool<FinalTag> *pool : impl::SlabAllocator::Pool<FinalTag>::AllPools())
+                    ret.push_back(pool->Statistics());
+                return ret;
+            }
+        };
+    };
+}
@@ -28,10 +28,13 @@ const TileInfo &GetTileInfo(Tile tile)
     return tile_info[int(tile)];
 }
 
+// If enabled, every bitmap collision test is cross-checked against the pointwise one. This is very slow.
+#ifndef IMP_GRID_VALIDATE_BITMAP_COLLISIONS
+#define IMP_GRID_VALIDATE_BITMAP_COLLISIONS 0
+#endif
+
 namespace TileHitboxes
 {
-    static constexpr int highres_tile_size = tile_size * highres_factor;
-
     // On the diagnoals, we create points sparsely (with `highres_factor` as the step).
     // This looks safe, but if something goes wrong, there's non-sparse version in the git history.
     static const std::vector<std::vector<ivec2>> hitbox_point_patterns_HighRes = {
@@ -146,6 +149,88 @@ namespace TileHitboxes
         throw std::runtime_error("Invalid corner id.");
     }
 
+    ivec2 TileRowRangeHighRes(int corner, int y)
+    {
+        // Must agree with `TileCollidesWithPointHighRes()`.
+        switch (corner)
+        {
+          case -2:
+            return ivec2(0, 0);
+          case -1:
+            return ivec2(0, highres_tile_size);
+          case 0:
+            return ivec2(0, highres_tile_size - 1 - y);
+          case 1:
+            return ivec2(y + 1, highres_tile_size);
+          case 2:
+            return ivec2(highres_tile_size - y, highres_tile_size);
+          case 3:
+            return ivec2(0, y);
+        }
+        throw std::runtime_error("Invalid corner id.");
+    }
+
+    std::optional<float> RayCastTile(int corner, fvec2 origin, fvec2 dir, float t_begin, float t_end)
+    {
+        // The tile is where `normal.dot(point) <= offset`. Must agree with `TileCollidesWithPointHighRes()`.
+        fvec2 normal;
+        float offset = 0;
+        switch (corner)
+        {
+          case -2:
+            return {};
+          case -1:
+            if (t_begin >= t_end)
+                return {};
+            return t_begin;
+          case 0:
+            normal = fvec2(1, 1);
+            offset = tile_size;
+            break;
+          case 1:
+            normal = fvec2(-1, 1);
+            break;
+          case 2:
+            normal = fvec2(-1, -1);
+            offset = -tile_size;
+            break;
+          case 3:
+            normal = fvec2(1, -1);
+            break;
+          default:
+            throw std::runtime_error("Invalid corner id.");
+        }
+
+        // Find the range of `t` in which the ray is inside of the tile.
+        float dist = normal.dot(origin + dir * t_begin) - offset;
+        float speed = normal.dot(dir);
+        float t_a = t_begin, t_b = t_end;
+        if (speed == 0)
+        {
+            if (dist > 0)
+                return {};
+        }
+        else
+        {
+            float t_cross = t_begin - dist / speed;
+            if (speed < 0)
+                clamp_var_min(t_a, t_cross);
+            else
+                clamp_var_max(t_b, t_cross);
+        }
+
+        if (t_a >= t_b)
+            return {};
+        return t_a;
+    }
+
+    int RotateCorner(int corner, int steps)
+    {
+        if (corner < 0)
+            return corner;
+        return mod_ex(corner + steps, 4);
+    }
+
     bool CornerHasEdge(int corner, int dir)
     {
         dir = mod_ex(dir, 4);
@@ -173,43 +258,43 @@ void Grid::Resize(ivec2 offset, ivec2 new_size)
         new_size = {};
 
     // Realign position to avoid visual movement.
-    xf.pos += xf.Matrix() * (-offset * tile_size + new_size * tile_size / 2 - cells.size() * tile_size / 2);
+    xf.pos += xf.Matrix() * (-offset * tile_size + new_size * tile_size / 2 - size * tile_size / 2);
 
-    cells.resize(new_size, offset);
+    bool size_changed = new_size != size;
+    size = new_size;
 
-    { // Trim hitbox points outside of the new rect, and offset the remaining points.
-        // If this is true, we copy the map to a new location to offset the points, ignoring the out-of-range points.
-        // Otherwise we remove the out-of-range points in place.
-        bool need_offset = offset != 0;
+    BumpEditGeneration();
 
-        for (auto *map : {&hitbox_points_full, &hitbox_points_min})
-        {
-            phmap::flat_hash_map<ivec2, int> new_map;
-            if (need_offset)
-                new_map.reserve(map->size());
+    if (IsEmpty())
+    {
+        chunks.clear();
+        storage_offset = {};
+        tiles_with_lost_edges.clear();
+        return;
+    }
 
-            for (auto it = map->begin(); it != map->end();)
-            {
-                ivec2 rel_pos = it->first + offset;
-                if (rel_pos(any) < 0 || rel_pos(any) >= new_size)
-                {
-                    if (need_offset)
-                        it++;
-                    else
-                        it = map->erase(it);
-                }
-                else
-                {
-                    if (need_offset)
-                        new_map.try_emplace(rel_pos, it->second);
+    for (ivec2 &tile : tiles_with_lost_edges)
+        tile += offset;
 
-                    ++it;
-                }
-            }
+    if (chunked)
+    {
+        // The tiles stay where they are, only the grid space moves.
+        storage_offset -= offset;
+        return;
+    }
 
-            if (need_offset)
-                *map = std::move(new_map);
-        }
+    Chunk &chunk = chunks[ivec2()];
+    chunk.cells.resize(new_size, offset);
+
+    chunk.hitbox_points_full.Resize(new_size, offset);
+    chunk.hitbox_points_min.Resize(new_size, offset);
+
+    chunk.nonempty_b = new_size;
+
+    if (size_changed || offset != 0)
+    {
+        RegenerateBitmaps(chunk);
+        chunk.mesh_blocks = {};
     }
 }
 
@@ -218,6 +303,36 @@ ivec2 Grid::Trim()
     if (IsEmpty())
         return {}; // No cells.
 
+    if (chunked)
+    {
+        if (chunks.empty())
+        {
+            // All cells are empty.
+            size = {};
+            storage_offset = {};
+            return {};
+        }
+
+        ivec2 a = ivec2(std::numeric_limits<int>::max());
+        ivec2 b = ivec2(std::numeric_limits<int>::min());
+        for (const auto &[index, chunk] : chunks)
+        {
+            a = min(a, chunk.pos + chunk.nonempty_a);
+            b = max(b, chunk.pos + chunk.nonempty_b);
+        }
+        a -= storage_offset;
+        b -= storage_offset;
+
+        if (a == ivec2() && b == size)
+            return {}; // No changes needed.
+
+        Resize(-a, b - a);
+
+        return a;
+    }
+
+    const Array2D<Cell> &cells = chunks.at(ivec2()).cells;
+
     int top = 0;
     for (; top < cells.size().y; top++)
     {
@@ -237,7 +352,8 @@ ivec2 Grid::Trim()
     if (top >= cells.size().y)
     {
         // All cells are empty.
-        cells = {};
+        chunks.clear();
+        size = {};
         return {};
     }
 
@@ -297,34 +413,346 @@ ivec2 Grid::Trim()
     return ivec2(left, top);
 }
 
-void Grid::RegenerateHitboxPointsInRect(ivec2 pos, ivec2 size)
+int Grid::TileEdgeMask(ivec2 pos) const
 {
-    // Update the full hitbox.
-    for (ivec2 tile_pos : vector_range(size) + pos)
+    int corner = GetCell(pos).mid.Info().corner;
+    int ret = 0;
+    for (int i = 0; i < 4; i++)
     {
-        int mask = TileHitboxes::GetHitboxPointsMaskFull(cells.safe_throwing_at(tile_pos).mid.Info().corner);
-        if (mask == 0)
-            hitbox_points_full.erase(tile_pos);
-        else
-            hitbox_points_full.insert_or_assign(tile_pos, mask);
+        if (TileHitboxes::CornerHasEdge(corner, i))
+            ret |= 1 << i;
     }
+    return ret;
+}
 
-    // Update the minimal hitbox.
-    for (ivec2 tile_pos : clamp_min(pos - 1) <= vector_range < clamp_max(pos + size + 1, cells.size()))
+Grid::ModifyRegionState Grid::BeginModifyRegion(ivec2 pos, ivec2 size)
+{
+    ModifyRegionState ret;
+    ret.pos = pos;
+    ret.size = size;
+
+    // Determine the starting mass and edges of the region.
+    ret.edges_pos = clamp_min(pos, 0);
+    ret.edges_size = clamp_min(clamp_max(pos + size, this->size) - ret.edges_pos, 0);
+    ret.starting_edges.reserve(std::size_t(ret.edges_size.prod()));
+    for (ivec2 tile_pos : ret.edges_pos <= vector_range < ret.edges_pos + ret.edges_size)
+    {
+        ret.starting_mass += GetCell(tile_pos).Mass();
+        ret.starting_edges.push_back(std::uint8_t(TileEdgeMask(tile_pos)));
+    }
+
+    // Only the edits touching the borders can make the grid smaller.
+    ret.should_trim = pos(any) <= 0 || (pos + size)(any) >= this->size;
+    ret.offset = clamp_min(-pos, 0);
+    Resize(ret.offset, max(clamp_min(pos, 0) + size, ret.offset + this->size));
+
+    return ret;
+}
+
+Cell &Grid::CellForModification(ModifyRegionState &state, ivec2 target)
+{
+    ivec2 storage_pos = target + state.pos + state.offset + storage_offset;
+
+    ivec2 index = ChunkIndex(storage_pos);
+    if (!state.chunk || state.chunk_index != index)
+    {
+        // Note that adding chunks can move the other chunks, but not their cells.
+        auto it = chunks.find(index);
+        state.chunk = it != chunks.end() ? &it->second : &AddChunk(index);
+        state.chunk_index = index;
+    }
+
+    return state.chunk->cells.safe_nonthrowing_at(storage_pos - state.chunk->pos);
+}
+
+void Grid::EndModifyRegion(const ModifyRegionState &state)
+{
+    // Remember the tiles that lost some edges, for `SplitDisconnectedParts()`. This must happen before trimming, which moves the grid space.
+    auto starting_edges = state.starting_edges.begin();
+    for (ivec2 tile_pos : state.edges_pos + state.offset <= vector_range < state.edges_pos + state.offset + state.edges_size)
+    {
+        if (*starting_edges++ & ~TileEdgeMask(tile_pos))
+            tiles_with_lost_edges.push_back(tile_pos);
+    }
+
+    ivec2 pos = state.pos + state.offset;
+    ivec2 size = state.size;
+
+    // In the chunked mode trimming is cheap, so we do it last, after removing the empty chunks.
+    if (!chunked && state.should_trim)
+        pos -= Trim();
+
+    ivec2 clamped_pos = clamp_min(pos);
+    size -= clamped_pos - pos;
+    pos = clamped_pos;
+    clamp_var_max(size, this->size - pos);
+
+    // Update the hitbox points.
+    if (size(all) >= 0) // Sic. Since it updates a 1-tile border around the rect, empty rects are workable too.
+        RegenerateHitboxPointsInRect(pos, size);
+
+    // Update the mass.
+    mass -= state.starting_mass;
+    for (ivec2 tile_pos : pos <= vector_range < pos + size)
+        mass += GetCell(tile_pos).Mass();
+
+    InvalidateMeshesInRect(pos, pos + size);
+    BumpEditGeneration();
+
+    if (chunked)
+    {
+        // Remove the chunks that became empty.
+        std::vector<ivec2> empty_chunks;
+        ForEachChunkInRect(*this, pos, pos + size, [&](Chunk &chunk)
+        {
+            UpdateChunkBounds(chunk);
+            if (chunk.nonempty_a(any) >= chunk.nonempty_b)
+                empty_chunks.push_back(div_ex(chunk.pos, chunk_size));
+            return false;
+        });
+        for (ivec2 index : empty_chunks)
+            chunks.erase(index);
+
+        if (state.should_trim)
+            Trim();
+    }
+}
+
+const Grid::Chunk *Grid::FindChunk(ivec2 storage_pos) const
+{
+    auto it = chunks.find(ChunkIndex(storage_pos));
+    return it == chunks.end() ? nullptr : &it->second;
+}
+
+Grid::Chunk &Grid::AddChunk(ivec2 index)
+{
+    ASSERT(chunked, "Only the chunked grids can have more than one chunk.");
+
+    Chunk &chunk = chunks[index];
+    chunk.pos = index * chunk_size;
+    chunk.cells = Array2D<Cell>(ivec2(chunk_size));
+    chunk.hitbox_points_full.Resize(ivec2(chunk_size), ivec2());
+    chunk.hitbox_points_min.Resize(ivec2(chunk_size), ivec2());
+    RegenerateBitmaps(chunk);
+    return chunk;
+}
+
+template <typename G, typename F>
+bool Grid::ForEachChunkInRect(G &grid, ivec2 a, ivec2 b, F &&func)
+{
+    clamp_var_min(a, 0);
+    clamp_var_max(b, grid.size);
+    if (a(any) >= b)
+        return false;
+
+    ivec2 index_a = grid.ChunkIndex(a + grid.storage_offset);
+    ivec2 index_b = grid.ChunkIndex(b - 1 + grid.storage_offset) + 1;
+
+    if ((index_b - index_a).prod() > int(grid.chunks.size()))
     {
-        int mask = TileHitboxes::GetHitboxPointsMaskPartial(cells.safe_throwing_at(tile_pos).mid.Info().corner,
-            [&](ivec2 offset)
+        // The rect is large, iterate over all existing chunks instead.
+        for (auto &[index, chunk] : grid.chunks)
+        {
+            if (index(all) >= index_a && index(all) < index_b && func(chunk))
+                return true;
+        }
+    }
+    else
+    {
+        for (ivec2 index : index_a <= vector_range < index_b)
+        {
+            auto it = grid.chunks.find(index);
+            if (it != grid.chunks.end() && func(it->second))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+template <typename F>
+bool Grid::ForEachChunkPair(const Grid &source, const Grid &target, Xf target_to_source, ivec2 path_a, ivec2 path_b, F &&func)
+{
+    if (source.chunks.empty() || target.chunks.empty())
+        return false;
+
+    // Without chunks there's nothing to cull, the bitmap tests are bounded anyway.
+    if (!source.chunked && !target.chunked)
+        return func(source.chunks.begin()->second, target.chunks.begin()->second, target_to_source);
+
+    constexpr int ts = TileHitboxes::highres_tile_size;
+
+    // Transforms a rect with a pixel-centered transform. The second corner is exclusive.
+    auto TransformRect = [](Xf rect_xf, ivec2 a, ivec2 b)
+    {
+        auto [ret_a, ret_b] = sort_two(rect_xf.TransformPixelCenteredPoint(a), rect_xf.TransformPixelCenteredPoint(b - 1));
+        return std::pair(ret_a, ret_b + 1);
+    };
+
+    ivec2 path_min = min(path_a, path_b);
+    ivec2 path_max = max(path_a, path_b);
+
+    // The part of the source that the target can touch, in the high-res source grid space.
+    auto [target_a, target_b] = TransformRect(target_to_source, ivec2(), target.size * ts);
+    ivec2 overlap_a = max(target_a + path_min, ivec2());
+    ivec2 overlap_b = min(target_b + path_max, source.size * ts);
+    if (overlap_a(any) >= overlap_b)
+        return false;
+
+    Xf source_to_target = target_to_source.Inverse();
+
+    return ForEachChunkInRect(source, div_ex(overlap_a, ts), div_ex(overlap_b - 1, ts) + 1, [&](const Chunk &source_chunk)
+    {
+        ivec2 source_chunk_pos = (source_chunk.pos - source.storage_offset) * ts;
+        ivec2 a = max(overlap_a, source_chunk_pos + source_chunk.nonempty_a * ts);
+        ivec2 b = min(overlap_b, source_chunk_pos + source_chunk.nonempty_b * ts);
+        if (a(any) >= b)
+            return false;
+
+        // The part of the target that can touch this source chunk, in the high-res target grid space.
+        auto [part_a, part_b] = TransformRect(source_to_target, a - path_max, b - path_min);
+
+        return ForEachChunkInRect(target, div_ex(part_a, ts), div_ex(part_b - 1, ts) + 1, [&](const Chunk &target_chunk)
+        {
+            ivec2 target_chunk_pos = (target_chunk.pos - target.storage_offset) * ts;
+            if (max(part_a, target_chunk_pos + target_chunk.nonempty_a * ts)(any) >= min(part_b, target_chunk_pos + target_chunk.nonempty_b * ts))
+                return false;
+
+            return func(source_chunk, target_chunk, Xf::Pos(-source_chunk_pos) * target_to_source * Xf::Pos(target_chunk_pos));
+        });
+    });
+}
+
+void Grid::RegenerateHitboxPointsInRect(ivec2 pos, ivec2 size, bool update_bitmaps)
+{
+    // Update the full hitbox.
+    ForEachChunkInRect(*this, pos, pos + size, [&](Chunk &chunk)
+    {
+        ivec2 chunk_pos = chunk.pos - storage_offset;
+        ivec2 a = max(pos - chunk_pos, ivec2());
+        ivec2 b = min(pos + size - chunk_pos, chunk.cells.size());
+
+        chunk.hitbox_points_full.ModifyRect(a, b - a, [&](ivec2 tile_pos)
+        {
+            int mask = TileHitboxes::GetHitboxPointsMaskFull(chunk.cells.safe_throwing_at(tile_pos).mid.Info().corner);
+
+            if (update_bitmaps)
             {
-                ivec2 this_pos = tile_pos + offset;
-                if (!cells.pos_in_range(this_pos))
-                    return 0;
-                return TileHitboxes::GetHitboxPointsMaskPossibleMin(cells.safe_throwing_at(this_pos).mid.Info().corner);
+                UpdateTileInHitboxBitmap(chunk.hitbox_bitmap_full, tile_pos, mask);
+                UpdateTileInOccupancyBitmaps(chunk, tile_pos);
             }
-        );
-        if (mask == 0)
-            hitbox_points_min.erase(tile_pos);
-        else
-            hitbox_points_min.insert_or_assign(tile_pos, mask);
+            return mask;
+        });
+        return false;
+    });
+
+    // Update the minimal hitbox.
+    ivec2 min_rect_a = clamp_min(pos - 1);
+    ivec2 min_rect_b = clamp_max(pos + size + 1, this->size);
+    ForEachChunkInRect(*this, min_rect_a, min_rect_b, [&](Chunk &chunk)
+    {
+        ivec2 chunk_pos = chunk.pos - storage_offset;
+        ivec2 a = max(min_rect_a - chunk_pos, ivec2());
+        ivec2 b = min(min_rect_b - chunk_pos, chunk.cells.size());
+
+        chunk.hitbox_points_min.ModifyRect(a, b - a, [&](ivec2 tile_pos)
+        {
+            int mask = TileHitboxes::GetHitboxPointsMaskPartial(chunk.cells.safe_throwing_at(tile_pos).mid.Info().corner,
+                [&](ivec2 offset)
+                {
+                    ivec2 this_pos = tile_pos + offset;
+                    // The neighbors can be in the other chunks.
+                    const Cell &cell = chunk.cells.pos_in_range(this_pos) ? chunk.cells.safe_nonthrowing_at(this_pos) : GetCell(this_pos + chunk_pos);
+                    return TileHitboxes::GetHitboxPointsMaskPossibleMin(cell.mid.Info().corner);
+                }
+            );
+            if (update_bitmaps)
+                UpdateTileInHitboxBitmap(chunk.hitbox_bitmap_min, tile_pos, mask);
+            return mask;
+        });
+        return false;
+    });
+}
+
+void Grid::UpdateChunkBounds(Chunk &chunk)
+{
+    chunk.nonempty_a = chunk.cells.size();
+    chunk.nonempty_b = ivec2();
+    for (ivec2 tile_pos : vector_range(chunk.cells.size()))
+    {
+        if (!chunk.cells.safe_nonthrowing_at(tile_pos).Empty())
+        {
+            chunk.nonempty_a = min(chunk.nonempty_a, tile_pos);
+            chunk.nonempty_b = max(chunk.nonempty_b, tile_pos + 1);
+        }
+    }
+}
+
+void Grid::RegenerateBitmaps(Chunk &chunk)
+{
+    ivec2 highres_size = chunk.cells.size() * TileHitboxes::highres_tile_size;
+
+    chunk.hitbox_bitmap_min.Resize(highres_size);
+    chunk.hitbox_bitmap_full.Resize(highres_size);
+    chunk.hitbox_points_min.ForEach([&](ivec2 tile_pos, int mask){UpdateTileInHitboxBitmap(chunk.hitbox_bitmap_min, tile_pos, mask, false);});
+    chunk.hitbox_points_full.ForEach([&](ivec2 tile_pos, int mask){UpdateTileInHitboxBitmap(chunk.hitbox_bitmap_full, tile_pos, mask, false);});
+
+    for (int rot = 0; rot < 4; rot++)
+    {
+        // Find the bounds of the rotated chunk.
+        Xf rot_xf = Xf{}.Rotate(rot);
+        auto [a, b] = sort_two(rot_xf.TransformPixelCenteredPoint(ivec2(0)), rot_xf.TransformPixelCenteredPoint(highres_size - 1));
+        chunk.occupancy_bitmap_origins[rot] = a;
+        chunk.occupancy_bitmaps[rot].Resize(highres_size(any) <= 0 ? ivec2() : b - a + 1);
+    }
+
+    for (ivec2 tile_pos : vector_range(chunk.cells.size()))
+    {
+        if (!chunk.cells.safe_nonthrowing_at(tile_pos).Empty())
+            UpdateTileInOccupancyBitmaps(chunk, tile_pos, false);
+    }
+}
+
+void Grid::UpdateTileInOccupancyBitmaps(Chunk &chunk, ivec2 tile_pos, bool clear)
+{
+    int corner = chunk.cells.safe_throwing_at(tile_pos).mid.Info().corner;
+
+    for (int rot = 0; rot < 4; rot++)
+    {
+        BitMatrix &bitmap = chunk.occupancy_bitmaps[rot];
+
+        // Find the top-left corner of the rotated tile in the bitmap.
+        Xf rot_xf = Xf{}.Rotate(rot);
+        ivec2 tile_corner = tile_pos * TileHitboxes::highres_tile_size;
+        ivec2 target = min(rot_xf.TransformPixelCenteredPoint(tile_corner), rot_xf.TransformPixelCenteredPoint(tile_corner + TileHitboxes::highres_tile_size - 1));
+        target -= chunk.occupancy_bitmap_origins[rot];
+
+        int rotated_corner = TileHitboxes::RotateCorner(corner, rot);
+
+        for (int y = 0; y < TileHitboxes::highres_tile_size; y++)
+        {
+            ivec2 range = TileHitboxes::TileRowRangeHighRes(rotated_corner, y);
+            if (clear)
+                bitmap.SetRowRange(target.y + y, target.x, target.x + TileHitboxes::highres_tile_size, false);
+            bitmap.SetRowRange(target.y + y, target.x + range.x, target.x + range.y, true);
+        }
+    }
+}
+
+void Grid::UpdateTileInHitboxBitmap(BitMatrix &bitmap, ivec2 tile_pos, int mask, bool clear)
+{
+    ivec2 tile_corner = tile_pos * TileHitboxes::highres_tile_size;
+
+    if (clear)
+        bitmap.ClearRect(tile_corner, ivec2(TileHitboxes::highres_tile_size));
+
+    for (int i = 0, cur_mask = mask; cur_mask; cur_mask >>= 1, i++)
+    {
+        if ((cur_mask & 1) == 0)
+            continue;
+
+        for (ivec2 point : TileHitboxes::GetHitboxPointsHighRes(i))
+            bitmap.Set(tile_corner + point);
     }
 }
 
@@ -337,7 +765,7 @@ void Grid::LoadFromFile(Stream::ReadOnlyData data)
         auto input_layer = Tiled::LoadTileLayer(Tiled::FindLayer(json.GetView(), "mid"));
 
         // Validate the tiles in the file.
-        for (ivec2 pos : vector_range(cells.size()))
+        for (ivec2 pos : vector_range(input_layer.size()))
         {
             int tile_index = input_layer.safe_throwing_at(pos);
             if (tile_index < 0 || tile_index >= int(Tile::_count))
@@ -350,7 +778,7 @@ void Grid::LoadFromFile(Stream::ReadOnlyData data)
         // Copy the tiles into the grid.
         ModifyRegion(ivec2(0), input_layer.size(), [&](auto &&cell)
         {
-            for (ivec2 pos : vector_range(cells.size()))
+            for (ivec2 pos : vector_range(input_layer.size()))
             cell(pos).mid.tile = Tile(input_layer.safe_throwing_at(pos));
         });
     }
@@ -360,35 +788,302 @@ void Grid::LoadFromFile(Stream::ReadOnlyData data)
     }
 }
 
+void Grid::SaveToStream(Stream::Output &output) const
+{
+    output.WriteLittle<std::int32_t>(xf.pos.x).WriteLittle<std::int32_t>(xf.pos.y).WriteByte(std::uint8_t(xf.rot));
+    output.WriteByte(chunked);
+    output.WriteLittle<std::int32_t>(size.x).WriteLittle<std::int32_t>(size.y);
+    for (ivec2 pos : vector_range(size))
+        output.WriteByte(std::uint8_t(GetCell(pos).mid.tile));
+}
+
+Grid::StreamData Grid::ReadFromStream(Stream::Input &input)
+{
+    StreamData ret;
+    ret.xf.pos.x = input.ReadLittle<std::int32_t>();
+    ret.xf.pos.y = input.ReadLittle<std::int32_t>();
+    ret.xf.rot = input.ReadByte();
+    ret.chunked = input.ReadByte();
+    ret.size.x = input.ReadLittle<std::int32_t>();
+    ret.size.y = input.ReadLittle<std::int32_t>();
+
+    if (ret.xf.rot >= 4)
+        Program::Error(input.GetExceptionPrefix() + FMT("Invalid grid rotation: {}.", ret.xf.rot));
+    if (ret.size(any) < 0 || std::size_t(ret.size.x) * std::size_t(ret.size.y) > input.RemainingBytes())
+        Program::Error(input.GetExceptionPrefix() + FMT("Invalid grid size: {}.", ret.size));
+
+    ret.tiles.resize(std::size_t(ret.size.x) * std::size_t(ret.size.y));
+    for (Tile &tile : ret.tiles)
+    {
+        std::uint8_t index = input.ReadByte();
+        if (index >= std::uint8_t(Tile::_count))
+            Program::Error(input.GetExceptionPrefix() + FMT("Invalid tile: {}.", index));
+        tile = Tile(index);
+    }
+
+    return ret;
+}
+
+void Grid::Load(const StreamData &data)
+{
+    // Remove the existing grid contents.
+    Resize(ivec2(0), ivec2(0));
+    mass = 0;
+
+    chunked = data.chunked;
+
+    if (chunked || data.size(any) == 0)
+    {
+        ModifyRegion(ivec2(0), data.size, [&](auto &&cell)
+        {
+            auto it = data.tiles.begin();
+            for (ivec2 pos : vector_range(data.size))
+                cell(pos).mid.tile = *it++;
+        });
+    }
+    else
+    {
+        // In the normal mode, fill the only chunk directly and generate the bitmaps once, which is faster than `ModifyRegion()`.
+        size = data.size;
+        Chunk &chunk = chunks[ivec2()];
+        chunk.cells = Array2D<Cell>(size);
+        auto it = data.tiles.begin();
+        for (ivec2 pos : vector_range(size))
+        {
+            Cell &cell = chunk.cells.safe_nonthrowing_at(pos);
+            cell.mid.tile = *it++;
+            mass += cell.Mass();
+        }
+        chunk.nonempty_b = size;
+        chunk.hitbox_points_full.Resize(size, ivec2());
+        chunk.hitbox_points_min.Resize(size, ivec2());
+        RegenerateHitboxPointsInRect(ivec2(), size, false);
+        RegenerateBitmaps(chunk);
+        BumpEditGeneration();
+
+        // The saved grids are always trimmed, but check anyway.
+        Trim();
+    }
+
+    // This is set last, since modifying the grid moves it.
+    xf = data.xf;
+}
+
 bool Grid::IsEmpty() const
 {
-    return (cells.size() <= 0).any();
+    return (size <= 0).any();
 }
 
-void Grid::RemoveTile(ivec2 pos)
+const Cell &Grid::GetCell(ivec2 pos) const
 {
-    if (!cells.pos_in_range(pos))
-        return; // Out of range.
+    static const Cell empty_cell;
+
+    if (!(pos(all) >= 0 && pos(all) < size))
+        return empty_cell;
+
+    ivec2 storage_pos = pos + storage_offset;
+    const Chunk *chunk = FindChunk(storage_pos);
+    if (!chunk)
+        return empty_cell;
+    return chunk->cells.safe_nonthrowing_at(storage_pos - chunk->pos);
+}
+
+void Grid::SetChunked(bool new_chunked)
+{
+    if (new_chunked == chunked)
+        return;
 
-    if (Cells().safe_nonthrowing_at(pos).mid.tile == Tile::empty)
-        return; // No tile.
+    ivec2 old_size = size;
+    Array2D<Cell> old_cells(old_size);
+    for (ivec2 pos : vector_range(old_size))
+        old_cells.safe_nonthrowing_at(pos) = GetCell(pos);
+
+    // Remove the existing grid contents. This moves `xf`, but adding the tiles back moves it back.
+    Resize(ivec2(0), ivec2(0));
+    mass = 0;
+
+    chunked = new_chunked;
+
+    ModifyRegion(ivec2(0), old_size, [&](auto &&cell)
+    {
+        for (ivec2 pos : vector_range(old_size))
+            cell(pos) = old_cells.safe_nonthrowing_at(pos);
+    });
+}
+
+void Grid::RemoveTile(ivec2 pos)
+{
+    if (GetCell(pos).mid.tile == Tile::empty)
+        return; // No tile, or out of range.
 
     ModifyRegion(pos, ivec2(1), [](auto &&cell){cell(ivec2(0)).mid.tile = Tile::empty;});
 }
 
+std::vector<Grid> Grid::SplitDisconnectedParts()
+{
+    std::vector<ivec2> changed_tiles = std::move(tiles_with_lost_edges);
+    tiles_with_lost_edges.clear();
+
+    // We flood-fill from every non-empty tile that could've lost a connection.
+    struct Fill
+    {
+        // All tiles reached by this fill. The ones starting from `next` weren't expanded yet.
+        std::vector<ivec2> tiles;
+        std::size_t next = 0;
+    };
+    std::vector<Fill> fills;
+    // Maps the reached tiles to the fills that reached them.
+    phmap::flat_hash_map<ivec2, int> tile_fills;
+
+    for (ivec2 tile : changed_tiles)
+    {
+        for (int i = -1; i < 4; i++)
+        {
+            ivec2 pos = i < 0 ? tile : tile + ivec2::dir4(i);
+            if (TileEdgeMask(pos) == 0 || !tile_fills.try_emplace(pos, int(fills.size())).second)
+                continue;
+            fills.emplace_back().tiles.push_back(pos);
+        }
+    }
+
+    if (fills.size() < 2)
+        return {};
+
+    // The fills that meet are merged into groups, using union-find.
+    // A group that runs out of tiles to expand before meeting everyone else is a separate part.
+    struct Group
+    {
+        int parent = 0;
+        // Those are only meaningful for the roots.
+        std::vector<int> fills;
+        std::size_t pending_tiles = 1;
+    };
+    std::vector<Group> groups(fills.size());
+    for (int i = 0; i < int(groups.size()); i++)
+    {
+        groups[i].parent = i;
+        groups[i].fills = {i};
+    }
+    auto FindGroup = [&](int i)
+    {
+        while (groups[i].parent != i)
+            i = groups[i].parent = groups[groups[i].parent].parent;
+        return i;
+    };
+
+    int num_groups = int(groups.size());
+    std::vector<std::vector<ivec2>> parts;
+
+    // Each fill expands one tile per iteration, to keep the groups growing at roughly the same speed.
+    while (num_groups > 1)
+    {
+        for (int i = 0; i < int(fills.size()) && num_groups > 1; i++)
+        {
+            Fill &fill = fills[i];
+            if (fill.next == fill.tiles.size())
+                continue;
+
+            ivec2 tile = fill.tiles[fill.next++];
+            int group = FindGroup(i);
+            groups[group].pending_tiles--;
+
+            int edges = TileEdgeMask(tile);
+            for (int dir = 0; dir < 4; dir++)
+            {
+                ivec2 next_tile = tile + ivec2::dir4(dir);
+                if (!(edges & 1 << dir) || !(TileEdgeMask(next_tile) & 1 << (dir + 2) % 4))
+                    continue;
+
+                auto [it, inserted] = tile_fills.try_emplace(next_tile, i);
+                if (inserted)
+                {
+                    fill.tiles.push_back(next_tile);
+                    groups[group].pending_tiles++;
+                    continue;
+                }
+
+                int other_group = FindGroup(it->second);
+                if (other_group == group)
+                    continue;
+
+                // Merge the smaller fill list into the larger one.
+                if (groups[group].fills.size() < groups[other_group].fills.size())
+                    std::swap(group, other_group);
+                groups[other_group].parent = group;
+                groups[group].pending_tiles += groups[other_group].pending_tiles;
+                groups[group].fills.insert(groups[group].fills.end(), groups[other_group].fills.begin(), groups[other_group].fills.end());
+                groups[other_group].fills = {};
+                num_groups--;
+            }
+
+            if (groups[group].pending_tiles == 0 && num_groups > 1)
+            {
+                std::vector<ivec2> &part = parts.emplace_back();
+                for (int fill_index : groups[group].fills)
+                    part.insert(part.end(), fills[fill_index].tiles.begin(), fills[fill_index].tiles.end());
+                num_groups--;
+            }
+        }
+    }
+
+    if (parts.empty())
+        return {};
+
+    // Copy the parts to new grids.
+    Xf grid_to_world = GridToWorld();
+    std::vector<Grid> ret;
+    std::vector<ivec2> part_positions;
+    for (const std::vector<ivec2> &part : parts)
+    {
+        ivec2 a = part.front(), b = part.front();
+        for (ivec2 tile : part)
+        {
+            clamp_var_max(a, tile);
+            clamp_var_min(b, tile);
+        }
+        b++;
+
+        Grid &new_grid = ret.emplace_back();
+        new_grid.SetChunked(chunked);
+        new_grid.ModifyRegion(ivec2(), b - a, [&](auto &&cell)
+        {
+            for (ivec2 tile : part)
+                cell(tile - a) = GetCell(tile);
+        });
+        ASSERT(new_grid.Size() == b - a);
+        new_grid.xf.rot = xf.rot;
+        new_grid.xf.pos = grid_to_world * (a * tile_size) + new_grid.xf.Matrix() * (new_grid.Size() * tile_size / 2);
+        part_positions.push_back(a);
+    }
+
+    // Remove the parts from this grid. Each removal can trim the grid, so we recompute the grid space every time.
+    for (std::size_t i = 0; i < parts.size(); i++)
+    {
+        ivec2 pos = WorldToGrid() * ret[i].GridToWorld().pos / tile_size;
+        ModifyRegion(pos, ret[i].Size(), [&](auto &&cell)
+        {
+            for (ivec2 tile : parts[i])
+                cell(tile - part_positions[i]) = {};
+        });
+    }
+
+    // The remaining tiles are connected, since we only stopped when all the fills still running have met.
+    tiles_with_lost_edges.clear();
+
+    return ret;
+}
+
 Xf Grid::GridToWorld() const
 {
     Xf ret = xf;
-    ret.pos -= ret.Matrix() * (cells.size() * tile_size / 2);
+    ret.pos -= ret.Matrix() * (size * tile_size / 2);
     return ret;
 }
 
 bool Grid::CollidesWithPointInGridSpaceHighRes(ivec2 point) const
 {
     ivec2 tile_pos = div_ex(point, TileHitboxes::highres_tile_size);
-    if (!cells.pos_in_range(tile_pos))
-        return false;
-    return TileHitboxes::TileCollidesWithPointHighRes(cells.safe_throwing_at(tile_pos).mid.Info().corner, mod_ex(point, TileHitboxes::highres_tile_size));
+    return TileHitboxes::TileCollidesWithPointHighRes(GetCell(tile_pos).mid.Info().corner, mod_ex(point, TileHitboxes::highres_tile_size));
 }
 
 bool Grid::CollidesWithPointInGridSpace(ivec2 point) const
@@ -396,7 +1091,170 @@ bool Grid::CollidesWithPointInGridSpace(ivec2 point) const
     return TileHitboxes::ToHighResCorners(point, [&](ivec2 corner){return CollidesWithPointInGridSpaceHighRes(corner);});
 }
 
+std::optional<Grid::RayHit> Grid::RayCastInGridSpace(fvec2 origin, fvec2 dir, float max_t) const
+{
+    if (IsEmpty())
+        return {};
+
+    // Clip the ray to the grid bounds.
+    fvec2 bounds(size * tile_size);
+    float t_enter = 0, t_exit = max_t;
+    for (int i = 0; i < 2; i++)
+    {
+        if (dir[i] == 0)
+        {
+            if (origin[i] < 0 || origin[i] > bounds[i])
+                return {};
+            continue;
+        }
+
+        float t_a = -origin[i] / dir[i];
+        float t_b = (bounds[i] - origin[i]) / dir[i];
+        if (t_a > t_b)
+            std::swap(t_a, t_b);
+        clamp_var_min(t_enter, t_a);
+        clamp_var_max(t_exit, t_b);
+    }
+    if (t_enter > t_exit)
+        return {};
+
+    // Walk the tiles along the ray, as in "A Fast Voxel Traversal Algorithm for Ray Tracing" by Amanatides and Woo.
+    ivec2 tile = clamp(ivec2(floor((origin + dir * t_enter) / tile_size)), 0, size - 1);
+    ivec2 step;
+    fvec2 t_next, t_delta; // When the ray crosses the next tile border on each axis, and how much time it takes to cross a tile.
+    for (int i = 0; i < 2; i++)
+    {
+        if (dir[i] == 0)
+        {
+            t_next[i] = std::numeric_limits<float>::infinity();
+            continue;
+        }
+        step[i] = dir[i] > 0 ? 1 : -1;
+        t_next[i] = ((tile[i] + (step[i] > 0)) * tile_size - origin[i]) / dir[i];
+        t_delta[i] = tile_size / abs(dir[i]);
+    }
+
+    float t = t_enter;
+    while (true)
+    {
+        int axis = t_next.x < t_next.y ? 0 : 1;
+        float t_leave = min(t_next[axis], t_exit);
+
+        if (auto hit_t = TileHitboxes::RayCastTile(GetCell(tile).mid.Info().corner, origin - fvec2(tile * tile_size), dir, t, t_leave))
+            return RayHit{.t = *hit_t, .tile = tile};
+
+        if (t_next[axis] >= t_exit)
+            return {};
+
+        tile[axis] += step[axis];
+        if (tile[axis] < 0 || tile[axis] >= size[axis])
+            return {};
+        t = t_next[axis];
+        t_next[axis] += t_delta[axis];
+    }
+}
+
 bool Grid::CollidesWithGridWithCustomXfDifference(const Grid &other, Xf this_to_other, bool full) const
+{
+    struct Job
+    {
+        const Grid *source = nullptr;
+        const Grid *target = nullptr;
+        Xf target_to_source;
+    };
+
+    Xf this_to_other_highres = this_to_other;
+    this_to_other_highres.pos *= TileHitboxes::highres_factor;
+
+    Job jobs[2] = {
+        {this, &other, this_to_other_highres.Inverse()},
+        {&other, this, this_to_other_highres},
+    };
+
+    bool ret = false;
+
+    for (const Job &job : jobs)
+    {
+        // A source point collides if it's in the target occupancy transformed with `target_to_source` (pixel-centered).
+        // The rotated occupancy bitmaps store exactly that, minus the translation.
+        if (ForEachChunkPair(*job.source, *job.target, job.target_to_source, ivec2(), ivec2(), [&](const Chunk &source_chunk, const Chunk &target_chunk, Xf target_to_source)
+        {
+            return (full ? source_chunk.hitbox_bitmap_full : source_chunk.hitbox_bitmap_min).Intersects(
+                target_chunk.occupancy_bitmaps[target_to_source.rot],
+                target_to_source.pos + target_chunk.occupancy_bitmap_origins[target_to_source.rot]
+            );
+        }))
+        {
+            ret = true;
+            break;
+        }
+    }
+
+    #if IMP_GRID_VALIDATE_BITMAP_COLLISIONS
+    ASSERT_ALWAYS(ret == CollidesWithGridWithCustomXfDifferencePointwise(other, this_to_other, full), "The bitmap collision test disagrees with the pointwise one.");
+    #endif
+
+    return ret;
+}
+
+int Grid::MaxFreeTranslationWithCustomXfDifference(const Grid &other, Xf this_to_other, ivec2 dir, int limit, bool full) const
+{
+    if (limit <= 0)
+        return 0;
+
+    struct Job
+    {
+        const Grid *source = nullptr;
+        const Grid *target = nullptr;
+        Xf target_to_source;
+        // How `target_to_source.pos` changes with each step.
+        ivec2 step;
+    };
+
+    Xf this_to_other_highres = this_to_other;
+    this_to_other_highres.pos *= TileHitboxes::highres_factor;
+    ivec2 dir_highres = dir * TileHitboxes::highres_factor;
+
+    Xf other_to_this_highres = this_to_other_highres.Inverse();
+
+    Job jobs[2] = {
+        {this, &other, other_to_this_highres, other_to_this_highres.Matrix() * -dir_highres},
+        {&other, this, this_to_other_highres, dir_highres},
+    };
+
+    // The first step that collides, or `limit + 1` if none.
+    int first_collision = limit + 1;
+
+    for (const Job &job : jobs)
+    {
+        if (first_collision == 1)
+            break;
+
+        // See `CollidesWithGridWithCustomXfDifference()` for the explanation.
+        ForEachChunkPair(*job.source, *job.target, job.target_to_source, job.step, job.step * (first_collision - 1), [&](const Chunk &source_chunk, const Chunk &target_chunk, Xf target_to_source)
+        {
+            first_collision = (full ? source_chunk.hitbox_bitmap_full : source_chunk.hitbox_bitmap_min).FirstIntersectionAlongPath(
+                target_chunk.occupancy_bitmaps[target_to_source.rot],
+                target_to_source.pos + target_chunk.occupancy_bitmap_origins[target_to_source.rot],
+                job.step,
+                first_collision - 1
+            );
+            return first_collision == 1;
+        });
+    }
+
+    #if IMP_GRID_VALIDATE_BITMAP_COLLISIONS
+    for (int i = 1; i <= min(first_collision, limit); i++)
+    {
+        ASSERT_ALWAYS(CollidesWithGridWithCustomXfDifference(other, Xf::Pos(dir * i) * this_to_other, full) == (i == first_collision),
+            "The sweep collision test disagrees with the step-by-step one.");
+    }
+    #endif
+
+    return first_collision - 1;
+}
+
+bool Grid::CollidesWithGridWithCustomXfDifferencePointwise(const Grid &other, Xf this_to_other, bool full) const
 {
     struct Job
     {
@@ -412,61 +1270,91 @@ bool Grid::CollidesWithGridWithCustomXfDifference(const Grid &other, Xf this_to_
         {&other, this, this_to_other.Inverse()},
     };
 
+    bool ret = false;
     for (const Job &job : jobs)
     {
-        for (const auto &[tile, mask] : full ? job.source->hitbox_points_full : job.source->hitbox_points_min)
+        for (const auto &[index, chunk] : job.source->chunks)
         {
-            for (int i = 0, cur_mask = mask; cur_mask; cur_mask >>= 1, i++)
+            ivec2 chunk_pos = chunk.pos - job.source->storage_offset;
+            (full ? chunk.hitbox_points_full : chunk.hitbox_points_min).ForEach([&](ivec2 tile, int mask)
             {
-                if ((cur_mask & 1) == 0)
-                    continue;
+                tile += chunk_pos;
 
-                for (ivec2 point : TileHitboxes::GetHitboxPointsHighRes(i))
+                for (int i = 0, cur_mask = mask; cur_mask && !ret; cur_mask >>= 1, i++)
                 {
-                    if (job.target->CollidesWithPointInGridSpaceHighRes(job.xf.TransformPixelCenteredPoint(point + tile * TileHitboxes::highres_tile_size)))
-                        return true;
+                    if ((cur_mask & 1) == 0)
+                        continue;
+
+                    for (ivec2 point : TileHitboxes::GetHitboxPointsHighRes(i))
+                    {
+                        if (job.target->CollidesWithPointInGridSpaceHighRes(job.xf.TransformPixelCenteredPoint(point + tile * TileHitboxes::highres_tile_size)))
+                        {
+                            ret = true;
+                            break;
+                        }
+                    }
                 }
-            }
+            });
+            if (ret)
+                break;
         }
+        if (ret)
+            break;
     }
-    return false;
+    return ret;
 }
 
-void Grid::Render(Xf camera, std::optional<fvec3> color) const
+void Grid::InvalidateMeshesInRect(ivec2 a, ivec2 b)
 {
-    if (IsEmpty())
-        return; // Empty grid.
+    ForEachChunkInRect(*this, a - 1, b + 1, [&](Chunk &chunk)
+    {
+        if (chunk.mesh_blocks.size() == ivec2())
+            return false; // All outdated already.
+
+        // The rect relative to the chunk, clamped to it.
+        ivec2 local_a = clamp_min(a - 1 + storage_offset - chunk.pos, 0);
+        ivec2 local_b = clamp_max(b + 1 + storage_offset - chunk.pos, chunk.cells.size());
+        if (local_a(any) >= local_b)
+            return false;
 
+        for (ivec2 block_index : div_ex(local_a, mesh_block_size) <= vector_range <= div_ex(local_b - 1, mesh_block_size))
+            chunk.mesh_blocks.safe_nonthrowing_at(block_index).rot = -1;
+        return false;
+    });
+}
+
+void Grid::RegenerateMesh(const Chunk &chunk, ivec2 block_index, int rot) const
+{
     static const Graphics::TextureAtlas::Region &region = texture_atlas.Get("tiles.png");
 
-    // Maps the grid space to the camera space.
-    Xf render_xf = camera.Inverse() * GridToWorld();
-    // Maps the camera space to the grid space.
-    Xf inv_render_xf = render_xf.Inverse();
+    Chunk::MeshBlock &block = chunk.mesh_blocks.safe_nonthrowing_at(block_index);
+    block.mesh.Clear();
+    block.rot = rot;
 
-    auto [corner_a, corner_b] = sort_two(
-        div_ex(inv_render_xf * (-screen_size/2), tile_size),
-        div_ex(inv_render_xf * ( screen_size/2), tile_size)
-    );
-    clamp_var_min(corner_a, 0);
-    clamp_var_max(corner_b, cells.size() - 1);
+    // Rotates the block space to the camera space, without the offset.
+    imat2 rot_matrix = Xf{}.Rotate(rot).Matrix();
+    // The chunk position in the grid space.
+    ivec2 chunk_pos = chunk.pos - storage_offset;
+    // The block position relative to the chunk.
+    ivec2 block_pos = block_index * mesh_block_size;
 
-    for (ivec2 tile_pos : corner_a <= vector_range <= corner_b)
+    for (ivec2 local_pos : clamp_min(chunk.nonempty_a, block_pos) <= vector_range < clamp_max(chunk.nonempty_b, block_pos + mesh_block_size))
     {
-        const CellLayer &la = cells.safe_throwing_at(tile_pos).mid;
+        ivec2 tile_pos = chunk_pos + local_pos;
+        const CellLayer &la = chunk.cells.safe_nonthrowing_at(local_pos).mid;
         const TileInfo &info = la.Info();
 
         if (info.render == TileRenderFlavor::quarter)
         {
-            ivec2 tile_pix_pos = render_xf * (tile_pos * tile_size + tile_size/2);
+            ivec2 tile_pix_pos = rot_matrix * ((local_pos - block_pos) * tile_size + tile_size/2);
 
             // Returns true if this tile should be drawn merged with its neighbor at `offset`.
             auto MergeToOffset = [&](ivec2 offset) -> bool
             {
                 ivec2 other_pos = tile_pos + offset;
-                if (!cells.pos_in_range(other_pos))
+                if (!(other_pos(all) >= 0 && other_pos(all) < size))
                     return false;
-                const TileInfo &other_info = cells.safe_nonthrowing_at(other_pos).mid.Info();
+                const TileInfo &other_info = GetCell(other_pos).mid.Info();
                 if (offset.x == 0 || offset.y == 0)
                 {
                     int dir = offset.angle4_floor();
@@ -499,23 +1387,20 @@ void Grid::Render(Xf camera, std::optional<fvec3> color) const
                 else
                     variant = 4;
 
-                ivec2 matrix_dir = ivec2::dir4(mod_ex(corner + render_xf.rot - flip, 4));
-                auto quad = r.iquad(tile_pix_pos, region.region(ivec2(variant, info.tex_index) * tile_size, ivec2(tile_size))).center().matrix(imat2(matrix_dir, matrix_dir.rot90())).flip_x(flip);
-                if (color)
-                    quad.color(*color).mix(0);
+                ivec2 matrix_dir = ivec2::dir4(mod_ex(corner + rot - flip, 4));
+                block.mesh.iquad(tile_pix_pos, region.region(ivec2(variant, info.tex_index) * tile_size, ivec2(tile_size))).center().matrix(imat2(matrix_dir, matrix_dir.rot90())).flip_x(flip);
             }
             else
             {
                 bool merge[4];
                 bool merge_diag[4];
                 for (int i = 0; i < 4; i++)
-                    merge[i] = MergeToOffset(ivec2::dir4(i - xf.rot));
+                    merge[i] = MergeToOffset(ivec2::dir4(i - rot));
                 for (int i = 0; i < 4; i++)
                     merge_diag[i] = merge[i] && merge[mod_ex(i + 1, 4)] && MergeToOffset(ivec2::dir8(1 + i * 2));
 
                 for (int i = 0; i < 4; i++)
                 {
-
                     ivec2 sector_dir = ivec2::dir4_diag(i);
                     ivec2 sector = clamp_min(sector_dir, 0);
 
@@ -537,20 +1422,53 @@ void Grid::Render(Xf camera, std::optional<fvec3> color) const
                         ASSERT(false, "Unsure what tile variant to use.");
 
                     ivec2 dir = ivec2::dir4(flip_diag);
-                    auto quad = r.fquad(tile_pix_pos + tile_size/2 * (sector - 1) + tile_size/4.f, region.region(ivec2(0, info.tex_index) * tile_size + variant * tile_size/2, ivec2(tile_size/2))).center().matrix(imat2(dir, dir.rot90()));
+                    auto quad = block.mesh.fquad(tile_pix_pos + tile_size/2 * (sector - 1) + tile_size/4.f, region.region(ivec2(0, info.tex_index) * tile_size + variant * tile_size/2, ivec2(tile_size/2))).center().matrix(imat2(dir, dir.rot90()));
 
                     if (flip_diag ? !sector.y : sector.x)
                         quad.flip_x();
                     if (flip_diag ? !sector.x : sector.y)
                         quad.flip_y();
-                    if (color)
-                        quad.color(*color).mix(0);
                 }
             }
+        }
+    }
+}
+
+void Grid::RenderWithXf(Xf camera, Xf grid_to_world, std::optional<fvec3> color) const
+{
+    if (IsEmpty())
+        return; // Empty grid.
+
+    // Maps the grid space to the camera space.
+    Xf render_xf = camera.Inverse() * grid_to_world;
+    // Maps the camera space to the grid space.
+    Xf inv_render_xf = render_xf.Inverse();
+
+    auto [corner_a, corner_b] = sort_two(
+        div_ex(inv_render_xf * (-screen_size/2), tile_size),
+        div_ex(inv_render_xf * ( screen_size/2), tile_size)
+    );
+
+    ForEachChunkInRect(*this, corner_a, corner_b + 1, [&](const Chunk &chunk)
+    {
+        ivec2 num_blocks = (chunk.cells.size() + mesh_block_size - 1) / mesh_block_size;
+        if (chunk.mesh_blocks.size() != num_blocks)
+            chunk.mesh_blocks = Array2D<Chunk::MeshBlock>(num_blocks);
 
+        // The visible blocks. The visible rect relative to the chunk is `corner_a .. corner_b` (inclusive), shifted by this.
+        ivec2 offset = storage_offset - chunk.pos;
+        ivec2 block_a = clamp_min(div_ex(corner_a + offset, mesh_block_size), 0);
+        ivec2 block_b = clamp_max(div_ex(corner_b + offset, mesh_block_size) + 1, num_blocks);
 
+        for (ivec2 block_index : block_a <= vector_range < block_b)
+        {
+            const Chunk::MeshBlock &block = chunk.mesh_blocks.safe_nonthrowing_at(block_index);
+            if (block.rot != render_xf.rot)
+                RegenerateMesh(chunk, block_index, render_xf.rot);
+            r.AddQuads(block.mesh, render_xf * ((chunk.pos - storage_offset + block_index * mesh_block_size) * tile_size), color);
         }
-    }
+        return false;
+    });
 }
 
 void Grid::DebugRender(Xf camera, DebugRenderFlags flags) const
@@ -566,7 +1484,7 @@ void Grid::DebugRender(Xf camera, DebugRenderFlags flags) const
         float alpha = 1;
 
         ivec2 a = render_xf * ivec2(0);
-        ivec2 b = render_xf * (cells.size() * tile_size);
+        ivec2 b = render_xf * (size * tile_size);
         sort_two_var(a, b);
 
 
@@ -609,16 +1527,21 @@ void Grid::DebugRender(Xf camera, DebugRenderFlags flags) const
         fvec3 color(1,0,1);
         float alpha = 0.6;
 
-        for (const auto &[tile, mask] : hitbox_points_full)
+        for (const auto &[index, chunk] : chunks)
         {
-            for (int i = 0, cur_mask = mask; cur_mask; cur_mask >>= 1, i++)
+            chunk.hitbox_points_full.ForEach([&](ivec2 tile, int mask)
             {
-                if ((cur_mask & 1) == 0)
-                    continue;
+                tile += chunk.pos - storage_offset;
 
-                for (ivec2 point : TileHitboxes::GetHitboxPointsHighRes(i))
-                    r.iquad(render_xf.TransformPixelCenteredPoint(TileHitboxes::ToNormalRes(point) + tile * tile_size), ivec2(1)).color(color).alpha(alpha);
-            }
+                for (int i = 0, cur_mask = mask; cur_mask; cur_mask >>= 1, i++)
+                {
+                    if ((cur_mask & 1) == 0)
+                        continue;
+
+                    for (ivec2 point : TileHitboxes::GetHitboxPointsHighRes(i))
+                        r.iquad(render_xf.TransformPixelCenteredPoint(TileHitboxes::ToNormalRes(point) + tile * tile_size), ivec2(1)).color(color).alpha(alpha);
+                }
+            });
         }
     }
 
@@ -627,16 +1550,21 @@ void Grid::DebugRender(Xf camera, DebugRenderFlags flags) const
         fvec3 color(0,0.5,1);
         float alpha = 1;
 
-        for (const auto &[tile, mask] : hitbox_points_min)
+        for (const auto &[index, chunk] : chunks)
         {
-            for (int i = 0, cur_mask = mask; cur_mask; cur_mask >>= 1, i++)
+            chunk.hitbox_points_min.ForEach([&](ivec2 tile, int mask)
             {
-                if ((cur_mask & 1) == 0)
-                    continue;
+                tile += chunk.pos - storage_offset;
 
-                for (ivec2 point : TileHitboxes::GetHitboxPointsHighRes(i))
-                    r.iquad(render_xf.TransformPixelCenteredPoint(TileHitboxes::ToNormalRes(point) + tile * tile_size), ivec2(1)).color(color).alpha(alpha);
-            }
+                for (int i = 0, cur_mask = mask; cur_mask; cur_mask >>= 1, i++)
+                {
+                    if ((cur_mask & 1) == 0)
+                        continue;
+
+                    for (ivec2 point : TileHitboxes::GetHitboxPointsHighRes(i))
+                        r.iquad(render_xf.TransformPixelCenteredPoint(TileHitboxes::ToNormalRes(point) + tile * tile_size), ivec2(1)).color(color).alpha(alpha);
+                }
+            });
         }
     }
 }
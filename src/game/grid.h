@@ -1,6 +1,7 @@
 #pragma once
 
 #include "game/xf.h"
+#include "utils/bit_matrix.h"
 
 constexpr int tile_size = 12;
 
@@ -41,6 +42,7 @@ namespace TileHitboxes
     // A 2x resolution would kinda work, but the conversion to and from 1x resolution would be asymmetrical, which isn't good.
 
     constexpr int highres_factor = 3;
+    constexpr int highres_tile_size = tile_size * highres_factor;
 
     // Converts a point from 3x to normal resolution.
     [[nodiscard]] inline ivec2 ToNormalRes(ivec2 point) {return div_ex(point, highres_factor);}
@@ -132,6 +134,19 @@ namespace TileHitboxes
     // `point` is in double-resolution, and is pixel-centered.
     [[nodiscard]] bool TileCollidesWithPointHighRes(int corner, ivec2 point);
 
+    // Returns the half-open range of X coordinates of high-res points in row `y` that collide with a `corner`-shaped tile.
+    // This agrees with `TileCollidesWithPointHighRes()`. The range can be empty.
+    [[nodiscard]] ivec2 TileRowRangeHighRes(int corner, int y);
+
+    // Returns the smallest `t` in `[t_begin, t_end]` for which `origin + dir * t` is inside of a `corner`-shaped tile, if any.
+    // `origin` is relative to the tile corner, in normal resolution and continuous coordinates (the tile spans from 0 to `tile_size`).
+    // The ray is assumed to be in the tile AABB for this range of `t`. The ray must overlap the tile for a non-zero length, touching a single point doesn't count.
+    [[nodiscard]] std::optional<float> RayCastTile(int corner, fvec2 origin, fvec2 dir, float t_begin, float t_end);
+
+    // Returns the corner of a tile rotated by `steps` 90 degree steps.
+    // `corner`: -2 = empty, -1 = full tile, 0 = |/, 1 = \|, 2 = /|, 3 = |\.
+    [[nodiscard]] int RotateCorner(int corner, int steps);
+
     // `corner`: -2 = empty, -1 = full tile, 0 = |/, 1 = \|, 2 = /|, 3 = |\.
     // Returns true if this corner type has an edge in this 4-direction `dir`.
     [[nodiscard]] bool CornerHasEdge(int corner, int dir);
@@ -157,29 +172,291 @@ struct Cell
     [[nodiscard]] int Mass() const {return mid.Info().mass;}
 };
 
+// Stores a hitbox point mask for every tile of a grid. Pass individual bit numbers to `TileHitboxes::GetHitboxPoints(i)`.
+// The masks are stored densely, with the same layout as the cells.
+// We also keep a list of non-empty spans for every row, to iterate over the non-empty masks quickly.
+class HitboxMaskArray
+{
+  public:
+    using mask_t = std::uint16_t;
+
+  private:
+    Array2D<mask_t> masks;
+
+    // Half-open X ranges of non-zero masks, sorted by Y, then by X. Adjacent spans in the same row are always merged.
+    std::vector<ivec2> spans;
+    // `row_span_starts[y]` is the index of the first span in row `y`. This has an extra element at the end.
+    std::vector<int> row_span_starts = {0};
+
+    // Recomputes the spans in the rows `[y_begin, y_end)` from the masks.
+    void RegenerateSpans(int y_begin, int y_end)
+    {
+        std::vector<ivec2> new_spans;
+        std::vector<int> new_row_span_counts(y_end - y_begin);
+        for (int y = y_begin; y < y_end; y++)
+        {
+            const mask_t *row = masks.elements() + std::ptrdiff_t(y) * masks.size().x;
+            for (int x = 0; x < masks.size().x;)
+            {
+                if (row[x] == 0)
+                {
+                    x++;
+                    continue;
+                }
+                int x_begin = x;
+                while (x < masks.size().x && row[x] != 0)
+                    x++;
+                new_spans.push_back(ivec2(x_begin, x));
+                new_row_span_counts[y - y_begin]++;
+            }
+        }
+
+        int old_span_count = row_span_starts[y_end] - row_span_starts[y_begin];
+        spans.erase(spans.begin() + row_span_starts[y_begin], spans.begin() + row_span_starts[y_end]);
+        spans.insert(spans.begin() + row_span_starts[y_begin], new_spans.begin(), new_spans.end());
+
+        for (int y = y_begin; y < y_end; y++)
+            row_span_starts[y + 1] = row_span_starts[y] + new_row_span_counts[y - y_begin];
+        for (int y = y_end + 1; y < int(row_span_starts.size()); y++)
+            row_span_starts[y] += int(new_spans.size()) - old_span_count;
+    }
+
+  public:
+    [[nodiscard]] ivec2 Size() const {return ivec2(masks.size());}
+
+    // Returns the mask at `pos`, or 0 if out of range.
+    [[nodiscard]] int Get(ivec2 pos) const
+    {
+        return masks.try_get(pos);
+    }
+
+    // Resizes the array and/or offsets it by the specified amount, like `MultiArray::resize()`.
+    // The masks are copied row by row, and the spans are offset without looking at the masks.
+    void Resize(ivec2 new_size, ivec2 offset)
+    {
+        if (new_size(any) <= 0)
+            new_size = {};
+        if (new_size == Size() && offset == 0)
+            return;
+
+        Array2D<mask_t> new_masks(new_size);
+        std::vector<ivec2> new_spans;
+        std::vector<int> new_row_span_starts(new_size.y + 1);
+
+        ivec2 source_start = clamp_min(-offset, 0);
+        ivec2 source_end = clamp_max(new_size - offset, Size());
+
+        for (int y = 0; y < new_size.y; y++)
+        {
+            new_row_span_starts[y] = int(new_spans.size());
+
+            int source_y = y - offset.y;
+            if (source_y < source_start.y || source_y >= source_end.y || source_start.x >= source_end.x)
+                continue;
+
+            std::copy_n(masks.elements() + std::ptrdiff_t(source_y) * masks.size().x + source_start.x, source_end.x - source_start.x,
+                new_masks.elements() + std::ptrdiff_t(y) * new_size.x + source_start.x + offset.x);
+
+            for (int i = row_span_starts[source_y]; i < row_span_starts[source_y + 1]; i++)
+            {
+                ivec2 span = clamp(spans[i] + offset.x, 0, new_size.x);
+                if (span.x < span.y)
+                    new_spans.push_back(span);
+            }
+        }
+        new_row_span_starts.back() = int(new_spans.size());
+
+        masks = std::move(new_masks);
+        spans = std::move(new_spans);
+        row_span_starts = std::move(new_row_span_starts);
+    }
+
+    // Calls `int func(ivec2 pos)` for every position in the rect, and assigns the returned masks.
+    // The rect must be in range.
+    template <typename F>
+    void ModifyRect(ivec2 pos, ivec2 size, F &&func)
+    {
+        if (size(any) <= 0)
+            return;
+        ASSERT(pos(all) >= 0 && (pos + size)(all) <= Size(), "Hitbox mask rect is out of range.");
+
+        for (ivec2 tile_pos : vector_range(size) + pos)
+        {
+            int mask = func(std::as_const(tile_pos));
+            ASSERT(mask >= 0 && mask <= std::numeric_limits<mask_t>::max(), "Hitbox mask is out of range.");
+            masks.unsafe_at(tile_pos) = mask_t(mask);
+        }
+
+        RegenerateSpans(pos.y, pos.y + size.y);
+    }
+
+    // Calls `void func(ivec2 pos, int mask)` for every non-zero mask, row by row.
+    template <typename F>
+    void ForEach(F &&func) const
+    {
+        for (int y = 0; y < Size().y; y++)
+        {
+            const mask_t *row = masks.elements() + std::ptrdiff_t(y) * masks.size().x;
+            for (int i = row_span_starts[y]; i < row_span_starts[y + 1]; i++)
+            {
+                for (int x = spans[i].x; x < spans[i].y; x++)
+                    func(ivec2(x, y), int(row[x]));
+            }
+        }
+    }
+};
+
 class Grid
 {
-    Array2D<Cell> cells;
+  public:
+    // The chunk size in the chunked mode, in tiles.
+    static constexpr int chunk_size = 16;
+    // The size of the blocks the tile meshes are cached in, in tiles. This doesn't depend on the mode.
+    static constexpr int mesh_block_size = 16;
+    static_assert(chunk_size % mesh_block_size == 0, "The chunks must consist of whole mesh blocks.");
+
+  private:
+    // A rectangular piece of the grid, with its own collision data.
+    // In the normal mode there's at most one chunk, covering the whole grid.
+    // In the chunked mode (see `SetChunked()`), all chunks are `chunk_size` large and aligned to `chunk_size`, and only the non-empty ones exist.
+    struct Chunk
+    {
+        // The position of the top-left tile of this chunk, in the storage space (see `storage_offset`).
+        ivec2 pos;
+
+        Array2D<Cell> cells;
+
+        // Hitbox point masks for every tile.
+        // The `..._min` array only contains a minimal set of points, enough to ensure movement without adding new collisions.
+        // The `..._full` array contains enough points to detect any collisions.
+        HitboxMaskArray hitbox_points_min, hitbox_points_full;
+
+        // Same hitbox points, rasterized in high resolution, relative to the chunk.
+        BitMatrix hitbox_bitmap_min, hitbox_bitmap_full;
+        // High-resolution occupancy bitmaps for each of the 4 rotations.
+        // `occupancy_bitmaps[i]` contains the points colliding with the chunk, rotated by `i` 90-degree steps
+        // (with `Xf::TransformPixelCenteredPoint()`), and then offset by `-occupancy_bitmap_origins[i]`.
+        std::array<BitMatrix, 4> occupancy_bitmaps;
+        std::array<ivec2, 4> occupancy_bitmap_origins{};
+
+        // The bounding box of the non-empty tiles, relative to `pos`. The second corner is exclusive.
+        // In the normal mode this always covers the whole chunk, since the grid is trimmed anyway.
+        ivec2 nonempty_a, nonempty_b;
+
+        // The tile sprites of a `mesh_block_size` block of tiles, cached by `Render()`.
+        struct MeshBlock
+        {
+            // Relative to the top-left corner of the block, rotated by `rot`.
+            ::Render::QuadList mesh;
+            // `rot == -1` means that the mesh is outdated.
+            int rot = -1;
+        };
+        // The mesh blocks covering `cells`, aligned to `pos`. This is empty if all of them are outdated.
+        // Editing a tile only outdates the nearby blocks, so even in the normal mode, where the whole grid is one chunk, we don't re-mesh the whole grid.
+        // Those are lazily updated in `Render()`, hence `mutable`.
+        mutable Array2D<MeshBlock> mesh_blocks;
+    };
+
+    // Maps chunk indices to chunks. In the normal mode, there's only one chunk, at index 0.
+    phmap::flat_hash_map<ivec2, Chunk> chunks;
+
+    bool chunked = false;
 
-    // Maps tile position to their hitbox points, if any.
-    // The hitbox is represented as a bit mask. Pass individual bit numbers to `TileHitboxes::GetHitboxPoints(i)`.
-    // The `..._min` map only contains a minimal set of points, enough to ensure movement without adding new collisions.
-    // The `..._full` map contains enough points to detect any collisions.
-    phmap::flat_hash_map<ivec2, int> hitbox_points_min, hitbox_points_full;
+    // The grid space has the origin in the top-left corner of the grid, and the grid covers `[0, size)` in it.
+    ivec2 size;
+    // The storage space is the grid space plus `storage_offset`. Chunk positions are in the storage space.
+    // In the normal mode this is always zero, and resizing the grid moves the tiles.
+    // In the chunked mode resizing the grid only changes this offset.
+    ivec2 storage_offset;
 
     // The total mass of the grid.
     int mass = 0;
 
+    // See `EditGeneration()`.
+    std::uint64_t edit_generation = 0;
+    inline static std::atomic<std::uint64_t> next_edit_generation = 1;
+    void BumpEditGeneration() {edit_generation = next_edit_generation.fetch_add(1, std::memory_order_relaxed);}
+
+    // The tiles that lost some of their edges since the last `SplitDisconnectedParts()`, in the grid space.
+    // The grid can only fall apart next to those. `Resize()` keeps them in sync with the grid space.
+    std::vector<ivec2> tiles_with_lost_edges;
+
+    // This is passed from `BeginModifyRegion()` to `EndModifyRegion()`.
+    struct ModifyRegionState
+    {
+        ivec2 pos;
+        ivec2 size;
+        ivec2 offset;
+        int starting_mass = 0;
+        bool should_trim = false;
+
+        // The `TileEdgeMask()`s of the region tiles that were in the grid before the edit, in the `vector_range` order.
+        // `edges_pos` and `edges_size` is that rect, in the grid space from before the edit.
+        std::vector<std::uint8_t> starting_edges;
+        ivec2 edges_pos, edges_size;
+
+        // The last chunk returned by `CellForModification()`, to avoid repeated lookups.
+        Chunk *chunk = nullptr;
+        ivec2 chunk_index;
+    };
+
+    // The parts of `ModifyRegion()` that don't depend on the callback.
+    [[nodiscard]] ModifyRegionState BeginModifyRegion(ivec2 pos, ivec2 size);
+    void EndModifyRegion(const ModifyRegionState &state);
+    // Returns a cell for `ModifyRegion()`. `target` is relative to the region. In the chunked mode, creates the chunk if it doesn't exist.
+    [[nodiscard]] Cell &CellForModification(ModifyRegionState &state, ivec2 target);
+
     // This can untrim the grid. Make sure to trim it after you're done adding tiles.
+    // In the chunked mode, the tiles outside of the new rect must be empty.
     void Resize(ivec2 offset, ivec2 new_size);
 
     // Removes empty tiles on the sides.
     // Returns the non-negative trim offset for the top-left corners.
     ivec2 Trim();
 
+    // Returns the edges of a tile that can connect to its neighbors: bit `i` is set if `TileHitboxes::CornerHasEdge(corner, i)`.
+    // Two adjacent tiles are connected if both have the shared edge. Returns 0 for empty tiles and out-of-range positions.
+    [[nodiscard]] int TileEdgeMask(ivec2 pos) const;
+
+    // Returns the chunk index for a tile position in the storage space.
+    [[nodiscard]] ivec2 ChunkIndex(ivec2 storage_pos) const {return chunked ? div_ex(storage_pos, chunk_size) : ivec2();}
+    // Returns the chunk containing this tile position in the storage space, or null if none.
+    [[nodiscard]] const Chunk *FindChunk(ivec2 storage_pos) const;
+    // Creates a new empty chunk in the chunked mode.
+    Chunk &AddChunk(ivec2 index);
+    // Calls `bool func(Chunk &chunk)` (or `const Chunk &`, depending on `G`) for every chunk intersecting a tile rect in the grid space.
+    // The second corner is exclusive. If `func` returns true, stops and returns true.
+    template <typename G, typename F>
+    static bool ForEachChunkInRect(G &grid, ivec2 a, ivec2 b, F &&func);
+    // Calls `bool func(const Chunk &source_chunk, const Chunk &target_chunk, Xf target_to_source)` for all chunk pairs that can overlap.
+    // `target_to_source` maps from the high-res grid space of `target` to the high-res grid space of `source`.
+    // The target is tested at all positions between `target_to_source` offset by `path_a` and `path_b` (in the source space).
+    // The `target_to_source` passed to `func` is from the target chunk space to the source chunk space.
+    // If `func` returns true, stops and returns true.
+    template <typename F>
+    static bool ForEachChunkPair(const Grid &source, const Grid &target, Xf target_to_source, ivec2 path_a, ivec2 path_b, F &&func);
+
     // Update hitbox points for the specified rect.
     // This will also partially update a 1-tile area around the rect, even if the rect is empty.
-    void RegenerateHitboxPointsInRect(ivec2 pos, ivec2 size);
+    // If `update_bitmaps` is false, only updates the point masks. Then you must call `RegenerateBitmaps()` on the affected chunks.
+    void RegenerateHitboxPointsInRect(ivec2 pos, ivec2 size, bool update_bitmaps = true);
+    // Recomputes `nonempty_a` and `nonempty_b` of a chunk, in the chunked mode.
+    static void UpdateChunkBounds(Chunk &chunk);
+
+    // Regenerates all the collision bitmaps of a chunk from scratch, using the tiles and the hitbox point maps.
+    static void RegenerateBitmaps(Chunk &chunk);
+    // Updates a single tile in all occupancy bitmaps. The position is relative to the chunk.
+    // If `clear` is false, assumes that the bits of this tile are zero.
+    static void UpdateTileInOccupancyBitmaps(Chunk &chunk, ivec2 tile_pos, bool clear = true);
+    // Updates a single tile in a hitbox point bitmap.
+    // If `clear` is false, assumes that the bits of this tile are zero.
+    static void UpdateTileInHitboxBitmap(BitMatrix &bitmap, ivec2 tile_pos, int mask, bool clear = true);
+
+    // Marks the mesh blocks intersecting a tile rect in the grid space as outdated. The second corner is exclusive.
+    // Also does it for a 1-tile border around the rect, since the tile sprites depend on their neighbors.
+    void InvalidateMeshesInRect(ivec2 a, ivec2 b);
+    // Regenerates a mesh block of a chunk for the specified grid rotation relative to the camera.
+    void RegenerateMesh(const Chunk &chunk, ivec2 block_index, int rot) const;
 
   public:
     // Maps from the unaligned grid space (origin in the center) to the world space.
@@ -187,12 +464,43 @@ class Grid
 
     void LoadFromFile(Stream::ReadOnlyData data);
 
+    // The grid contents, as read by `ReadFromStream()`.
+    struct StreamData
+    {
+        Xf xf;
+        bool chunked = false;
+        ivec2 size;
+        std::vector<Tile> tiles; // Row by row.
+    };
+
+    // Writes `xf` and the tiles in a compact binary format, for `GridManager::SaveSnapshot()`.
+    void SaveToStream(Stream::Output &output) const;
+    // Reads and validates the data written by `SaveToStream()`. Throws on failure.
+    // This is separate from `Load()`, which is much slower, but can run in parallel for different grids.
+    [[nodiscard]] static StreamData ReadFromStream(Stream::Input &input);
+    // Replaces the grid contents with the data from `ReadFromStream()`.
+    void Load(const StreamData &data);
+
     [[nodiscard]] bool IsEmpty() const;
 
-    [[nodiscard]] const Array2D<Cell> Cells() const {return cells;}
+    // The size of the grid in tiles.
+    [[nodiscard]] ivec2 Size() const {return size;}
+    // Returns a cell. Returns an empty cell if the position is out of range.
+    [[nodiscard]] const Cell &GetCell(ivec2 pos) const;
 
     [[nodiscard]] int Mass() const {return mass;}
 
+    // Whether the grid is stored in `chunk_size` chunks, allocated only when non-empty.
+    // This is intended for very large grids: edits only touch the affected chunks, and collision tests only look at the overlapping chunk pairs.
+    [[nodiscard]] bool IsChunked() const {return chunked;}
+
+    // Changes every time the tiles change. The values are unique across all grids, so two grids with the same value have the same tiles
+    // (e.g. if one was copied from the other). The grids that were never modified have 0.
+    // This is used to cache collision test results.
+    [[nodiscard]] std::uint64_t EditGeneration() const {return edit_generation;}
+    // Converts the grid to or from the chunked mode. This doesn't change the grid contents or its position.
+    void SetChunked(bool new_chunked);
+
     // Resizes the array to include the specified rect.
     // Then calls `void func(auto &&cell)`, where `cell` is `Cell &cell(ivec2 target)`, where `target` is relative so the `pos` parameter of the function itself.
     // `func` is only allowed to modify the specified rect, otherwise an assertion is triggered.
@@ -203,42 +511,28 @@ class Grid
         if (size(any) <= 0)
             return; // Empty rect.
 
-        // Determine the starting mass of the region.
-        int starting_mass = 0;
-        for (ivec2 pos : clamp_min(pos, 0) <= vector_range < clamp_max(pos + size, cells.size()))
-            starting_mass += cells.safe_throwing_at(pos).Mass();
-
-        bool should_trim = pos(any) <= 0 || (pos + size)(any) >= size;
-        ivec2 offset = clamp_min(-pos, 0);
-        Resize(offset, max(clamp_min(pos, 0) + size, offset + cells.size()));
+        ModifyRegionState state = BeginModifyRegion(pos, size);
         func([&](ivec2 target) -> Cell &
         {
             ASSERT(target(all) >= 0 && target(all) < size);
-            return cells.safe_nonthrowing_at(target + pos + offset);
+            return CellForModification(state, target);
         });
-        if (should_trim)
-            offset -= Trim();
-
-        pos += offset;
-        ivec2 clamped_pos = clamp_min(pos);
-        size -= clamped_pos - pos;
-        pos = clamped_pos;
-        clamp_var_max(size, cells.size() - pos);
-
-        // Update the hitbox points.
-        if (size(all) >= 0) // Sic. Since it updates a 1-tile border around the rect, empty rects are workable too.
-            RegenerateHitboxPointsInRect(pos, size);
-
-        // Update the mass.
-        mass -= starting_mass;
-        for (ivec2 pos : pos <= vector_range < size)
-            mass += cells.safe_throwing_at(pos).Mass();
+        EndModifyRegion(state);
     }
 
     // Uses `ModifyRegion` to remove the specified tile.
     // Does nothing if the tile is out of range.
     void RemoveTile(ivec2 pos);
 
+    // Whether some tiles lost their connections to the neighbors since the last `SplitDisconnectedParts()`, so the grid might've fallen apart.
+    [[nodiscard]] bool MightBeDisconnected() const {return !tiles_with_lost_edges.empty();}
+    // Removes the parts of the grid that are no longer connected to the rest, and returns them as separate grids at the same world positions.
+    // The tiles are connected if they share an edge (see `TileEdgeMask()`). One of the parts stays in this grid, usually the largest one.
+    // Only looks at the tiles that lost their edges since the last call, and assumes that the grid was connected before that.
+    // The flood fills from both sides of each removed edge run in lockstep, and stop once all of them meet,
+    // so the cost is proportional to the size of the parts we split off, rather than the whole grid.
+    [[nodiscard]] std::vector<Grid> SplitDisconnectedParts();
+
     // Maps from the grid space (with the origin in the corner, unlike `xf`) to the world space.
     [[nodiscard]] Xf GridToWorld() const;
     [[nodiscard]] Xf WorldToGrid() const {return GridToWorld().Inverse();}
@@ -263,11 +557,40 @@ class Grid
         return CollidesWithPointInGridSpace(WorldToGrid().TransformPixelCenteredPoint(point));
     }
 
+    // The result of `RayCastInGridSpace()`.
+    struct RayHit
+    {
+        // The hit position is `origin + dir * t`.
+        float t = 0;
+        // The tile that was hit.
+        ivec2 tile;
+    };
+
+    // Casts a ray `origin + dir * t` for `t` in `[0, max_t]`, and returns the first tile it hits, respecting the triangular tile shapes.
+    // The ray is in grid space, in normal resolution, in continuous coordinates (pixel `i` spans from `i` to `i+1`). `dir` doesn't have to be normalized.
+    // If the ray starts inside of a tile, returns that tile with `t == 0`. Rays that only touch a tile at a single point (e.g. a corner) don't hit it.
+    [[nodiscard]] std::optional<RayHit> RayCastInGridSpace(fvec2 origin, fvec2 dir, float max_t) const;
+    // Same, but in world space. The `t` is the same in both spaces, since the transformation doesn't scale.
+    [[nodiscard]] std::optional<RayHit> RayCastInWorldSpace(fvec2 origin, fvec2 dir, float max_t) const
+    {
+        Xf to_grid = WorldToGrid();
+        fmat2 matrix(to_grid.Matrix());
+        return RayCastInGridSpace(fvec2(to_grid.pos) + matrix * origin, matrix * dir, max_t);
+    }
+
     // Checks collisiton between two grids.
     // Ignores grid XFs completely, only respects `this_to_other`.
     // If `full` is false, does an incomplete test that only checks the borders.
     // Experiments show that in some case the border is 1 pixel thick, but the diagonal 1-pixel movement is safe.
+    // This tests our hitbox point bitmap against the rotated occupancy bitmap of the other grid, and vice versa, a row of 64 points at a time.
     [[nodiscard]] bool CollidesWithGridWithCustomXfDifference(const Grid &other, Xf this_to_other, bool full) const;
+    // Same, but checks the hitbox points one by one. Gives the same results, but is much slower.
+    [[nodiscard]] bool CollidesWithGridWithCustomXfDifferencePointwise(const Grid &other, Xf this_to_other, bool full) const;
+    // Returns how far (up to `limit`) this grid can move in `dir` before touching `other`.
+    // `dir` is in the grid space of `other`, i.e. the tested transforms are `Xf::Pos(dir * i) * this_to_other`, for `i` in `[1, limit]`.
+    // Returns the largest `n` such that none of the first `n` positions collide. Doesn't check the starting position.
+    // This gives the same result as calling `CollidesWithGridWithCustomXfDifference()` for each step, but is much faster.
+    [[nodiscard]] int MaxFreeTranslationWithCustomXfDifference(const Grid &other, Xf this_to_other, ivec2 dir, int limit, bool full) const;
     // Same, but respects our XF and their XF.
     [[nodiscard]] bool CollidesWithGrid(const Grid &other, bool full) const
     {
@@ -279,7 +602,10 @@ class Grid
         return CollidesWithGridWithCustomXfDifference(other, other_offset.Inverse() * other.WorldToGrid() * GridToWorld() * our_offset, full);
     }
 
-    void Render(Xf camera, std::optional<fvec3> color = {}) const;
+    void Render(Xf camera, std::optional<fvec3> color = {}) const {RenderWithXf(camera, GridToWorld(), color);}
+    // Same, but uses a custom `GridToWorld()` instead of the current one. This doesn't read `xf`.
+    // This is used to render the grids from a `GridManager::RenderSnapshot`, while `GridManager::TickPhysics()` moves them on a different thread.
+    void RenderWithXf(Xf camera, Xf grid_to_world, std::optional<fvec3> color = {}) const;
 
     enum class DebugRenderFlags
     {
@@ -294,8 +620,10 @@ class Grid
         hitbox_points_full = 1 << 3,
         hitbox_points_min  = 1 << 4,
         hitbox_points = hitbox_points_full | hitbox_points_min,
+        // Paints the sleeping grids blue. This is handled by `GridManager::DebugRender()`, since only the manager knows which grids are sleeping.
+        sleeping = 1 << 5,
 
-        all = aabb | coordinate_system | tile_origin | hitbox_points,
+        all = aabb | coordinate_system | tile_origin | hitbox_points | sleeping,
     };
     IMP_ENUM_FLAG_OPERATORS_IN_CLASS(DebugRenderFlags)
 
@@ -3,11 +3,26 @@
 #include "game/main.h"
 #include "utils/coroutines.h"
 
+#if IMP_GRID_MANAGER_SPATIAL_HASH
+// Moving within a cell is free, so the hash doesn't need margins.
+static constexpr int spatial_hash_cell_size = tile_size * 4;
+#else
 static constexpr int aabb_tree_margin = tile_size;
 // static constexpr int aabb_tree_margin = 0; // For testing only.
+#endif
+
+// If enabled, the whole AABB tree is validated at the end of each physics tick.
+// This is on top of `IMP_AUTO_VALIDATE_AABB_TREES`, which only validates the parts of the tree touched by each change.
+#ifndef IMP_GRID_MANAGER_VALIDATE_AABB_TREE_EACH_TICK
+#define IMP_GRID_MANAGER_VALIDATE_AABB_TREE_EACH_TICK 0
+#endif
 
 GridManager::GridManager()
+    #if IMP_GRID_MANAGER_SPATIAL_HASH
+    : aabb_tree(ivec2(spatial_hash_cell_size))
+    #else
     : aabb_tree(ivec2(aabb_tree_margin))
+    #endif
 {}
 
 GridManager::aabb_t GridManager::GetGridAabb(const Grid &grid, Xf offset)
@@ -15,7 +30,7 @@ GridManager::aabb_t GridManager::GetGridAabb(const Grid &grid, Xf offset)
     Xf xf = grid.GridToWorld() * offset;
     aabb_t ret;
     ret.a = xf * ivec2(0);
-    ret.b = xf * (grid.Cells().size() * tile_size);
+    ret.b = xf * (grid.Size() * tile_size);
     sort_two_var(ret.a, ret.b);
     return ret;
 }
@@ -30,23 +45,258 @@ GridId GridManager::AddGrid(GridObject obj) noexcept
 
     GridId ret;
     ret.index = grid_ids.InsertAny();
-    grids[ret.index] = std::move(obj);
-    grids[ret.index]->aabb_node_index = aabb_tree.AddNode(GetGridAabb(grids[ret.index].value().grid), TreeData{.grid_id = ret});
+    // The new ID is always the last one in `grid_ids`, so we append to `hot`.
+    hot.PushBack(obj, aabb_tree.AddNode(GetGridAabb(obj.grid), TreeData{.grid_id = ret}));
+    grids[ret.index] = std::move(obj.grid);
+
+    return ret;
+}
+
+void GridManager::HotData::PushBack(const GridObject &obj, int aabb_node)
+{
+    vel.push_back(obj.vel);
+    vel_lag.push_back(obj.vel_lag);
+    vel_owed.push_back(obj.vel_owed);
+    infinite_mass.push_back(obj.infinite_mass);
+    mass.push_back(obj.grid.Mass());
+    aabb_node_index.push_back(aabb_node);
+    sleeping.push_back(false);
+}
+
+void GridManager::HotData::EraseUnordered(std::size_t index)
+{
+    auto Erase = [&](auto &vec)
+    {
+        vec[index] = vec.back();
+        vec.pop_back();
+    };
+    Erase(vel);
+    Erase(vel_lag);
+    Erase(vel_owed);
+    Erase(infinite_mass);
+    Erase(mass);
+    Erase(aabb_node_index);
+    Erase(sleeping);
+}
 
+GridObject GridManager::ExtractGridObject(GridId id)
+{
+    std::size_t i = DenseIndex(id);
+    GridObject ret;
+    ret.grid = std::move(grids.at(id.index).value());
+    ret.vel = hot.vel[i];
+    ret.vel_lag = hot.vel_lag[i];
+    ret.vel_owed = hot.vel_owed[i];
+    ret.infinite_mass = hot.infinite_mass[i];
     return ret;
 }
 
+void GridManager::StoreGridObject(GridId id, GridObject &&obj)
+{
+    std::size_t i = DenseIndex(id);
+    hot.vel[i] = obj.vel;
+    hot.vel_lag[i] = obj.vel_lag;
+    hot.vel_owed[i] = obj.vel_owed;
+    hot.infinite_mass[i] = obj.infinite_mass;
+    hot.mass[i] = obj.grid.Mass();
+    hot.sleeping[i] = false;
+    Grid &grid = grids.at(id.index).value();
+    grid = std::move(obj.grid);
+    aabb_tree.ModifyNode(hot.aabb_node_index[i], GetGridAabb(grid), round_maxabs(hot.vel[i]));
+}
+
+void GridManager::SplitDisconnectedGrid(GridId id)
+{
+    Grid &grid = grids.at(id.index).value();
+    std::vector<Grid> parts = grid.SplitDisconnectedParts();
+    if (parts.empty())
+        return;
+
+    std::size_t i = DenseIndex(id);
+    hot.mass[i] = grid.Mass();
+    aabb_tree.ModifyNode(hot.aabb_node_index[i], GetGridAabb(grid), round_maxabs(hot.vel[i]));
+
+    GridObject template_obj;
+    template_obj.vel = hot.vel[i];
+    template_obj.vel_lag = hot.vel_lag[i];
+    template_obj.vel_owed = hot.vel_owed[i];
+    template_obj.infinite_mass = hot.infinite_mass[i];
+
+    for (Grid &part : parts)
+    {
+        GridObject new_obj = template_obj;
+        new_obj.grid = std::move(part);
+        AddGrid(std::move(new_obj));
+    }
+}
+
 void GridManager::RemoveGrid(GridId id) noexcept
 {
-    auto &obj = grids.at(id.index);
-    aabb_tree.RemoveNode(obj.value().aabb_node_index);
-    obj.reset();
+    std::size_t i = DenseIndex(id);
+    aabb_tree.RemoveNode(hot.aabb_node_index[i]);
+    grids.at(id.index).reset();
     grid_ids.EraseUnordered(id.index);
+    hot.EraseUnordered(i);
+}
+
+GridObjectView GridManager::GetGrid(GridId id) const
+{
+    std::size_t i = DenseIndex(id);
+    return {
+        .grid = grids.at(id.index).value(),
+        .vel = hot.vel[i],
+        .vel_lag = hot.vel_lag[i],
+        .vel_owed = hot.vel_owed[i],
+        .infinite_mass = bool(hot.infinite_mass[i]),
+    };
+}
+
+// The first bytes of the snapshots.
+static constexpr std::uint32_t snapshot_magic = 0x53444947; // `GIDS` in little endian.
+static constexpr std::uint32_t snapshot_version = 1;
+
+std::vector<std::uint8_t> GridManager::SaveSnapshot(bool compress) const
+{
+    std::vector<std::uint8_t> body;
+    {
+        Stream::Output output = Stream::Output::Container(body, Stream::capacity_t(0x10000));
+
+        output.WriteByte(initial_dir_for_physics_tick);
+
+        // The whole ID set, including the unused IDs. Their order determines the IDs of the new grids.
+        output.WriteLittle<std::int32_t>(grid_ids.Capacity());
+        output.WriteLittle<std::int32_t>(grid_ids.ElemCount());
+        for (int i = 0; i < grid_ids.Capacity(); i++)
+            output.WriteLittle<std::int32_t>(grid_ids.GetElem(i));
+
+        for (int i = 0; i < grid_ids.ElemCount(); i++)
+        {
+            for (float x : {hot.vel[i].x, hot.vel[i].y, hot.vel_lag[i].x, hot.vel_lag[i].y})
+                output.WriteLittle<std::uint32_t>(std::bit_cast<std::uint32_t>(x));
+            output.WriteLittle<std::int32_t>(hot.vel_owed[i].x).WriteLittle<std::int32_t>(hot.vel_owed[i].y);
+            output.WriteByte(hot.infinite_mass[i]);
+            grids[grid_ids.GetElem(i)]->SaveToStream(output);
+        }
+
+        output.Flush();
+    }
+
+    std::vector<std::uint8_t> ret;
+    {
+        Stream::Output output = Stream::Output::Container(ret);
+        output.WriteLittle<std::uint32_t>(snapshot_magic);
+        output.WriteLittle<std::uint32_t>(snapshot_version);
+        output.WriteByte(compress);
+        output.Flush();
+    }
+
+    if (compress)
+    {
+        std::size_t header_size = ret.size();
+        ret.resize(header_size + Archive::MaxCompressedSize(body.data(), body.data() + body.size()));
+        std::uint8_t *end = Archive::Compress(body.data(), body.data() + body.size(), ret.data() + header_size, ret.data() + ret.size());
+        ret.resize(end - ret.data());
+    }
+    else
+    {
+        ret.insert(ret.end(), body.begin(), body.end());
+    }
+
+    return ret;
 }
 
-const GridObject &GridManager::GetGrid(GridId id) const
+void GridManager::LoadSnapshot(const std::uint8_t *begin, const std::uint8_t *end)
 {
-    return grids.at(id.index).value();
+    Stream::Input header_input(Stream::ReadOnlyData::mem_reference(begin, end));
+    if (header_input.ReadLittle<std::uint32_t>() != snapshot_magic)
+        Program::Error(header_input.GetExceptionPrefix() + "This is not a grid snapshot.");
+    if (std::uint32_t version = header_input.ReadLittle<std::uint32_t>(); version != snapshot_version)
+        Program::Error(header_input.GetExceptionPrefix() + FMT("Unsupported grid snapshot version: {}.", version));
+    bool compressed = header_input.ReadByte();
+
+    const std::uint8_t *body_begin = begin + header_input.Position();
+    std::vector<std::uint8_t> uncompressed_body;
+    if (compressed)
+    {
+        uncompressed_body.resize(Archive::UncompressedSize(body_begin, end));
+        Archive::Uncompress(body_begin, end, uncompressed_body.data());
+    }
+    Stream::Input input(compressed
+        ? Stream::ReadOnlyData::mem_reference(uncompressed_body.data(), uncompressed_body.data() + uncompressed_body.size())
+        : Stream::ReadOnlyData::mem_reference(body_begin, end)
+    );
+
+    // Load everything into temporary variables first, to leave the manager unchanged on failure.
+
+    bool new_initial_dir = input.ReadByte();
+
+    int capacity = input.ReadLittle<std::int32_t>();
+    int count = input.ReadLittle<std::int32_t>();
+    if (capacity < 0 || count < 0 || count > capacity || std::size_t(capacity) * 4 > input.RemainingBytes())
+        Program::Error(input.GetExceptionPrefix() + "Invalid grid count.");
+
+    // Insert the IDs in the saved order, including the unused ones, then remove the unused ones from the end. This recreates the same order.
+    SparseSet<int> new_grid_ids(capacity);
+    for (int i = 0; i < capacity; i++)
+    {
+        int id = input.ReadLittle<std::int32_t>();
+        if (id < 0 || id >= capacity || !new_grid_ids.Insert(id))
+            Program::Error(input.GetExceptionPrefix() + FMT("Invalid grid ID: {}.", id));
+    }
+    for (int i = capacity - 1; i >= count; i--)
+        new_grid_ids.EraseUnordered(new_grid_ids.GetElem(i));
+
+    // Read everything first, then build the grids in parallel, since that's the slow part.
+    std::vector<std::optional<Grid>> new_grids(capacity);
+    HotData new_hot;
+    std::vector<Grid::StreamData> grid_data;
+    grid_data.reserve(count);
+    for (int i = 0; i < count; i++)
+    {
+        new_grids[new_grid_ids.GetElem(i)].emplace();
+
+        // The grid masses and the AABB nodes are filled below.
+        GridObject obj;
+        float floats[4];
+        for (float &x : floats)
+            x = std::bit_cast<float>(input.ReadLittle<std::uint32_t>());
+        obj.vel = fvec2(floats[0], floats[1]);
+        obj.vel_lag = fvec2(floats[2], floats[3]);
+        obj.vel_owed.x = input.ReadLittle<std::int32_t>();
+        obj.vel_owed.y = input.ReadLittle<std::int32_t>();
+        obj.infinite_mass = input.ReadByte();
+        new_hot.PushBack(obj, i);
+        grid_data.push_back(Grid::ReadFromStream(input));
+    }
+    input.ExpectEnd();
+
+    auto LoadGrid = [&](std::size_t i)
+    {
+        new_grids[new_grid_ids.GetElem(int(i))]->Load(grid_data[i]);
+    };
+    if (thread_pool)
+        thread_pool->ParallelFor(grid_data.size(), LoadGrid, 16);
+    else
+        for (std::size_t i = 0; i < grid_data.size(); i++)
+            LoadGrid(i);
+
+    // `AabbTree::Build()` gives the leaves the same indices as in this list.
+    std::vector<std::pair<aabb_t, TreeData>> tree_leaves;
+    tree_leaves.reserve(count);
+    for (int i = 0; i < count; i++)
+    {
+        GridId id{.index = new_grid_ids.GetElem(i)};
+        const Grid &grid = new_grids[id.index].value();
+        new_hot.mass[i] = grid.Mass();
+        tree_leaves.emplace_back(GetGridAabb(grid), TreeData{.grid_id = id});
+    }
+
+    aabb_tree.Build(tree_leaves);
+    grid_ids = std::move(new_grid_ids);
+    grids = std::move(new_grids);
+    hot = std::move(new_hot);
+    initial_dir_for_physics_tick = new_initial_dir;
+    contact_cache.clear();
 }
 
 void GridManager::Render(Xf camera) const
@@ -62,7 +312,46 @@ void GridManager::Render(Xf camera) const
     });
     std::sort(ids.begin(), ids.end());
     for (GridId id : ids)
-        GetGrid(id).grid.Render(camera);
+        grids[id.index]->Render(camera);
+}
+
+void GridManager::TakeRenderSnapshot(RenderSnapshot &target) const
+{
+    target.entries.clear();
+    target.entries.reserve(std::size_t(GridCount()));
+
+    // Going over the indices in order gives us the entries sorted by ID.
+    for (std::size_t i = 0; i < grids.size(); i++)
+    {
+        if (!grids[i])
+            continue;
+        const Grid &grid = *grids[i];
+        target.entries.push_back({
+            .id = GridId{.index = int(i)},
+            .grid_to_world = grid.GridToWorld(),
+            .aabb = GetGridAabb(grid),
+            .edit_generation = grid.EditGeneration(),
+        });
+    }
+}
+
+void GridManager::Render(const RenderSnapshot &snapshot, Xf camera) const
+{
+    aabb_t aabb;
+    aabb.a = camera * (-screen_size / 2);
+    aabb.b = camera * ( screen_size / 2);
+    sort_two_var(aabb.a, aabb.b);
+
+    for (const RenderSnapshot::Entry &entry : snapshot.entries)
+    {
+        if (!aabb.Intersects(entry.aabb))
+            continue;
+
+        ASSERT(entry.id.index < int(grids.size()) && grids[entry.id.index], "The grid from the render snapshot no longer exists.");
+        const Grid &grid = *grids[entry.id.index];
+        ASSERT(grid.EditGeneration() == entry.edit_generation, "The grid tiles were modified after taking the render snapshot.");
+        grid.RenderWithXf(camera, entry.grid_to_world);
+    }
 }
 
 void GridManager::DebugRender(Xf camera, Grid::DebugRenderFlags flags) const
@@ -78,7 +367,18 @@ void GridManager::DebugRender(Xf camera, Grid::DebugRenderFlags flags) const
     });
     std::sort(ids.begin(), ids.end());
     for (GridId id : ids)
-        GetGrid(id).grid.DebugRender(camera, flags);
+    {
+        if (bool(flags & Grid::DebugRenderFlags::sleeping) && IsGridSleeping(id))
+            grids[id.index]->Render(camera, fvec3(0.2f, 0.4f, 1));
+        grids[id.index]->DebugRender(camera, flags);
+    }
+}
+
+void GridManager::SetSleepingAllowed(bool allowed)
+{
+    allow_sleeping = allowed;
+    if (!allowed)
+        std::fill(hot.sleeping.begin(), hot.sleeping.end(), false);
 }
 
 void GridManager::TickPhysics()
@@ -97,470 +397,936 @@ void GridManager::TickPhysics()
     struct Entry
     {
         ivec2 remaining_vel;
-        phmap::flat_hash_set<GridId> collision_candidates;
+        std::vector<GridId> collision_candidates;
+
+        // Set when the grid can't move anymore during the pixel-by-pixel movement. See below.
+        bool blocked = false;
     };
 
     struct ExtendedEntry
     {
-        phmap::flat_hash_set<GridId> collision_candidates;
+        // Sorted by index. This list is symmetric: if A is a candidate of B, then B is a candidate of A.
+        std::vector<GridId> collision_candidates;
 
         // This is used by the circular obstruction avoidance algorithm below.
         // (0,0) means that the grid wasn't moved yet.
         ivec2 circular_dir;
+        // Where the collision test results of this grid start in `Island::circular_collision_memo`.
+        std::size_t circular_memo_offset = 0;
+
+        // Set after the impulse transfer processes this grid, to process each pair of grids only once.
+        bool impulse_transfer_done = false;
+    };
 
-        // // If true, circular movement in that 8-direction has failed.
-        // std::array<bool, 8> failed_circular_dirs{};
+    // Stores the time since the previous call (or since the start of the tick) to `target`, in seconds.
+    auto phase_start = std::chrono::steady_clock::now();
+    auto EndPhase = [&](double &target)
+    {
+        auto now = std::chrono::steady_clock::now();
+        target = std::chrono::duration<double>(now - phase_start).count();
+        phase_start = now;
     };
 
+    double initial_validation_time = aabb_tree.ValidationTime();
+
     std::vector<GridId> aabb_update_entries;
     phmap::flat_hash_map<GridId, Entry> entries;
     phmap::flat_hash_map<GridId, ExtendedEntry> entries_ex;
 
-    // Populate entries.
-    // Also move unobstructed objects early.
-    for (int i = 0; i < GridCount(); i++)
+    // Runs `func(i)` for `i` in `[0, count)`, on the thread pool if we have one.
+    auto ParallelFor = [&](std::size_t count, auto &&func, std::size_t grain_size = 1)
     {
-        GridId grid_id = GetGridId(i);
+        if (thread_pool)
+        {
+            thread_pool->ParallelFor(count, func, grain_size);
+        }
+        else
+        {
+            for (std::size_t i = 0; i < count; i++)
+                func(std::as_const(i));
+        }
+    };
 
-        GridObject &obj = grids[grid_id.index].value();
+    // The grids processed by this tick, in the order of their dense indices. Those are the awake grids, including the ones woken up below.
+    // We iterate over this instead of the maps, to make the results independent of the sleeping grids.
+    struct TickGrid
+    {
+        GridId id;
+        std::size_t dense_index = 0;
+        // Null if the grid has no collision candidates.
+        decltype(entries)::value_type *entry = nullptr;
+        decltype(entries_ex)::value_type *entry_ex = nullptr;
+    };
+    std::vector<TickGrid> tick_grids;
 
-        Entry new_entry;
-        new_entry.remaining_vel = Math::round_with_compensation(obj.vel, obj.vel_lag);
-        obj.vel_lag *= 0.99f;
+    { // Populate entries.
+        // Also move unobstructed objects early.
+        // The per-grid parts only touch one grid at a time, so they run in parallel.
+        // The results are then inserted into the maps in the dense order.
 
-        // Repay `vel_owed`.
-        for (int i = 0; i < 2; i++)
+        struct NewEntry
         {
-            if (new_entry.remaining_vel[i] != 0)
-            {
-                if (sign(new_entry.remaining_vel[i]) == obj.vel_owed[i])
-                    new_entry.remaining_vel[i] -= sign(new_entry.remaining_vel[i]);
-                obj.vel_owed[i] = 0;
-            }
-        }
+            Entry entry;
+            ExtendedEntry entry_ex;
 
-        ExtendedEntry new_entry_ex;
+            // The index in `hot`.
+            std::size_t dense_index = 0;
 
-        // If this entry is going to move, queue it for AABB update.
-        if (new_entry.remaining_vel != 0)
-            aabb_update_entries.push_back(grid_id);
+            // The area this grid can touch during this tick.
+            aabb_t swept_aabb;
+        };
+        std::vector<NewEntry> new_entries;
+        new_entries.reserve(GridCount());
 
-        // Find potentially colliding grids.
-        // Note the final expand by 1 pixel, which lets us reuse the grid list for impulse transfer later.
-        aabb_t expanded_aabb = GetGridAabb(obj.grid).ExpandInDir(new_entry.remaining_vel).Expand(ivec2(1));
-        CollideAabbApprox(expanded_aabb, [&](GridId other_grid_id)
-        {
-            if (other_grid_id != grid_id)
-                new_entry_ex.collision_candidates.insert(other_grid_id);
-            return false;
-        });
+        // Maps grid indices to indices in `new_entries`.
+        std::vector<int> new_entry_indices(grids.size(), -1);
 
-        // If this grid can't hit any other grids, move it early.
-        if (new_entry_ex.collision_candidates.empty())
-            obj.grid.xf.pos += new_entry.remaining_vel;
-        else
-            entries.try_emplace(grid_id, std::move(new_entry));
+        auto AddEntry = [&](std::size_t dense_index)
+        {
+            hot.sleeping[dense_index] = false;
+            new_entry_indices[GetGridId(int(dense_index)).index] = int(new_entries.size());
+            new_entries.emplace_back().dense_index = dense_index;
+        };
 
-        // Queue for impulse transfer.
-        // We add all grids here, even if they have zero velocity, because we store collision candidates in this list.
-        entries_ex.try_emplace(grid_id, std::move(new_entry_ex));
-    }
-    // Extend `collision_candidates` to make it symmetric.
-    // Yes, we extended the source object hitbox when looking for candidates,
-    // but we couldn't extend the candidate hitboxes, so this is still needed.
-    for (auto &[id, entry] : entries_ex)
-    {
-        for (GridId candidate : entry.collision_candidates)
+        for (std::size_t i = 0; i < hot.sleeping.size(); i++)
         {
-            if (auto it = entries_ex.find(candidate); it != entries_ex.end())
-                it->second.collision_candidates.insert(id);
+            if (!hot.sleeping[i])
+                AddEntry(i);
+            else
+                hot.vel_lag[i] *= 0.99f; // Decay the lag as if the grid was awake, see below.
         }
-    }
-    for (auto &[id, entry] : entries)
-        entry.collision_candidates = entries_ex.at(id).collision_candidates;
 
-    // Advance the objects by a single pixel.
-    // First, try both directions at the same time. On failure, try the directions separately.
-    while (true)
-    {
-        bool any_progress = false;
+        // The sleeping grids touched by the awake ones are woken up, and join the tick. Then the grids they touch are woken up, and so on.
+        // We do this in rounds, each round finds the collision candidates for the grids added by the previous one.
+        // The first round finds all pairs involving the initially awake grids, and the later rounds only look for pairs between the woken up grids.
+        std::size_t num_initially_awake = new_entries.size();
+        auto IsInitiallyAwake = [&](int entry_index){return entry_index != -1 && std::size_t(entry_index) < num_initially_awake;};
 
-        for (auto it = entries.begin(); it != entries.end();)
+        std::size_t round_begin = 0, round_end = 0;
+
+        // Returns the swept AABB of any grid. The ones that were sleeping at the beginning of this round don't move, and don't have it computed yet.
+        auto GetSweptAabb = [&](GridId id) -> aabb_t
         {
-            Entry &entry = it->second;
-            ivec2 dir = sign(entry.remaining_vel);
+            int entry_index = new_entry_indices[id.index];
+            return entry_index != -1 && std::size_t(entry_index) < round_end ? new_entries[entry_index].swept_aabb : GetGridAabb(*grids[id.index]).Expand(ivec2(1));
+        };
 
-            GridObject &obj = grids[it->first.index].value();
+        while (round_begin < new_entries.size())
+        {
+            round_end = new_entries.size();
+            bool first_round = round_begin == 0;
 
-            bool can_move = std::none_of(entry.collision_candidates.begin(), entry.collision_candidates.end(), [&](GridId id)
+            // Determine how far each grid moves this tick. This only touches the dense velocity arrays.
+            // The woken up grids have zero velocity and their lag was already decayed above, so this only runs in the first round.
+            for (std::size_t i = round_begin; first_round && i < round_end; i++)
             {
-                const GridObject &other_obj = grids[id.index].value();
-                return obj.grid.CollidesWithGridWithCustomXfDifference(other_obj.grid, other_obj.grid.WorldToGrid() * Xf::Pos(dir) * obj.grid.GridToWorld(), false);
-            });
+                std::size_t d = new_entries[i].dense_index;
+                ivec2 remaining_vel = Math::round_with_compensation(hot.vel[d], hot.vel_lag[d]);
+                hot.vel_lag[d] *= 0.99f;
+
+                // Repay `vel_owed`.
+                for (int j = 0; j < 2; j++)
+                {
+                    if (remaining_vel[j] != 0)
+                    {
+                        if (sign(remaining_vel[j]) == hot.vel_owed[d][j])
+                            remaining_vel[j] -= sign(remaining_vel[j]);
+                        hot.vel_owed[d][j] = 0;
+                    }
+                }
 
-            if (can_move)
+                new_entries[i].entry.remaining_vel = remaining_vel;
+            }
+
+            ParallelFor(round_end - round_begin, [&](std::size_t i)
+            {
+                NewEntry &new_entry = new_entries[round_begin + i];
+                GridId grid_id = GetGridId(int(new_entry.dense_index));
+
+                // Note the final expand by 1 pixel, which lets us reuse the candidate lists for impulse transfer later.
+                new_entry.swept_aabb = GetGridAabb(*grids[grid_id.index]).ExpandInDir(new_entry.entry.remaining_vel).Expand(ivec2(1));
+            }, 64);
+
+            // Make sure the tree nodes cover the swept areas. This is usually a no-op, thanks to the tree margins.
+            // The sleeping grids don't need this, since they were enlarged when they fell asleep.
+            for (std::size_t i = round_begin; i < round_end; i++)
+                aabb_tree.EnlargeNode(hot.aabb_node_index[new_entries[i].dense_index], new_entries[i].swept_aabb);
+
+            if (first_round && num_initially_awake * 2 >= std::size_t(GridCount()))
             {
-                obj.grid.xf.pos += dir;
-                entry.remaining_vel -= dir;
-                any_progress = true;
+                // Most grids are awake, so find the pairs in a single pass over the AABB tree.
+                aabb_tree.CollidePairs([&](int node_a, int node_b)
+                {
+                    GridId grid_id_a = aabb_tree.GetNodeUserData(node_a).grid_id;
+                    GridId grid_id_b = aabb_tree.GetNodeUserData(node_b).grid_id;
+                    if (!IsInitiallyAwake(new_entry_indices[grid_id_a.index]))
+                        std::swap(grid_id_a, grid_id_b);
+                    if (!IsInitiallyAwake(new_entry_indices[grid_id_a.index]))
+                        return false; // The later rounds handle those.
+
+                    // The tree nodes are larger than necessary, so check the actual swept areas.
+                    if (!new_entries[new_entry_indices[grid_id_a.index]].swept_aabb.Intersects(GetSweptAabb(grid_id_b)))
+                        return false;
+
+                    if (new_entry_indices[grid_id_b.index] == -1)
+                        AddEntry(DenseIndex(grid_id_b));
+                    new_entries[new_entry_indices[grid_id_a.index]].entry_ex.collision_candidates.push_back(grid_id_b);
+                    new_entries[new_entry_indices[grid_id_b.index]].entry_ex.collision_candidates.push_back(grid_id_a);
+                    return false;
+                });
             }
             else
             {
-                for (bool axis_dir_index : initial_dir_for_physics_tick ? std::array{true, false} : std::array{false, true})
+                // Query the tree for each grid. Each pair between the grids of this round is found from both sides.
+                ParallelFor(round_end - round_begin, [&](std::size_t i)
                 {
-                    ivec2 axis_dir;
-                    axis_dir[axis_dir_index] = dir[axis_dir_index];
-
-                    if (!axis_dir)
-                        continue;
+                    NewEntry &new_entry = new_entries[round_begin + i];
+                    GridId grid_id = GetGridId(int(new_entry.dense_index));
 
-                    bool axis_can_move = std::none_of(entry.collision_candidates.begin(), entry.collision_candidates.end(), [&](GridId id)
+                    aabb_tree.CollideAabb(new_entry.swept_aabb, [&](int node)
                     {
-                        const GridObject &other_obj = grids[id.index].value();
-                        return obj.grid.CollidesWithGridWithCustomXfDifference(other_obj.grid, other_obj.grid.WorldToGrid() * Xf::Pos(axis_dir) * obj.grid.GridToWorld(), false);
+                        GridId other_id = aabb_tree.GetNodeUserData(node).grid_id;
+                        if (other_id == grid_id || (!first_round && IsInitiallyAwake(new_entry_indices[other_id.index])))
+                            return false;
+
+                        // The tree nodes are larger than necessary, so check the actual swept areas.
+                        if (new_entry.swept_aabb.Intersects(GetSweptAabb(other_id)))
+                            new_entry.entry_ex.collision_candidates.push_back(other_id);
+                        return false;
                     });
+                }, 16);
 
-                    if (axis_can_move)
+                // Wake up the sleeping candidates.
+                for (std::size_t i = round_begin; i < round_end; i++)
+                {
+                    GridId grid_id = GetGridId(int(new_entries[i].dense_index));
+                    for (GridId other_id : new_entries[i].entry_ex.collision_candidates)
                     {
-                        obj.grid.xf.pos += axis_dir;
-                        entry.remaining_vel -= axis_dir;
-                        any_progress = true;
+                        int &other_entry_index = new_entry_indices[other_id.index];
+                        if (other_entry_index == -1)
+                            AddEntry(DenseIndex(other_id));
+
+                        // The later rounds don't look for the pairs with the initially awake grids, so add them from this side.
+                        if (first_round && !IsInitiallyAwake(other_entry_index))
+                            new_entries[other_entry_index].entry_ex.collision_candidates.push_back(grid_id);
                     }
                 }
             }
 
-            if (entry.remaining_vel == 0)
-                it = entries.erase(it);
+            round_begin = round_end;
+        }
+
+        // Restore the dense order, which the woken up grids broke.
+        if (new_entries.size() != num_initially_awake)
+            std::sort(new_entries.begin(), new_entries.end(), [](const NewEntry &a, const NewEntry &b){return a.dense_index < b.dense_index;});
+
+        ParallelFor(new_entries.size(), [&](std::size_t i)
+        {
+            NewEntry &new_entry = new_entries[i];
+
+            // Sort the candidates, to make the results independent of the tree structure.
+            std::sort(new_entry.entry_ex.collision_candidates.begin(), new_entry.entry_ex.collision_candidates.end());
+
+            // If this grid can't hit any other grids, move it early.
+            if (new_entry.entry_ex.collision_candidates.empty())
+                grids[GetGridId(int(new_entry.dense_index)).index]->xf.pos += new_entry.entry.remaining_vel;
             else
-                it++;
+                new_entry.entry.collision_candidates = new_entry.entry_ex.collision_candidates;
+        }, 64);
+
+        // Reserve to keep the pointers in `tick_grids` valid.
+        entries.reserve(new_entries.size());
+        entries_ex.reserve(new_entries.size());
+        tick_grids.reserve(new_entries.size());
+        for (NewEntry &new_entry : new_entries)
+        {
+            GridId grid_id = GetGridId(int(new_entry.dense_index));
+            TickGrid &tick_grid = tick_grids.emplace_back();
+            tick_grid.id = grid_id;
+            tick_grid.dense_index = new_entry.dense_index;
+
+            // If this entry is going to move, queue it for AABB update.
+            if (new_entry.entry.remaining_vel != 0)
+                aabb_update_entries.push_back(grid_id);
+
+            // Entries without collision candidates were already moved above.
+            if (!new_entry.entry_ex.collision_candidates.empty())
+                tick_grid.entry = &*entries.try_emplace(grid_id, std::move(new_entry.entry)).first;
+
+            // Queue for impulse transfer.
+            // We add all grids here, even if they have zero velocity, because we store collision candidates in this list.
+            tick_grid.entry_ex = &*entries_ex.try_emplace(grid_id, std::move(new_entry.entry_ex)).first;
+        }
+    }
+
+
+    // Split the grids into islands, connected through `collision_candidates`.
+    // Grids from different islands can't affect each other during this tick, so the islands are processed independently (and in parallel).
+    // Each island processes its grids in the same order as the serial algorithm would, so the results don't depend on the thread count.
+    // From this point on, the maps are not modified structurally, only their elements are.
+    // Instead of erasing the entries with no remaining velocity, we remove them from the islands, which is equivalent.
+
+    // The circular obstruction resolution is a backtracking search. Moving a grid requires moving the grids it now collides with,
+    // each in one of several directions, and so on. We keep the list of grids that still need to move (the goals) as a linked list,
+    // and remember every choice of direction we make, along with how to undo it, to return to it if a later goal can't be satisfied.
+    struct CircularGoal
+    {
+        GridId id;
+        // The next goal in `Island::circular_goals`, or -1 if none.
+        int next = -1;
+        // The 8-directions to try, in order.
+        std::array<std::int8_t, 5> dirs{};
+        int num_dirs = 0;
+    };
+    struct CircularChoice
+    {
+        // The goal we're choosing the direction for, an index in `Island::circular_goals`.
+        int goal = 0;
+        // The index of the next direction to try in the goal.
+        int next_dir = 0;
+        // The sizes of `Island::circular_goals` and `Island::circular_undo` when the choice was made.
+        std::size_t num_goals = 0;
+        std::size_t num_undo = 0;
+    };
+    // Undoes moving a grid.
+    struct CircularUndo
+    {
+        Grid *grid = nullptr;
+        ExtendedEntry *entry_ex = nullptr;
+        // Null if the grid had no remaining velocity.
+        Entry *entry = nullptr;
+        ivec2 prev_remaining_vel;
+    };
+
+    struct Island
+    {
+        // Entries that still need to move, in the order of `tick_grids`.
+        std::vector<decltype(entries)::value_type *> moving;
+        // All grids of this island, in the order of `tick_grids`.
+        std::vector<decltype(entries_ex)::value_type *> members;
+        // Same, but sorted for the impulse transfer.
+        std::vector<decltype(entries_ex)::value_type *> members_sorted_by_speed;
+        // The contact cache entries created by the impulse transfer. They're added to `contact_cache` after it finishes.
+        std::vector<std::pair<ContactCacheKey, ContactCacheEntry>> new_contacts;
+
+        // Whether the last pass of the circular obstruction resolution made any progress.
+        bool any_circular_progress = false;
+
+        // The state of the circular obstruction resolution. The vectors are reused between attempts.
+        std::vector<CircularGoal> circular_goals;
+        std::vector<CircularChoice> circular_choices;
+        std::vector<CircularUndo> circular_undo;
+        // The collision tests of the circular obstruction resolution only depend on the difference of `circular_dir`s of the two grids.
+        // For each grid and each of its candidates (see `ExtendedEntry::circular_memo_offset`), the low 32 bits tell which of the 25 differences
+        // were tested, and the high 32 bits have the results. This is reset when the grids move for real.
+        std::vector<std::uint64_t> circular_collision_memo;
+    };
+    std::vector<Island> islands;
+    // Maps grid indices to island indices.
+    phmap::flat_hash_map<GridId, int> grid_islands;
+    {
+        // A union-find over grid indices.
+        std::vector<int> parents(grids.size(), -1);
+        auto FindRoot = [&](int index)
+        {
+            int root = index;
+            while (parents[root] != -1)
+                root = parents[root];
+            while (parents[index] != -1)
+                index = std::exchange(parents[index], root);
+            return root;
+        };
+        for (const auto &[id, entry] : entries_ex)
+        {
+            for (GridId candidate : entry.collision_candidates)
+            {
+                int a = FindRoot(id.index);
+                int b = FindRoot(candidate.index);
+                if (a != b)
+                    parents[b] = a;
+            }
         }
 
-        if (!any_progress)
-            break;
+        // Number the islands in the order of their first grid. Ignore grids without candidates, they don't need any more processing.
+        phmap::flat_hash_map<int, int> root_to_island;
+        for (const TickGrid &tick_grid : tick_grids)
+        {
+            auto &elem = *tick_grid.entry_ex;
+            if (elem.second.collision_candidates.empty())
+                continue;
+            auto [it, is_new] = root_to_island.try_emplace(FindRoot(elem.first.index), int(islands.size()));
+            if (is_new)
+                islands.emplace_back();
+            islands[it->second].members.push_back(&elem);
+            grid_islands.try_emplace(elem.first, it->second);
+        }
+        for (const TickGrid &tick_grid : tick_grids)
+        {
+            if (tick_grid.entry)
+                islands[grid_islands.at(tick_grid.id)].moving.push_back(tick_grid.entry);
+        }
     }
 
-    // Try to resolve any circular obstructions.
-    if (!entries.empty())
+    EndPhase(last_physics_timings.candidates);
+
+    // Advance the objects by a single pixel.
+    // First, try both directions at the same time. On failure, try the directions separately.
+    // This doesn't modify anything on failure, so each island can run this until it stops making progress, independently from other islands.
+    ParallelFor(islands.size(), [&](std::size_t island_index)
     {
+        Island &island = islands[island_index];
+
         while (true)
         {
             bool any_progress = false;
 
-            // Coroutine. Pauses to show a working scenario. Stops when there's no more valid scenarios.
-            auto ProcessObject = [&](auto &ProcessObject, GridId id, int proposed_dir) -> Coroutine<>
+            for (auto *entry_pair : island.moving)
             {
-                ExtendedEntry &entry_ex = entries_ex.at(id);
-                if (entry_ex.circular_dir)
-                    co_return; // The object was already moved.
-                // if (entry_ex.failed_circular_dirs[proposed_dir])
-                //     co_return; // We already tried this direction, and it's obstructed.
+                Entry &entry = entry_pair->second;
+                if (entry.blocked)
+                    continue;
 
-                GridObject &obj = grids.at(id.index).value();
+                Grid &grid = grids[entry_pair->first.index].value();
 
-                ivec2 *remaining_vel = [&]{
-                    auto it = entries.find(id);
-                    return it == entries.end() ? nullptr : &it->second.remaining_vel;
-                }();
-
-                // Temporarily add the offset to the position.
-                entry_ex.circular_dir = ivec2::dir8(proposed_dir);
-                obj.grid.xf.pos += entry_ex.circular_dir;
-                auto prev_remaining_vel = remaining_vel ? *remaining_vel : ivec2();
-                auto prev_vel_lag = obj.vel_lag;
-                for (int i = 0; i < 2; i++)
+                // Returns how far we can move in `dir`, up to `limit` pixels.
+                auto MaxFreeTranslation = [&](ivec2 dir, int limit)
                 {
-                    if (remaining_vel && sign((*remaining_vel)[i]) == entry_ex.circular_dir[i])
-                        (*remaining_vel)[i] -= entry_ex.circular_dir[i]; // Move by expending `remaining_vel`.
-                    else
-                        obj.vel_owed[i] += entry_ex.circular_dir[i]; // Fallback: move by expending `vel_owed`.
-                }
-
-
-                struct Collision
-                {
-                    GridId id;
-                    std::vector<int> possible_dirs;
+                    for (GridId id : entry.collision_candidates)
+                    {
+                        if (limit == 0)
+                            break;
+                        const Grid &other_grid = grids[id.index].value();
+                        Xf world_to_other = other_grid.WorldToGrid();
+                        limit = grid.MaxFreeTranslationWithCustomXfDifference(other_grid, world_to_other * grid.GridToWorld(), world_to_other.Matrix() * dir, limit, false);
+                    }
+                    return limit;
                 };
 
-                std::vector<Collision> collisions;
-                bool stuck = false;
-                // bool fully_stuck = false; // Not only stuck now, but won't move in this iteration at all.
-
-                for (GridId candidate_id : entry_ex.collision_candidates)
+                // Tries to move by one pixel along each axis of `dir` separately. This is used when moving in `dir` directly fails.
+                // Returns false if we couldn't move at all.
+                auto TryMoveAlongAxes = [&](ivec2 dir) -> bool
                 {
-                    const GridObject &candidate = GetGrid(candidate_id);
-
-                    bool candidate_was_movable = true; // This was supposed to be true if candidate exists in `entries`, but we can't, because of `vel_owed`.
-                    // We could check `remaining_vel` here, if we didn't allow movement by expending `vel_owed`.
-                    // Note that we could have grids with zero `remaining_vel` here, since this algorithm removes them later.
-                    bool candidate_is_movable_now = candidate_was_movable && entries_ex.at(candidate_id).circular_dir == 0;
+                    bool moved = false;
+                    for (bool axis_dir_index : initial_dir_for_physics_tick ? std::array{true, false} : std::array{false, true})
+                    {
+                        ivec2 axis_dir;
+                        axis_dir[axis_dir_index] = dir[axis_dir_index];
 
-                    bool collides = obj.grid.CollidesWithGridWithCustomXfDifference(candidate.grid, candidate.grid.WorldToGrid() * obj.grid.GridToWorld(), false);
+                        if (!axis_dir || axis_dir == dir)
+                            continue; // The second condition is an optimization, we already know that it fails.
 
-                    if (collides)
-                    {
-                        if (!candidate_is_movable_now)
+                        if (MaxFreeTranslation(axis_dir, 1) == 1)
                         {
-                            stuck = true;
-                            if (!candidate_was_movable)
-                            {
-                                // fully_stuck = true;
-                                break;
-                            }
-                            // Otherwise don't stop yet, we want to check if we're fully stuck or not.
+                            grid.xf.pos += axis_dir;
+                            entry.remaining_vel -= axis_dir;
+                            moved = true;
                         }
-                        else if (!stuck)
-                        {
-                            Collision new_collision;
-                            new_collision.id = candidate_id;
-                            new_collision.possible_dirs.reserve(5);
+                    }
+                    return moved;
+                };
 
-                            auto candidate_iter = entries.find(candidate_id);
+                // If none of the candidates need to move anymore, nobody else can observe our position until this loop ends (because the candidate lists are symmetric).
+                // Then we can perform all our remaining steps at once, and jump straight to the contact, with the same result.
+                bool candidates_are_static = std::all_of(entry.collision_candidates.begin(), entry.collision_candidates.end(), [&](GridId id)
+                {
+                    auto it = entries.find(id);
+                    return it == entries.end() || it->second.remaining_vel == 0 || it->second.blocked;
+                });
 
-                            for (int delta : {0, 1, -1, 2, -2})
-                            {
-                                ivec2 desired_dir = ivec2::dir8(proposed_dir + delta);
-
-                                bool can_move = true;
-
-                                for (int i = 0; i < 2; i++)
-                                {
-                                    if (desired_dir[i] == 0)
-                                        continue;
-                                    if (candidate_iter != entries.end() && sign(candidate_iter->second.remaining_vel[i]) == desired_dir[i])
-                                        continue; // We can move by expending `remaining_vel`.
-                                    if (candidate.vel_owed[i] == 0 && sign(desired_dir[i]) == sign(GetGrid(candidate_id).vel[i]))
-                                        continue; // We can move by expending `vel_lag`.
-                                    can_move = false;
-                                    break;
-                                }
-
-                                if (can_move)
-                                    new_collision.possible_dirs.push_back(mod_ex(proposed_dir + delta, 8));
-                            }
-                            collisions.push_back(std::move(new_collision));
-                        }
+                if (!candidates_are_static)
+                {
+                    ivec2 dir = sign(entry.remaining_vel);
+                    if (MaxFreeTranslation(dir, 1) == 1)
+                    {
+                        grid.xf.pos += dir;
+                        entry.remaining_vel -= dir;
+                        any_progress = true;
                     }
+                    else if (TryMoveAlongAxes(dir))
+                    {
+                        any_progress = true;
+                    }
+                    continue;
                 }
 
-                if (stuck)
-                {
-                    // if (fully_stuck)
-                    //     entry.failed_circular_dirs[proposed_dir] = true;
-                }
-                else if (!collisions.empty())
+                while (entry.remaining_vel != 0)
                 {
-                    auto CollisionCoro = [&](std::size_t i) -> Coroutine<>
-                    {
-                        for (int dir : collisions[i].possible_dirs)
-                        {
-                            auto coro = ProcessObject(ProcessObject, collisions[i].id, dir);
-                            while (coro())
-                                co_await std::suspend_always{}; // Propagate success.
-                        }
-                    };
+                    ivec2 dir = sign(entry.remaining_vel);
+                    // The number of steps until `dir` changes.
+                    int limit = dir(all) != 0 ? abs(entry.remaining_vel).min() : abs(entry.remaining_vel).max();
 
-                    std::vector<Coroutine<>> coroutines(collisions.size());
-                    coroutines.front() = CollisionCoro(0);
+                    int dist = MaxFreeTranslation(dir, limit);
+                    if (dist > 0)
+                    {
+                        grid.xf.pos += dir * dist;
+                        entry.remaining_vel -= dir * dist;
+                        any_progress = true;
+                    }
 
-                    std::size_t pos = 0;
-                    while (true)
+                    if (dist < limit)
                     {
-                        if (coroutines[pos]())
-                        {
-                            if (pos + 1 == coroutines.size())
-                            {
-                                // Success.
-                                co_await std::suspend_always{};
-                            }
-                            else
-                            {
-                                // Success, but we need to resolve more collisions.
-                                pos++;
-                                coroutines[pos] = CollisionCoro(pos);
-                            }
-                        }
-                        else
+                        // Blocked. Try the axes separately.
+                        if (!TryMoveAlongAxes(dir))
                         {
-                            if (pos == 0)
-                                break; // We're done.
-
-                            // Failure, need to update the previous collision.
-                            pos--;
+                            // Our candidates don't move, so we'll stay blocked until the end of this loop.
+                            entry.blocked = true;
+                            break;
                         }
+                        any_progress = true;
                     }
                 }
+            }
+
+            std::erase_if(island.moving, [](const auto *entry_pair){return entry_pair->second.remaining_vel == 0;});
+
+            if (!any_progress)
+                break;
+        }
+    });
+
+    EndPhase(last_physics_timings.pixel_advance);
+
+    // Try to resolve any circular obstructions.
+    // Unlike the previous step, a failed attempt here can modify `vel_owed`, so the islands must run the same number of passes as the serial algorithm would.
+    // Because of that, we run the passes in lockstep, and stop when none of the islands made progress.
+    if (std::any_of(islands.begin(), islands.end(), [](const Island &island){return !island.moving.empty();}))
+    {
+        // Returns the entry for this grid, or null if it doesn't need to move anymore.
+        auto FindEntry = [&](GridId id) -> Entry *
+        {
+            auto it = entries.find(id);
+            return it == entries.end() || it->second.remaining_vel == 0 ? nullptr : &it->second;
+        };
+
+        // Moves a grid by `ivec2::dir8(dir)` as a part of the circular obstruction resolution, and records how to undo it in `island.circular_undo`.
+        // On success, prepends the grids that must now move out of the way to the goal list `goal` (an index in `island.circular_goals`) and returns true.
+        // On failure returns false, then the caller must undo the movement (if it was recorded).
+        auto MoveCircular = [&](Island &island, GridId id, int dir, int &goal) -> bool
+        {
+            ExtendedEntry &entry_ex = entries_ex.at(id);
+            if (entry_ex.circular_dir)
+                return false; // The object was already moved.
+
+            Grid &grid = grids.at(id.index).value();
+            ivec2 &vel_owed = hot.vel_owed[DenseIndex(id)];
+            Entry *entry = FindEntry(id);
+
+            island.circular_undo.push_back({.grid = &grid, .entry_ex = &entry_ex, .entry = entry, .prev_remaining_vel = entry ? entry->remaining_vel : ivec2()});
+
+            // Temporarily add the offset to the position.
+            entry_ex.circular_dir = ivec2::dir8(dir);
+            grid.xf.pos += entry_ex.circular_dir;
+            for (int i = 0; i < 2; i++)
+            {
+                if (entry && sign(entry->remaining_vel[i]) == entry_ex.circular_dir[i])
+                    entry->remaining_vel[i] -= entry_ex.circular_dir[i]; // Move by expending `remaining_vel`.
+                else
+                    vel_owed[i] += entry_ex.circular_dir[i]; // Fallback: move by expending `vel_owed`.
+            }
+
+            // The grids we collide with, in order. They're prepended to the goal list in reverse, after we know that we're not stuck.
+            std::size_t first_new_goal = island.circular_goals.size();
+
+            for (std::size_t i = 0; i < entry_ex.collision_candidates.size(); i++)
+            {
+                GridId candidate_id = entry_ex.collision_candidates[i];
+                const Grid &candidate_grid = grids[candidate_id.index].value();
+                const ExtendedEntry &candidate_entry_ex = entries_ex.at(candidate_id);
+
+                // Note that we could have grids with zero `remaining_vel` here, since this algorithm removes them later.
+                // Those are still movable, since they can move by expending `vel_owed`.
+                bool candidate_is_movable_now = candidate_entry_ex.circular_dir == 0;
+
+                bool collides = false;
+                ivec2 dir_difference = entry_ex.circular_dir - candidate_entry_ex.circular_dir;
+                int memo_bit = 1 << (dir_difference.x + 2 + (dir_difference.y + 2) * 5);
+                std::uint64_t &memo = island.circular_collision_memo[entry_ex.circular_memo_offset + i];
+                if (memo & memo_bit)
+                {
+                    collides = memo >> 32 & memo_bit;
+                }
                 else
                 {
-                    // Success!
-                    co_await std::suspend_always{};
+                    collides = grid.CollidesWithGridWithCustomXfDifference(candidate_grid, candidate_grid.WorldToGrid() * grid.GridToWorld(), false);
+                    memo |= memo_bit | (collides ? std::uint64_t(memo_bit) << 32 : 0);
                 }
 
-                // Undo the movement.
-                obj.grid.xf.pos -= entry_ex.circular_dir;
-                entry_ex.circular_dir = ivec2();
-                if (remaining_vel)
-                    *remaining_vel = prev_remaining_vel;
-                obj.vel_lag = prev_vel_lag;
-            };
+                if (!collides)
+                    continue;
 
-            for (auto &[id, entry] : entries)
-            {
-                auto TryOffset = [&, &id = id](ivec2 offset) -> bool
+                if (!candidate_is_movable_now)
+                {
+                    // Stuck.
+                    island.circular_goals.resize(first_new_goal);
+                    return false;
+                }
+
+                CircularGoal &new_goal = island.circular_goals.emplace_back();
+                new_goal.id = candidate_id;
+
+                Entry *candidate_entry = FindEntry(candidate_id);
+                std::size_t candidate_index = DenseIndex(candidate_id);
+
+                for (int delta : {0, 1, -1, 2, -2})
                 {
-                    auto coro = ProcessObject(ProcessObject, id, offset.angle8_sign());
-                    bool success = coro();
-                    if (success)
+                    ivec2 desired_dir = ivec2::dir8(dir + delta);
+
+                    bool can_move = true;
+
+                    for (int j = 0; j < 2; j++)
                     {
-                        // Reset stuff. On failure it happens automatically.
-                        for (auto &[id, entry] : entries_ex)
-                        {
-                            // entry.failed_circular_dirs = {};
-                            entry.circular_dir = {};
-                        }
+                        if (desired_dir[j] == 0)
+                            continue;
+                        if (candidate_entry && sign(candidate_entry->remaining_vel[j]) == desired_dir[j])
+                            continue; // We can move by expending `remaining_vel`.
+                        if (hot.vel_owed[candidate_index][j] == 0 && sign(desired_dir[j]) == sign(hot.vel[candidate_index][j]))
+                            continue; // We can move by expending `vel_lag`.
+                        can_move = false;
+                        break;
                     }
-                    return success;
-                };
 
-                if (entry.remaining_vel(all) != 0 && TryOffset(sign(entry.remaining_vel)))
+                    if (can_move)
+                        new_goal.dirs[new_goal.num_dirs++] = std::int8_t(mod_ex(dir + delta, 8));
+                }
+            }
+
+            // Link the new goals in front of the existing ones, keeping their order.
+            for (std::size_t i = island.circular_goals.size(); i-- > first_new_goal;)
+            {
+                island.circular_goals[i].next = goal;
+                goal = int(i);
+            }
+            return true;
+        };
+
+        // Tries to move a grid by `ivec2::dir8(dir)`, moving the other grids out of the way as needed.
+        // On success keeps the grids moved. On failure undoes everything, except for the changes to `vel_owed`.
+        // The choices are tried depth-first, in the same order as the recursive algorithm would try them.
+        auto TryCircularMove = [&](Island &island, GridId id, int dir) -> bool
+        {
+            island.circular_goals.clear();
+            island.circular_choices.clear();
+            island.circular_undo.clear();
+
+            island.circular_goals.push_back({.id = id, .dirs = {std::int8_t(dir)}, .num_dirs = 1});
+            island.circular_choices.push_back({.goal = 0, .num_goals = 1});
+
+            while (!island.circular_choices.empty())
+            {
+                CircularChoice &choice = island.circular_choices.back();
+
+                // Undo everything done since this choice was made, including the previous direction we tried.
+                while (island.circular_undo.size() > choice.num_undo)
                 {
-                    // Moved diagonally.
-                    any_progress = true;
+                    const CircularUndo &undo = island.circular_undo.back();
+                    undo.grid->xf.pos -= undo.entry_ex->circular_dir;
+                    undo.entry_ex->circular_dir = ivec2();
+                    if (undo.entry)
+                        undo.entry->remaining_vel = undo.prev_remaining_vel;
+                    island.circular_undo.pop_back();
                 }
-                else
+                island.circular_goals.resize(choice.num_goals);
+
+                const CircularGoal &goal = island.circular_goals[choice.goal];
+                if (choice.next_dir == goal.num_dirs)
                 {
-                    // Couldn't move diagnoally, try both directions separately.
-                    if (ivec2 offset = sign(entry.remaining_vel * ivec2::dir4(initial_dir_for_physics_tick)); offset && TryOffset(offset))
-                        any_progress = true;
-                    if (ivec2 offset = sign(entry.remaining_vel * ivec2::dir4(!initial_dir_for_physics_tick)); offset && TryOffset(offset))
-                        any_progress = true;
+                    // All directions failed, return to the previous choice.
+                    island.circular_choices.pop_back();
+                    continue;
                 }
+
+                int next_goal = goal.next;
+                if (!MoveCircular(island, goal.id, goal.dirs[choice.next_dir++], next_goal))
+                    continue;
+
+                if (next_goal == -1)
+                    return true; // Nothing else needs to move.
+
+                island.circular_choices.push_back({.goal = next_goal, .num_goals = island.circular_goals.size(), .num_undo = island.circular_undo.size()});
             }
 
-            if (any_progress)
+            return false;
+        };
+
+        // Lay out the collision test memos.
+        for (Island &island : islands)
+        {
+            if (island.moving.empty())
+                continue;
+            std::size_t memo_size = 0;
+            for (auto *member : island.members)
+            {
+                member->second.circular_memo_offset = memo_size;
+                memo_size += member->second.collision_candidates.size();
+            }
+            island.circular_collision_memo.resize(memo_size);
+        }
+
+        while (true)
+        {
+            ParallelFor(islands.size(), [&](std::size_t island_index)
             {
-                // Erase entries with no remaining velocity. We couldn't do it earlier because it invalidates the iterators.
-                for (auto it = entries.begin(); it != entries.end();)
+                Island &island = islands[island_index];
+                island.any_circular_progress = false;
+
+                for (auto *entry_pair : island.moving)
                 {
-                    if (it->second.remaining_vel == 0)
-                        it = entries.erase(it);
+                    GridId id = entry_pair->first;
+                    Entry &entry = entry_pair->second;
+
+                    auto TryOffset = [&](ivec2 offset) -> bool
+                    {
+                        bool success = TryCircularMove(island, id, offset.angle8_sign());
+                        if (success)
+                        {
+                            // Reset stuff. On failure it happens automatically.
+                            for (auto *member : island.members)
+                                member->second.circular_dir = {};
+                            // The grids have moved, so the collision tests are outdated.
+                            std::fill(island.circular_collision_memo.begin(), island.circular_collision_memo.end(), 0);
+                        }
+                        return success;
+                    };
+
+                    if (entry.remaining_vel(all) != 0 && TryOffset(sign(entry.remaining_vel)))
+                    {
+                        // Moved diagonally.
+                        island.any_circular_progress = true;
+                    }
                     else
-                        ++it;
+                    {
+                        // Couldn't move diagnoally, try both directions separately.
+                        if (ivec2 offset = sign(entry.remaining_vel * ivec2::dir4(initial_dir_for_physics_tick)); offset && TryOffset(offset))
+                            island.any_circular_progress = true;
+                        if (ivec2 offset = sign(entry.remaining_vel * ivec2::dir4(!initial_dir_for_physics_tick)); offset && TryOffset(offset))
+                            island.any_circular_progress = true;
+                    }
                 }
-            }
-            else
-            {
+
+                if (island.any_circular_progress)
+                {
+                    // Remove entries with no remaining velocity. We couldn't do it earlier because it invalidates the iterators.
+                    std::erase_if(island.moving, [](const auto *entry_pair){return entry_pair->second.remaining_vel == 0;});
+                }
+            });
+
+            if (std::none_of(islands.begin(), islands.end(), [](const Island &island){return island.any_circular_progress;}))
                 break;
-            }
         }
     }
 
+    EndPhase(last_physics_timings.circular);
+
     // Update AABBs.
     for (const auto &id : aabb_update_entries)
-        ModifyGrid(id, [](GridObject &){});
+    {
+        std::size_t i = DenseIndex(id);
+        aabb_tree.ModifyNode(hot.aabb_node_index[i], GetGridAabb(*grids[id.index]), round_maxabs(hot.vel[i]));
+    }
+
+    EndPhase(last_physics_timings.aabb_update);
 
     // Perform impulse transfer.
     // First, sort entries by speed.
-    std::vector<decltype(entries_ex)::value_type *> entries_ex_sorted;
+    // The sorting is done globally, and then the sorted entries are distributed to the islands, to keep the same order as in the serial algorithm.
+    // The speeds are computed once, rather than on every comparison.
+    // The sort is stable, so the grids with the same speed stay in the dense order.
+    std::vector<std::pair<float, decltype(entries_ex)::value_type *>> entries_ex_sorted;
     entries_ex_sorted.reserve(entries_ex.size());
-    for (auto &entry : entries_ex)
-        entries_ex_sorted.push_back(&entry);
-    std::sort(entries_ex_sorted.begin(), entries_ex_sorted.end(), [&](const auto *a, const auto *b)
+    for (const TickGrid &tick_grid : tick_grids)
+        entries_ex_sorted.emplace_back(hot.vel[tick_grid.dense_index].len_sqr(), tick_grid.entry_ex);
+    std::stable_sort(entries_ex_sorted.begin(), entries_ex_sorted.end(), [&](const auto &a, const auto &b)
     {
-        return grids.at(a->first.index).value().vel.len_sqr() > grids.at(b->first.index).value().vel.len_sqr();
+        return a.first > b.first;
     });
-    for (auto *entry_pair : entries_ex_sorted)
+    for (auto [speed, entry_pair] : entries_ex_sorted)
     {
-        GridId id = entry_pair->first;
-        ExtendedEntry &entry = entry_pair->second;
+        if (auto it = grid_islands.find(entry_pair->first); it != grid_islands.end())
+            islands[it->second].members_sorted_by_speed.push_back(entry_pair);
+    }
 
-        GridObject &obj = grids.at(id.index).value();
+    // The collision tests below use `contact_cache`. It's only read during the parallel loop, the islands can modify the existing entries
+    //   (each pair belongs to a single island), and the new entries are added after the loop.
+    ParallelFor(islands.size(), [&](std::size_t island_index)
+    {
+        Island &island = islands[island_index];
 
-        for (GridId other_id : entry.collision_candidates)
+        for (auto *entry_pair : island.members_sorted_by_speed)
         {
-            GridObject &other_obj = grids.at(other_id.index).value();
+            GridId id = entry_pair->first;
+            ExtendedEntry &entry = entry_pair->second;
 
-            if (obj.infinite_mass && other_obj.infinite_mass)
-                continue;
+            const Grid &grid = grids.at(id.index).value();
+            std::size_t index = DenseIndex(id);
+            fvec2 &vel = hot.vel[index];
 
-            if (fvec2 vel_delta = obj.vel - other_obj.vel)
+            for (GridId other_id : entry.collision_candidates)
             {
-                int dir_index_0 = vel_delta.angle8_floor() - 1;
+                // Skip the pairs that were already processed from the other side.
+                if (entries_ex.at(other_id).impulse_transfer_done)
+                    continue;
+
+                const Grid &other_grid = grids.at(other_id.index).value();
+                std::size_t other_index = DenseIndex(other_id);
+                fvec2 &other_vel = hot.vel[other_index];
 
-                // Whether `vel_delta` is one of the 8 main directions.
-                bool dir_is_8_aligned = vel_delta(any) == 0 || abs(vel_delta.x) == abs(vel_delta.y);
+                if (hot.infinite_mass[index] && hot.infinite_mass[other_index])
+                    continue;
 
-                auto CollidesWithDir = [&](int dir)
+                if (fvec2 vel_delta = vel - other_vel)
                 {
-                    return obj.grid.CollidesWithGridWithCustomXfDifference(other_obj.grid, other_obj.grid.WorldToGrid() * Xf::Pos(ivec2::dir8(dir)) * obj.grid.GridToWorld(), false);
-                };
+                    int dir_index_0 = vel_delta.angle8_floor() - 1;
 
-                bool hit_1 = CollidesWithDir(dir_index_0 + 1);
-                bool hit_2 = CollidesWithDir(dir_index_0 + 2);
+                    // Whether `vel_delta` is one of the 8 main directions.
+                    bool dir_is_8_aligned = vel_delta(any) == 0 || abs(vel_delta.x) == abs(vel_delta.y);
 
-                // If we have a collision, perform impulse transfer.
-                if (hit_1 || (!dir_is_8_aligned && hit_2))
-                {
-                    // Determine the best movement direction.
-                    // If null, the objects can't move relative to each other.
-                    std::optional<int> best_dir;
+                    Xf relative_xf = other_grid.WorldToGrid() * grid.GridToWorld();
 
-                    if (dir_is_8_aligned)
+                    ContactCacheEntry *contact = nullptr;
+                    if (auto it = contact_cache.find(ContactCacheKey{id, other_id}); it != contact_cache.end())
+                        contact = &it->second;
+                    else
+                        contact = &island.new_contacts.emplace_back(ContactCacheKey{id, other_id}, ContactCacheEntry{}).second;
+
+                    // Reset the entry if it's outdated.
+                    if (contact->relative_xf != relative_xf || contact->generation != grid.EditGeneration() || contact->other_generation != other_grid.EditGeneration())
                     {
-                        if (!hit_1)
-                            best_dir = dir_index_0 + 1;
-                        else if (hit_2 != CollidesWithDir(dir_index_0))
-                            best_dir = dir_index_0 + (hit_2 ? 0 : 2);
+                        contact->relative_xf = relative_xf;
+                        contact->generation = grid.EditGeneration();
+                        contact->other_generation = other_grid.EditGeneration();
+                        contact->known_dirs = 0;
+                        contact->blocked_dirs = 0;
                     }
-                    else
+                    contact->last_used_tick = physics_tick_counter;
+
+                    auto CollidesWithDir = [&](int dir)
                     {
-                        if (hit_1 != hit_2)
+                        std::uint8_t bit = std::uint8_t(1 << mod_ex(dir, 8));
+                        if (!(contact->known_dirs & bit))
                         {
-                            best_dir = dir_index_0 + (hit_2 ? 1 : 2);
+                            contact->known_dirs |= bit;
+                            if (grid.CollidesWithGridWithCustomXfDifference(other_grid, other_grid.WorldToGrid() * Xf::Pos(ivec2::dir8(dir)) * grid.GridToWorld(), false))
+                                contact->blocked_dirs |= bit;
+                        }
+                        return bool(contact->blocked_dirs & bit);
+                    };
+
+                    bool hit_1 = CollidesWithDir(dir_index_0 + 1);
+                    bool hit_2 = CollidesWithDir(dir_index_0 + 2);
+
+                    // If we have a collision, perform impulse transfer.
+                    if (hit_1 || (!dir_is_8_aligned && hit_2))
+                    {
+                        // Determine the best movement direction.
+                        // If null, the objects can't move relative to each other.
+                        std::optional<int> best_dir;
+
+                        if (dir_is_8_aligned)
+                        {
+                            if (!hit_1)
+                                best_dir = dir_index_0 + 1;
+                            else if (hit_2 != CollidesWithDir(dir_index_0))
+                                best_dir = dir_index_0 + (hit_2 ? 0 : 2);
                         }
                         else
                         {
-                            // Check which of the two dirs is closer to our velocity.
-                            bool prefer_dir_2 = vel_delta /dot/ norm_dirs[mod_ex(dir_index_0 + 2, 8)] > vel_delta /dot/ norm_dirs[mod_ex(dir_index_0 + 1, 8)];
+                            if (hit_1 != hit_2)
+                            {
+                                best_dir = dir_index_0 + (hit_2 ? 1 : 2);
+                            }
+                            else
+                            {
+                                // Check which of the two dirs is closer to our velocity.
+                                bool prefer_dir_2 = vel_delta /dot/ norm_dirs[mod_ex(dir_index_0 + 2, 8)] > vel_delta /dot/ norm_dirs[mod_ex(dir_index_0 + 1, 8)];
 
-                            int preferred_dir = dir_index_0 + (prefer_dir_2 ? 3 : 0);
-                            int backup_dir = dir_index_0 + (prefer_dir_2 ? 0 : 3);
+                                int preferred_dir = dir_index_0 + (prefer_dir_2 ? 3 : 0);
+                                int backup_dir = dir_index_0 + (prefer_dir_2 ? 0 : 3);
 
-                            if (!CollidesWithDir(preferred_dir))
-                                best_dir = preferred_dir;
-                            else if (!CollidesWithDir(backup_dir))
-                                best_dir = backup_dir;
+                                if (!CollidesWithDir(preferred_dir))
+                                    best_dir = preferred_dir;
+                                else if (!CollidesWithDir(backup_dir))
+                                    best_dir = backup_dir;
+                            }
                         }
-                    }
 
-                    // Which body changes velocity: 0 = self, 1 = other.
-                    float mass_factor = other_obj.infinite_mass ? 0 : obj.infinite_mass ? 1 : obj.grid.Mass() / float(obj.grid.Mass() + other_obj.grid.Mass());
+                        // Which body changes velocity: 0 = self, 1 = other.
+                        float mass_factor = hot.infinite_mass[other_index] ? 0 : hot.infinite_mass[index] ? 1 : hot.mass[index] / float(hot.mass[index] + hot.mass[other_index]);
 
-                    if (!best_dir)
-                    {
-                        obj.vel = other_obj.vel = other_obj.vel + vel_delta * mass_factor;
-                        // obj.vel_lag = other_obj.vel_lag = (obj.vel_lag + other_obj.vel_lag) / 2;
-                    }
-                    else
-                    {
-                        fvec2 normal = norm_dirs[mod_ex(*best_dir + 2, 8)];
-                        fvec2 vel_delta_proj = Math::project_onto_line_norm(vel_delta, normal);
+                        if (!best_dir)
+                        {
+                            vel = other_vel = other_vel + vel_delta * mass_factor;
+                            // obj.vel_lag = other_obj.vel_lag = (obj.vel_lag + other_obj.vel_lag) / 2;
+                        }
+                        else
+                        {
+                            fvec2 normal = norm_dirs[mod_ex(*best_dir + 2, 8)];
+                            fvec2 vel_delta_proj = Math::project_onto_line_norm(vel_delta, normal);
 
-                        obj.vel -= vel_delta_proj * (1 - mass_factor);
-                        other_obj.vel += vel_delta_proj * mass_factor;
+                            vel -= vel_delta_proj * (1 - mass_factor);
+                            other_vel += vel_delta_proj * mass_factor;
 
-                        // // Try to sync the velocity lag.
-                        // fvec2 vel_lag_delta_proj = Math::project_onto_line_norm(obj.vel_lag - other_obj.vel_lag, normal);
-                        // obj.vel_lag -= vel_lag_delta_proj * (1 - mass_factor);
-                        // other_obj.vel_lag += vel_lag_delta_proj * mass_factor;
+                            // // Try to sync the velocity lag.
+                            // fvec2 vel_lag_delta_proj = Math::project_onto_line_norm(obj.vel_lag - other_obj.vel_lag, normal);
+                            // obj.vel_lag -= vel_lag_delta_proj * (1 - mass_factor);
+                            // other_obj.vel_lag += vel_lag_delta_proj * mass_factor;
+                        }
                     }
                 }
             }
 
-            // Erase this ID from the candidates of the other object, to avoid checking it twice.
-            entries_ex.at(other_id).collision_candidates.erase(id);
+            entry.impulse_transfer_done = true;
         }
+    });
+
+    // Update the contact cache.
+    for (Island &island : islands)
+    {
+        for (auto &[key, contact] : island.new_contacts)
+            contact_cache.insert_or_assign(key, contact);
     }
+    for (auto it = contact_cache.begin(); it != contact_cache.end();)
+    {
+        if (it->second.last_used_tick != physics_tick_counter)
+            contact_cache.erase(it++);
+        else
+            it++;
+    }
+    physics_tick_counter++;
+
+    EndPhase(last_physics_timings.impulse_transfer);
+
+    // Put the grids to sleep if they and all their candidates have no velocity.
+    // A grid without velocity never moves on its own, and only the grids touching a moving grid can be pushed or receive impulses,
+    //   so skipping it doesn't change anything, as long as we wake it up when a moving grid gets close. This is done at the beginning of the tick.
+    // The velocity lag is less than half a pixel, so it can't move the grid on its own, but it still affects the rounding after the grid is pushed.
+    // So the sleeping grids keep decaying it every tick, exactly like the awake ones, to make the results independent of sleeping.
+    if (allow_sleeping)
+    {
+        for (const TickGrid &tick_grid : tick_grids)
+        {
+            std::size_t i = tick_grid.dense_index;
+            if (hot.vel[i] != fvec2())
+                continue;
+
+            const ExtendedEntry &entry = tick_grid.entry_ex->second;
+            if (std::any_of(entry.collision_candidates.begin(), entry.collision_candidates.end(), [&](GridId other_id){return hot.vel[DenseIndex(other_id)] != fvec2();}))
+                continue;
+
+            hot.sleeping[i] = true;
+            // The awake grids look for the sleeping ones using their swept AABBs, which are expanded by 1 pixel.
+            aabb_tree.EnlargeNode(hot.aabb_node_index[i], GetGridAabb(*grids[tick_grid.id.index]).Expand(ivec2(1)));
+        }
+    }
+
+    EndPhase(last_physics_timings.sleeping);
+
+    last_physics_timings.aabb_validation = aabb_tree.ValidationTime() - initial_validation_time;
+    #if IMP_GRID_MANAGER_VALIDATE_AABB_TREE_EACH_TICK
+    aabb_tree.Validate();
+    double full_validation_time = 0;
+    EndPhase(full_validation_time);
+    last_physics_timings.aabb_validation += full_validation_time;
+    #endif
 
     // Update the preferred movement direction for the next tick.
     initial_dir_for_physics_tick = !initial_dir_for_physics_tick;
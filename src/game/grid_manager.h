@@ -2,9 +2,18 @@
 
 #include "game/grid.h"
 #include "utils/aabb_tree.h"
+#include "utils/spatial_hash.h"
+#include "utils/thread_pool.h"
 
+// If enabled, the grids are stored in a `SpatialHash` instead of an `AabbTree`.
+// The hash is faster when most grids are small debris, and the tree is better with a mix of small and huge grids. See `bench/broadphase_bench.cpp`.
+#ifndef IMP_GRID_MANAGER_SPATIAL_HASH
+#define IMP_GRID_MANAGER_SPATIAL_HASH 0
+#endif
 
-// Those should only exist inside of a `GridManager`.
+
+// A grid with its physics state, as passed to `GridManager::AddGrid()` and `GridManager::ModifyGrid()`.
+// The manager doesn't store those as is, it keeps the tiles separately from the rest of the state.
 struct GridObject
 {
     Grid grid;
@@ -14,9 +23,16 @@ struct GridObject
 
     // If true, the velocity can't be changed by other objects.
     bool infinite_mass = false;
+};
 
-    // Don't modify. This is set automatically by the grid manager.
-    int aabb_node_index = -1;
+// A read-only view of a grid in a `GridManager`, returned by `GridManager::GetGrid()`. Same as `GridObject`, but doesn't copy the tiles.
+struct GridObjectView
+{
+    const Grid &grid;
+    fvec2 vel;
+    fvec2 vel_lag;
+    ivec2 vel_owed;
+    bool infinite_mass = false;
 };
 
 struct GridId
@@ -42,20 +58,141 @@ public:
         GridId grid_id;
     };
 
+    #if IMP_GRID_MANAGER_SPATIAL_HASH
+    using aabb_tree_t = SpatialHash<ivec2, TreeData>;
+    #else
     using aabb_tree_t = AabbTree<ivec2, TreeData>;
+    #endif
     using aabb_t = aabb_tree_t::Aabb;
 
+    // How long each phase of `TickPhysics()` took, in seconds.
+    struct PhysicsTimings
+    {
+        // Moving the unobstructed grids, finding the collision candidates, and splitting the grids into islands.
+        double candidates = 0;
+        // Moving the grids pixel by pixel.
+        double pixel_advance = 0;
+        // Resolving circular obstructions.
+        double circular = 0;
+        double aabb_update = 0;
+        double impulse_transfer = 0;
+        // Putting the resting grids to sleep.
+        double sleeping = 0;
+        // The automatic validation of the AABB tree in the debug builds, see `IMP_AUTO_VALIDATE_AABB_TREES`.
+        // This isn't a separate phase, it's the part of the phases above spent on the validation.
+        double aabb_validation = 0;
+    };
+
+    // The state of the grids needed for rendering them, see `TakeRenderSnapshot()`.
+    // Rendering from a snapshot doesn't read anything that `TickPhysics()` modifies, so the next tick can run on a different thread in the meantime.
+    struct RenderSnapshot
+    {
+        struct Entry
+        {
+            GridId id;
+            // `Grid::GridToWorld()`.
+            Xf grid_to_world;
+            // The world-space AABB of the grid, for culling. We can't use the AABB tree, since the physics updates it.
+            aabb_t aabb;
+            // `Grid::EditGeneration()`. The tile meshes are taken from the live grids, so their tiles must not change while the snapshot is in use.
+            std::uint64_t edit_generation = 0;
+        };
+
+        // Sorted by ID.
+        std::vector<Entry> entries;
+    };
+
 private:
     aabb_tree_t aabb_tree;
 
     SparseSet<int> grid_ids;
 
-    std::vector<std::optional<GridObject>> grids;
+    // The tiles, indexed by `GridId::index`. The rest of the grid state is in `hot`.
+    std::vector<std::optional<Grid>> grids;
+
+    // The per-tick physics state of the grids, as parallel arrays indexed by the position of the grid in `grid_ids` (see `DenseIndex()`).
+    // This is kept away from the tiles, so the linear passes of `TickPhysics()` only stream over small dense arrays.
+    struct HotData
+    {
+        std::vector<fvec2> vel;
+        std::vector<fvec2> vel_lag;
+        std::vector<ivec2> vel_owed;
+        std::vector<std::uint8_t> infinite_mass; // Not `bool` to avoid `std::vector<bool>`.
+        std::vector<int> mass; // Same as `Grid::Mass()`.
+        std::vector<int> aabb_node_index;
+        // Not `bool` to avoid `std::vector<bool>`. The sleeping grids are skipped by `TickPhysics()`, unless a moving grid gets close to them.
+        // They have zero `vel`, but their `vel_lag` keeps decaying like for the awake grids. `ModifyGrid()` wakes them up.
+        std::vector<std::uint8_t> sleeping;
+
+        // Appends the state of a grid.
+        void PushBack(const GridObject &obj, int aabb_node);
+        // Moves the last element to `index`, and removes the last element. This mirrors `SparseSet::EraseUnordered()`.
+        void EraseUnordered(std::size_t index);
+    };
+    HotData hot;
 
     // This oscillates between 0 and 1 every time you call `TickPhysics()`.
     // It represents the initial axis (X or Y) that the physics tick uses.
     bool initial_dir_for_physics_tick = 0;
 
+    // See `SetSleepingAllowed()`.
+    bool allow_sleeping = true;
+
+    // If not null, `TickPhysics()` uses this to process independent groups of grids in parallel.
+    ThreadPool *thread_pool = nullptr;
+
+    PhysicsTimings last_physics_timings;
+
+    // The cached collision tests of the impulse transfer in `TickPhysics()`, for a pair of grids.
+    // They stay valid while the relative position of the grids and their `EditGeneration()`s stay the same.
+    struct ContactCacheEntry
+    {
+        // `other.WorldToGrid() * grid.GridToWorld()`.
+        Xf relative_xf;
+        std::uint64_t generation = 0, other_generation = 0;
+
+        // Bit `i` is set if we know whether the grids collide when the first one is moved by `ivec2::dir8(i)` relative to the second one.
+        std::uint8_t known_dirs = 0;
+        // Bit `i` is set if they collide in that direction. Only meaningful for the bits in `known_dirs`.
+        std::uint8_t blocked_dirs = 0;
+
+        // The value of `physics_tick_counter` when this entry was last used. The entries that weren't used during a tick are removed at the end of it.
+        std::uint64_t last_used_tick = 0;
+    };
+    // The order of grids matters, since the collision tests aren't symmetric.
+    struct ContactCacheKey
+    {
+        GridId grid, other;
+
+        [[nodiscard]] friend bool operator==(const ContactCacheKey &, const ContactCacheKey &) = default;
+
+        struct Hasher
+        {
+            std::size_t operator()(const ContactCacheKey &key) const
+            {
+                std::size_t ret = 0;
+                Hash::Append(ret, {Hash::Compute(key.grid.index), Hash::Compute(key.other.index)});
+                return ret;
+            }
+        };
+    };
+    phmap::flat_hash_map<ContactCacheKey, ContactCacheEntry, ContactCacheKey::Hasher> contact_cache;
+
+    // Incremented by `TickPhysics()`.
+    std::uint64_t physics_tick_counter = 0;
+
+    // Returns the index of a grid in `hot`.
+    [[nodiscard]] std::size_t DenseIndex(GridId id) const {return std::size_t(grid_ids.GetElemIndex(id.index));}
+
+    // Moves the grid state out of the manager into a `GridObject`, for `ModifyGrid()`. Must be followed by `StoreGridObject()`.
+    [[nodiscard]] GridObject ExtractGridObject(GridId id);
+    // Moves the grid state back into the manager, and updates the AABB.
+    void StoreGridObject(GridId id, GridObject &&obj);
+
+    // Moves the parts of a grid that are no longer connected to the rest into new grids, see `Grid::SplitDisconnectedParts()`.
+    // The new grids inherit the velocity, so the momentum is conserved.
+    void SplitDisconnectedGrid(GridId id);
+
 public:
     GridManager();
 
@@ -67,35 +204,41 @@ public:
     GridId AddGrid(GridObject obj) noexcept;
     void RemoveGrid(GridId id) noexcept;
 
-    [[nodiscard]] const GridObject &GetGrid(GridId id) const;
+    [[nodiscard]] GridObjectView GetGrid(GridId id) const;
 
     [[nodiscard]] int GridCount() const {return grid_ids.ElemCount();}
     [[nodiscard]] GridId GetGridId(int index) const {return {.index = grid_ids.GetElem(index)};}
 
     // Temporarily gives you a non-const reference to a grid to modify it.
     // `func` is `void func(GridObject &obj)`.
+    // If removing tiles breaks the grid apart, the disconnected parts become new grids, and one part keeps this ID.
     template <typename F>
     void ModifyGrid(GridId id, F &&func)
     {
-        GridObject &obj = grids.at(id.index).value();
+        GridObject obj = ExtractGridObject(id);
+        FINALLY_ON_THROW{StoreGridObject(id, std::move(obj));};
         func(obj);
-        aabb_tree.ModifyNode(obj.aabb_node_index, GetGridAabb(obj.grid), round_maxabs(obj.vel));
+        StoreGridObject(id, std::move(obj));
+        if (grids[id.index]->MightBeDisconnected())
+            SplitDisconnectedGrid(id);
     }
 
     [[nodiscard]] const aabb_tree_t &AabbTree() const {return aabb_tree;}
+    // Rebuilds the AABB tree from scratch. Call this after moving a lot of grids at once (e.g. teleporting them), to speed up the queries.
+    void RebuildAabbTree() {aabb_tree.Rebuild();}
 
     // Finds all other grids colliding with this one.
     // `func` is `bool func(GridId id)`. If it returns true, the function stops immediately and also returns true.
     template <typename F>
     bool CollideGrid(GridId id, Xf offset, bool full, F &&func) const
     {
-        const Grid &grid = GetGrid(id).grid;
+        const Grid &grid = grids.at(id.index).value();
         return aabb_tree.CollideAabb(GetGridAabb(grid, offset), [&](int node_id)
         {
             GridId grid_id = aabb_tree.GetNodeUserData(node_id).grid_id;
             if (grid_id == id)
                 return false; // Skip this grid.
-            return grid.CollidesWithGridWithOffsets(offset, GetGrid(grid_id).grid, {}, full) && bool(func(std::as_const(grid_id)));
+            return grid.CollidesWithGridWithOffsets(offset, *grids[grid_id.index], {}, full) && bool(func(std::as_const(grid_id)));
         });
     }
 
@@ -107,7 +250,7 @@ public:
         return aabb_tree.CollideAabb(GetGridAabb(grid, offset), [&](int id)
         {
             GridId grid_id = aabb_tree.GetNodeUserData(id).grid_id;
-            return grid.CollidesWithGridWithOffsets(offset, GetGrid(grid_id).grid, {}, full) && bool(func(std::as_const(grid_id)));
+            return grid.CollidesWithGridWithOffsets(offset, *grids[grid_id.index], {}, full) && bool(func(std::as_const(grid_id)));
         });
     }
 
@@ -133,8 +276,78 @@ public:
         });
     }
 
+    // The result of `RayCast()`.
+    struct RayHit
+    {
+        GridId grid_id;
+        // The hit position is `origin + dir * t`.
+        float t = 0;
+        // The tile that was hit, in the grid space.
+        ivec2 tile;
+    };
+
+    // Casts a ray `origin + dir * t` for `t` in `[0, max_t]` in the world space, and returns the first tile it hits.
+    // See `Grid::RayCastInGridSpace()` for the details.
+    // `filter` is `bool filter(GridId id)`. The grids for which it returns false are ignored.
+    template <typename F>
+    [[nodiscard]] std::optional<RayHit> RayCast(fvec2 origin, fvec2 dir, float max_t, F &&filter) const
+    {
+        std::optional<RayHit> ret;
+        aabb_tree.RayCast(origin, dir, max_t, [&](int node, float t)
+        {
+            (void)t;
+            GridId id = aabb_tree.GetNodeUserData(node).grid_id;
+            float cur_max_t = ret ? ret->t : max_t;
+            if (!filter(std::as_const(id)))
+                return cur_max_t;
+
+            std::optional<Grid::RayHit> hit = grids[id.index]->RayCastInWorldSpace(origin, dir, cur_max_t);
+            if (!hit)
+                return cur_max_t;
+            ret = RayHit{.grid_id = id, .t = hit->t, .tile = hit->tile};
+            return hit->t;
+        });
+        return ret;
+    }
+    // Same, but checks all grids.
+    [[nodiscard]] std::optional<RayHit> RayCast(fvec2 origin, fvec2 dir, float max_t) const
+    {
+        return RayCast(origin, dir, max_t, [](GridId){return true;});
+    }
+
+    // Saves all grids in a compact binary format, to be loaded with `LoadSnapshot()`.
+    // If `compress` is true, the data is compressed with `Archive::Compress()`.
+    [[nodiscard]] std::vector<std::uint8_t> SaveSnapshot(bool compress = true) const;
+    // Replaces all grids with the ones from a snapshot made by `SaveSnapshot()`, and rebuilds the AABB tree from scratch.
+    // Preserves the grid IDs, and the IDs that the new grids will get. Continuing the simulation gives the same results as with the original grids.
+    // Throws on failure, in which case the manager is unchanged.
+    void LoadSnapshot(const std::uint8_t *begin, const std::uint8_t *end);
+
     void Render(Xf camera) const;
+
+    // Fills `target` with the current positions of all grids. Reuses the existing capacity of `target`.
+    void TakeRenderSnapshot(RenderSnapshot &target) const;
+    // Renders the grids at the positions from a snapshot made by `TakeRenderSnapshot()`.
+    // This can run concurrently with `TickPhysics()`, but not with anything else that modifies the manager.
+    // In particular the grids from the snapshot must still exist and have the same tiles.
+    void Render(const RenderSnapshot &snapshot, Xf camera) const;
     void DebugRender(Xf camera, Grid::DebugRenderFlags flags) const;
 
+    // The pool must outlive this manager, or be unset before it's destroyed. Pass null to run everything on the calling thread.
+    // The results don't depend on the pool or on the number of threads in it.
+    void SetThreadPool(ThreadPool *new_thread_pool) {thread_pool = new_thread_pool;}
+    [[nodiscard]] ThreadPool *GetThreadPool() const {return thread_pool;}
+
+    // Whether `TickPhysics()` can put the resting grids to sleep, to skip them in the following ticks. This is enabled by default.
+    // A grid falls asleep when it and the grids it touches have no velocity, and wakes up when a moving grid gets close, or when it's modified.
+    // Disabling this wakes up all grids.
+    void SetSleepingAllowed(bool allowed);
+    [[nodiscard]] bool SleepingAllowed() const {return allow_sleeping;}
+    // Whether the grid is currently sleeping, see `SetSleepingAllowed()`.
+    [[nodiscard]] bool IsGridSleeping(GridId id) const {return hot.sleeping[DenseIndex(id)];}
+
     void TickPhysics();
+
+    // The phase timings of the last `TickPhysics()` call. This is for profiling.
+    [[nodiscard]] const PhysicsTimings &LastPhysicsTimings() const {return last_physics_timings;}
 };
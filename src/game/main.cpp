@@ -41,6 +41,9 @@ Input::Mouse mouse;
 Random::DefaultGenerator random_generator = Random::MakeGeneratorFromRandomDevice();
 Random::DefaultInterfaces<Random::DefaultGenerator> ra(random_generator);
 
+// The calling thread also participates in the work, so we need one less worker than the number of cores.
+ThreadPool thread_pool(int(std::thread::hardware_concurrency()) - 1);
+
 struct Application : Program::DefaultBasicState
 {
     GameUtils::State::Manager<StateBase> state_manager;
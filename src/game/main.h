@@ -33,6 +33,8 @@ extern Input::Mouse mouse;
 extern Random::DefaultGenerator random_generator;
 extern Random::DefaultInterfaces<Random::DefaultGenerator> ra;
 
+extern ThreadPool thread_pool;
+
 STRUCT( StateBase EXTENDS GameUtils::State::Base POLYMORPHIC )
 {
     StateBase() {}
@@ -2,10 +2,14 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <deque>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <optional>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -37,9 +41,12 @@
 #include "program/platform.h"
 #include "reflection/full_with_poly.h"
 #include "reflection/short_macros.h"
+#include "stream/input.h"
+#include "stream/output.h"
 #include "strings/common.h"
 #include "strings/format.h"
 #include "strings/lexical_cast.h"
+#include "utils/archive.h"
 #include "utils/clock.h"
 #include "utils/hash.h"
 #include "utils/json.h"
@@ -49,3 +56,5 @@
 #include "utils/poly_storage.h"
 #include "utils/random.h"
 #include "utils/simple_iterator.h"
+#include "utils/thread_pool.h"
+#include "utils/worker_thread.h"
@@ -14,8 +14,18 @@ namespace States
 
         Xf camera;
 
+        // `grids.TickPhysics()` runs on a separate thread while we render the state from before the tick.
+        // The hand-off point is the beginning of `Tick()`: we wait for the previous physics tick, modify the grids if needed,
+        // snapshot them for `Render()`, then start the next physics tick. Nothing else may touch `grids` while it runs.
+        // The thread is persistent, to avoid creating a new one every frame.
+        // This is declared after `grids`, so the destructor waits for the tick before destroying the grids.
+        WorkerThread physics_thread;
+        GridManager::RenderSnapshot render_snapshot;
+
         World()
         {
+            grids.SetThreadPool(&thread_pool);
+
             GridObject obj;
             obj.grid.LoadFromFile(Program::ExeDir() + "assets/test_ship.json");
 
@@ -135,6 +145,9 @@ namespace States
         {
             (void)next_state;
 
+            // Rethrows the exceptions from the physics tick, if any.
+            physics_thread.Wait();
+
             if (Input::Button(Input::d).pressed())
                 grids.ModifyGrid(my_grid_id, [](GridObject &obj){obj.grid.xf = obj.grid.xf.Rotate(1);});
 
@@ -158,7 +171,8 @@ namespace States
                 });
             }
 
-            grids.TickPhysics();
+            grids.TakeRenderSnapshot(render_snapshot);
+            physics_thread.Start([this]{grids.TickPhysics();});
 
             // grids.ModifyGrid(my_grid_id, [&](GridObject &obj)
             // {
@@ -173,7 +187,7 @@ namespace States
 
             r.BindShader();
 
-            grids.Render(camera);
+            grids.Render(render_snapshot, camera);
             // grids.DebugRender(camera, Grid::DebugRenderFlags::all);
 
             // { // Cursor.
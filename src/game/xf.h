@@ -7,6 +7,8 @@ struct Xf
 
     Xf() {}
 
+    [[nodiscard]] friend bool operator==(const Xf &, const Xf &) = default;
+
     [[nodiscard]] static Xf Pos(ivec2 pos)
     {
         Xf ret;
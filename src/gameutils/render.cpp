@@ -120,7 +120,7 @@ void Render::SetColorMatrix(const fmat4 &m)
 
 Render::Quad_t::~Quad_t()
 {
-    if (!queue)
+    if (!queue && !list)
         return;
 
     ASSERT(data.has_texture || data.has_color, "2D poly renderer: Quad with no texture nor color specified.");
@@ -201,9 +201,59 @@ Render::Quad_t::~Quad_t()
     out[1].texcoord = {out[2].texcoord.x, out[0].texcoord.y};
     out[3].texcoord = {out[0].texcoord.x, out[2].texcoord.y};
 
+    if (list)
+    {
+        for (const auto &it : out)
+            list->vertices.push_back({.pos = it.pos, .color = it.color, .texcoord = it.texcoord, .factors = it.factors});
+        return;
+    }
+
     ((decltype(Render::Data::queue) *)queue)->Add(out[0], out[1], out[2], out[3]);
 }
 
+void Render::AddQuads(const QuadList &list, fvec2 offset, std::optional<fvec3> color)
+{
+    auto &queue = data->queue;
+    std::size_t max_batch = queue.Size() / 2; // Two triangles per quad.
+    ASSERT(max_batch > 0, "2D poly renderer: The render queue is too small.");
+
+    const Vertex *in = list.vertices.data();
+    std::size_t remaining = list.QuadCount();
+
+    while (remaining > 0)
+    {
+        std::size_t batch = std::min(remaining, max_batch);
+        Data::Attribs *out = queue.Reserve(batch * 2);
+
+        for (std::size_t i = 0; i < batch; i++)
+        {
+            Data::Attribs q[4];
+            for (int j = 0; j < 4; j++)
+            {
+                const Vertex &v = in[i * 4 + j];
+                q[j].pos = v.pos + offset;
+                q[j].color = color ? color->to_vec4(0) : v.color;
+                q[j].texcoord = v.texcoord;
+                q[j].factors = v.factors;
+                if (color)
+                    q[j].factors.x = 0;
+            }
+
+            // Same triangles as in `SimpleRenderQueue::Add()`.
+            Data::Attribs *tri = out + i * 6;
+            tri[0] = q[0];
+            tri[1] = q[1];
+            tri[2] = q[3];
+            tri[3] = q[3];
+            tri[4] = q[1];
+            tri[5] = q[2];
+        }
+
+        in += batch * 4;
+        remaining -= batch;
+    }
+}
+
 Render::Triangle_t::~Triangle_t()
 {
     if (!queue)
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <memory>
+#include <optional>
 #include <utility>
+#include <vector>
 
 #include "graphics/text.h"
 #include "graphics/texture_atlas.h"
@@ -48,13 +50,26 @@ class Render
 
     void SetColorMatrix(const fmat4 &m);
 
+    // A vertex of a `QuadList`. Same as the vertices we send to the shader.
+    struct Vertex
+    {
+        fvec2 pos;
+        fvec4 color;
+        fvec2 texcoord;
+        fvec3 factors;
+    };
+
+    class QuadList;
+
     class Quad_t
     {
         friend class Render;
+        friend class QuadList;
 
         using ref = Quad_t &&;
 
         void *queue = 0; // Actually the type should be `Graphics::SimpleRenderQueue<Attribs, 3> *`, but we don't include "graphics/simple_render_queue.h" for better compilation times.
+        QuadList *list = 0; // If this is set instead of `queue`, the quad is appended to this list.
 
         struct Data
         {
@@ -91,11 +106,17 @@ class Render
             data.pos = pos;
             data.size = size;
         }
+        Quad_t(QuadList *list, fvec2 pos, fvec2 size) : list(list)
+        {
+            data.pos = pos;
+            data.size = size;
+        }
       public:
-        Quad_t(Quad_t &&other) noexcept : queue(std::exchange(other.queue, {})), data(std::move(other.data)) {}
+        Quad_t(Quad_t &&other) noexcept : queue(std::exchange(other.queue, {})), list(std::exchange(other.list, {})), data(std::move(other.data)) {}
         Quad_t &operator=(Quad_t other) noexcept
         {
             std::swap(queue, other.queue);
+            std::swap(list, other.list);
             std::swap(data, other.data);
             return *this;
         }
@@ -562,6 +583,51 @@ class Render
         return fquad(pos, image);
     }
 
+    // A list of quads computed in advance, to be drawn many times with `AddQuads()` without recomputing them.
+    // Add quads with `fquad()` and `iquad()`, same as with `Render` itself.
+    class QuadList
+    {
+        friend class Render;
+        friend class Quad_t;
+
+        std::vector<Vertex> vertices; // 4 per quad, in the same order as passed to the render queue.
+
+      public:
+        QuadList() {}
+
+        [[nodiscard]] bool IsEmpty() const {return vertices.empty();}
+        [[nodiscard]] std::size_t QuadCount() const {return vertices.size() / 4;}
+
+        // Removes all quads, but keeps the memory.
+        void Clear() {vertices.clear();}
+
+        Quad_t fquad(fvec2 pos, fvec2 size)
+        {
+            return Quad_t(this, pos, size);
+        }
+
+        Quad_t iquad(fvec2 pos, fvec2 size) = delete;
+        Quad_t iquad(ivec2 pos, ivec2 size)
+        {
+            return Quad_t(this, pos, size);
+        }
+
+        Quad_t fquad(fvec2 pos, const Graphics::TextureAtlas::Region &image)
+        {
+            return fquad(pos, image.size).tex(image.pos);
+        }
+
+        Quad_t iquad(fvec2 pos, const Graphics::TextureAtlas::Region &image) = delete;
+        Quad_t iquad(ivec2 pos, const Graphics::TextureAtlas::Region &image)
+        {
+            return fquad(pos, image);
+        }
+    };
+
+    // Adds all quads from the list to the queue, moved by `offset`.
+    // If `color` is specified, it replaces the texture color, keeping the texture alpha. Same as `.color(*color).mix(0)`, so it only makes sense for textured quads.
+    void AddQuads(const QuadList &list, fvec2 offset, std::optional<fvec3> color = {});
+
     Triangle_t ftriangle(fvec2 a, fvec2 b, fvec2 c)
     {
         return Triangle_t(GetRenderQueuePtr(), a, b, c);
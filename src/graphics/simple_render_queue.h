@@ -7,6 +7,7 @@
 #include <vector>
 
 #include "graphics/vertex_buffer.h"
+#include "program/errors.h"
 
 namespace Graphics
 {
@@ -70,6 +71,18 @@ namespace Graphics
             pos = 0;
         }
 
+        // Returns the space for `count` more primitives (`count * N` vertices), which the caller must fill.
+        // Flushes first if they don't fit. `count` must not exceed `Size()`.
+        [[nodiscard]] T *Reserve(std::size_t count)
+        {
+            ASSERT(count <= size, "Too many primitives for the render queue.");
+            if (pos + count > size)
+                Flush();
+            T *ret = storage.get() + N * pos;
+            pos += count;
+            return ret;
+        }
+
         void Add(const T &a) requires (N == 1)
         {
             AddLow(a);
@@ -1,13 +1,23 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
 #include <concepts>
+#include <numeric>
+#include <span>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "macros/finally.h"
 #include "program/platform.h"
 #include "utils/mat.h"
 #include "utils/sparse_set.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 // This is a rewrite of box2d's b2DynamicTree by Erin Catto,
 // which was in turn inspired by BulletPhysics's btDbvt by Nathanael Presson.
 // (This probably refers to `struct b3DynamicBvh`?)
@@ -21,10 +31,16 @@
 #  endif
 #endif
 
+// When the automatic validation is enabled, each change only validates the nodes it touched, which is O(log n).
+// If this is positive, the whole tree is additionally validated after every this many changes, which is O(n).
+#ifndef IMP_AUTO_VALIDATE_AABB_TREES_FULL_INTERVAL
+#define IMP_AUTO_VALIDATE_AABB_TREES_FULL_INTERVAL 0
+#endif
+
 // `T` is a vector type, either integral or floating-point.
 // Only 2D vectors have been tested properly, the cost heuristics may not work in higher dimensions.
-// `UserData` is an arbitrary type, an instance of which will be stored in each node.
-// Keep it small, since it'll also be stored in internal non-leaf nodes, and copied around on a whim.
+// `UserData` is an arbitrary type, an instance of which will be stored in each leaf node.
+// It's stored separately from the nodes themselves, so its size doesn't affect the queries.
 // If `Inclusive == false`, the second corner of AABBs is exclusive. This is more convenient when dealing integral coordinates.
 // `Inclusive == true` is intended for floating-point coordinates. It makes both AABB corners inclusive.
 template <Math::vector T, typename UserData = void, bool Inclusive = false>
@@ -35,6 +51,9 @@ class AabbTree
     using vector = T;
     using scalar = typename T::type;
     using user_data = std::conditional_t<std::is_void_v<UserData>, Empty, UserData>;
+    // The vector type for `RayCast()`. It's floating-point even if `T` is integral.
+    using ray_vector = Math::vec<T::size, std::conditional_t<std::is_floating_point_v<scalar>, scalar, float>>;
+    using ray_scalar = typename ray_vector::type;
 
     struct Params
     {
@@ -103,8 +122,8 @@ class AabbTree
         [[nodiscard]] Aabb ExpandInDir(T value) const
         {
             Aabb ret = *this;
-            for (int i = 0; i < 2; i++)
-                (value[i] < 0 ? ret.a : ret.b) += value;
+            for (int i = 0; i < T::size; i++)
+                (value[i] < 0 ? ret.a : ret.b)[i] += value[i];
             return ret;
         }
 
@@ -138,7 +157,7 @@ class AabbTree
     [[nodiscard]] int AddNode(Aabb new_aabb, user_data new_data = {}, int new_index = null_index) noexcept
     {
         #if IMP_AUTO_VALIDATE_AABB_TREES
-        FINALLY{Validate();};
+        FINALLY{AutoValidate(new_index);};
         #endif
 
         sort_two_var(new_aabb.a, new_aabb.b);
@@ -152,14 +171,16 @@ class AabbTree
         }
         else
         {
-            ASSERT(node_set.Insert(new_index));
+            // Not inside of `ASSERT()`, since that's removed in prod builds.
+            [[maybe_unused]] bool inserted = node_set.Insert(new_index);
+            ASSERT(inserted);
         }
 
         // Don't want to create a reference to `nodes[new_index]` yet, since it can become dangling later.
         nodes[new_index] = {}; // Reset the node.
         nodes[new_index].aabb = new_aabb;
-        // nodes[new_index].moved = true; // See `struct Node` below.
-        nodes[new_index].userdata = std::move(new_data);
+        nodes[new_index].moved = true;
+        userdata[new_index] = std::move(new_data);
 
         if (node_set.ElemCount() == 1)
         {
@@ -251,14 +272,86 @@ class AabbTree
         return new_index;
     }
 
+    // Replaces the contents of the tree with the specified leaves, building it top-down in O(n log n).
+    // This is much faster than adding them one by one, and gives a better tree. See `BuildSubtree()` for the algorithm.
+    // The leaves get indices `0 .. leaves.size()-1`, in the same order. The internal nodes get the following indices.
+    void Build(std::span<const std::pair<Aabb, user_data>> leaves)
+    {
+        #if IMP_AUTO_VALIDATE_AABB_TREES
+        FINALLY{AutoValidate(null_index);};
+        #endif
+
+        node_set.EraseAllElements();
+        root_index = null_index;
+
+        if (leaves.empty())
+            return;
+
+        int num_nodes = int(leaves.size()) * 2 - 1;
+        Reserve(num_nodes);
+
+        for (int i = 0; i < int(leaves.size()); i++)
+        {
+            node_set.Insert(i);
+
+            Aabb aabb = leaves[i].first;
+            sort_two_var(aabb.a, aabb.b);
+
+            Node &node = nodes[i];
+            node = {};
+            node.aabb = aabb.Expand(params.extra_margin);
+            node.moved = true;
+            userdata[i] = leaves[i].second;
+        }
+
+        std::vector<int> leaf_indices(leaves.size());
+        std::iota(leaf_indices.begin(), leaf_indices.end(), 0);
+        std::vector<int> internal_indices(leaves.size() - 1);
+        std::iota(internal_indices.begin(), internal_indices.end(), int(leaves.size()));
+        for (int index : internal_indices)
+            node_set.Insert(index);
+
+        int next_internal = 0;
+        root_index = BuildSubtree(leaf_indices, internal_indices, next_internal);
+        ASSERT(next_internal == int(internal_indices.size()));
+    }
+
+    // Rebuilds the tree from the existing leaves, in the same way as `Build()`. All node indices remain valid, and leaves keep their AABBs and data.
+    // Use this when the tree quality degrades, e.g. after a lot of objects were moved far away at once.
+    void Rebuild()
+    {
+        if (node_set.ElemCount() <= 1)
+            return;
+
+        #if IMP_AUTO_VALIDATE_AABB_TREES
+        FINALLY{AutoValidate(null_index);};
+        #endif
+
+        std::vector<int> leaf_indices, internal_indices;
+        leaf_indices.reserve(node_set.ElemCount() / 2 + 1);
+        internal_indices.reserve(node_set.ElemCount() / 2);
+        for (int i = 0; i < node_set.ElemCount(); i++)
+        {
+            int index = node_set.GetElem(i);
+            (nodes[index].IsLeaf() ? leaf_indices : internal_indices).push_back(index);
+        }
+
+        int next_internal = 0;
+        root_index = BuildSubtree(leaf_indices, internal_indices, next_internal);
+        ASSERT(next_internal == int(internal_indices.size()));
+    }
+
     // Removes a node. Returns false if the index is invalid.
     bool RemoveNode(int target_index) noexcept
     {
         if (!node_set.Contains(target_index))
             return false;
 
+        // The sibling replaces the parent, so it's the lowest node we touch. Stays null if the tree becomes empty.
+        int sibling = null_index;
+
         #if IMP_AUTO_VALIDATE_AABB_TREES
-        FINALLY{Validate();};
+        FINALLY{AutoValidate(sibling);};
         #endif
 
         if (target_index == root_index)
@@ -271,7 +364,6 @@ class AabbTree
         int parent = nodes[target_index].parent;
         int grand_parent = nodes[parent].parent;
 
-        int sibling;
         if (nodes[parent].children[0] == target_index)
             sibling = nodes[parent].children[1];
         else
@@ -328,10 +420,59 @@ class AabbTree
 
         // The existing rect is either too big or too small.
 
-        user_data userdata = std::move(node.userdata);
+        user_data data = std::move(userdata[target_index]);
 
         RemoveNode(target_index);
-        (void)AddNode(large_aabb, std::move(userdata), target_index);
+        (void)AddNode(large_aabb, std::move(data), target_index);
+    }
+
+    // Enlarges the AABB of a leaf node to contain `aabb` (expanded by `params.extra_margin`), without restructuring the tree.
+    // Returns false if the node already contained `aabb`, in which case nothing is changed.
+    // This is cheaper than `ModifyNode()`, but the tree quality degrades if you keep doing it, so only use this for temporary growth
+    // (e.g. to cover the area swept by an object during a tick), and keep calling `ModifyNode()` as usual, which will shrink the node back if needed.
+    bool EnlargeNode(int target_index, Aabb aabb)
+    {
+        ASSERT(node_set.Contains(target_index));
+        ASSERT(nodes[target_index].IsLeaf());
+
+        sort_two_var(aabb.a, aabb.b);
+        if (nodes[target_index].aabb.Contains(aabb))
+            return false;
+
+        #if IMP_AUTO_VALIDATE_AABB_TREES
+        FINALLY{AutoValidate(target_index);};
+        #endif
+
+        Node &node = nodes[target_index];
+        node.aabb = node.aabb.Combine(aabb.Expand(params.extra_margin));
+        node.moved = true;
+
+        // Update the parents, until we find one that already contains the new AABB.
+        for (int index = node.parent; index != null_index; index = nodes[index].parent)
+        {
+            Node &parent = nodes[index];
+            UpdatePackedNode(index);
+            Aabb new_parent_aabb = nodes[parent.children[0]].aabb.Combine(nodes[parent.children[1]].aabb);
+            if (new_parent_aabb == parent.aabb)
+                break;
+            parent.aabb = new_parent_aabb;
+        }
+
+        return true;
+    }
+
+    // Returns true if the leaf node was added, reinserted by `ModifyNode()`, or enlarged by `EnlargeNode()` since the last `ClearMovedFlags()` call.
+    [[nodiscard]] bool NodeMoved(int node_index) const
+    {
+        ASSERT(node_set.Contains(node_index));
+        return nodes[node_index].moved;
+    }
+
+    // Resets the flags returned by `NodeMoved()`.
+    void ClearMovedFlags()
+    {
+        for (int i = 0; i < node_set.ElemCount(); i++)
+            nodes[node_set.GetElem(i)].moved = false;
     }
 
     // Returns arbitrary user data for the node.
@@ -342,7 +483,7 @@ class AabbTree
     [[nodiscard]] const user_data &GetNodeUserData(int node_index) const
     {
         ASSERT(node_set.Contains(node_index));
-        return nodes[node_index].userdata;
+        return userdata[node_index];
     }
 
     // Returns the AABB of a node. It might be larger than the requested AABB.
@@ -369,7 +510,38 @@ class AabbTree
     bool CollideAabb(Aabb aabb, F &&func) const
     {
         sort_two_var(aabb.a, aabb.b);
-        return CollideCustom([&aabb](const Aabb &node_aabb){return aabb.Intersects(node_aabb);}, std::forward<F>(func));
+
+        #if defined(__SSE2__)
+        if constexpr (std::is_same_v<T, ivec2>)
+        {
+            // Test both children at once. The lanes are `{x of child 0, x of child 1, y of child 0, y of child 1}`, see `PackedNode`.
+            __m128i query_a = _mm_setr_epi32(aabb.a.x, aabb.a.x, aabb.a.y, aabb.a.y);
+            __m128i query_b = _mm_setr_epi32(aabb.b.x, aabb.b.x, aabb.b.y, aabb.b.y);
+            return CollidePacked([&aabb](const Aabb &node_aabb){return aabb.Intersects(node_aabb);}, [&](const PackedNode &node)
+            {
+                __m128i node_a = _mm_loadu_si128((const __m128i *)node.a);
+                __m128i node_b = _mm_loadu_si128((const __m128i *)node.b);
+                int lanes;
+                if constexpr (Inclusive)
+                {
+                    // `!(node_a > query_b) && !(query_a > node_b)`
+                    __m128i fail = _mm_or_si128(_mm_cmpgt_epi32(node_a, query_b), _mm_cmpgt_epi32(query_a, node_b));
+                    lanes = ~_mm_movemask_ps(_mm_castsi128_ps(fail));
+                }
+                else
+                {
+                    // `node_a < query_b && node_b > query_a`
+                    __m128i pass = _mm_and_si128(_mm_cmplt_epi32(node_a, query_b), _mm_cmpgt_epi32(node_b, query_a));
+                    lanes = _mm_movemask_ps(_mm_castsi128_ps(pass));
+                }
+                return lanes & lanes >> 2 & 3;
+            }, func);
+        }
+        else
+        #endif
+        {
+            return CollideCustom([&aabb](const Aabb &node_aabb){return aabb.Intersects(node_aabb);}, std::forward<F>(func));
+        }
     }
 
     // A custom collision test.
@@ -379,38 +551,174 @@ class AabbTree
     template <typename C, typename F>
     bool CollideCustom(C &&check_collision, F &&func) const
     {
-        static constexpr bool (*lambda)(const AabbTree &, int, C &, F &) =
-        [](const AabbTree &self, int node_index, C &check_collision, F &func) -> bool
+        return CollidePacked(check_collision, [&check_collision](const PackedNode &node)
         {
-            const Node &node = self.nodes[node_index];
-            if (check_collision(std::as_const(node.aabb)))
+            return int(bool(check_collision(node.ChildAabb(0)))) | int(bool(check_collision(node.ChildAabb(1)))) << 1;
+        }, func);
+    }
+
+    // Casts a ray `origin + dir * t` for `t` in `[0, max_t]`, and reports the leaves it hits. `dir` doesn't have to be normalized.
+    // The AABBs are treated as closed continuous boxes `[a, b]`, regardless of `Inclusive`.
+    // `func` is `ray_scalar func(int node, ray_scalar t)`, where `t` is the distance at which the ray enters the leaf AABB.
+    // It should return the new `max_t`: either the same one to continue, or the distance to the exact hit to only look for closer hits after it,
+    // or a negative value to stop immediately. The nodes are visited approximately front to back, so clipping the ray skips most of the remaining ones.
+    // Since we expand AABBs, you might get false positive nodes. Manually check if the collision is exact.
+    template <typename F>
+    void RayCast(ray_vector origin, ray_vector dir, ray_scalar max_t, F &&func) const
+    {
+        if (root_index == null_index)
+            return;
+
+        ray_vector inv_dir;
+        for (int i = 0; i < T::size; i++)
+            inv_dir[i] = dir[i] == 0 ? 0 : 1 / dir[i];
+
+        // Computes the distance at which the ray enters `aabb`, returns false if it doesn't hit it before `max_t`.
+        auto RayEntersAabb = [&](const Aabb &aabb, ray_scalar &t) -> bool
+        {
+            ray_scalar t_enter = 0, t_exit = max_t;
+            for (int i = 0; i < T::size; i++)
+            {
+                if (dir[i] == 0)
+                {
+                    if (origin[i] < ray_scalar(aabb.a[i]) || origin[i] > ray_scalar(aabb.b[i]))
+                        return false;
+                    continue;
+                }
+
+                ray_scalar t_a = (ray_scalar(aabb.a[i]) - origin[i]) * inv_dir[i];
+                ray_scalar t_b = (ray_scalar(aabb.b[i]) - origin[i]) * inv_dir[i];
+                if (t_a > t_b)
+                    std::swap(t_a, t_b);
+                clamp_var_min(t_enter, t_a);
+                clamp_var_max(t_exit, t_b);
+            }
+            t = t_enter;
+            return t_enter <= t_exit;
+        };
+
+        struct Entry
+        {
+            int index = null_index; // Leaves are stored as `~index`, like in `PackedNode`.
+            ray_scalar t = 0; // Where the ray enters the node.
+        };
+
+        Entry cur;
+        if (!RayEntersAabb(nodes[root_index].aabb, cur.t))
+            return;
+        cur.index = nodes[root_index].IsLeaf() ? ~root_index : root_index;
+
+        TraversalStack<Entry> stack;
+        while (true)
+        {
+            // `max_t` could've decreased since this node was pushed.
+            if (cur.t <= max_t)
             {
-                if (node.IsLeaf())
+                if (cur.index < 0)
                 {
-                    if (func(std::as_const(node_index)))
-                        return true;
+                    const int leaf_index = ~cur.index;
+                    ray_scalar new_max_t = func(leaf_index, std::as_const(cur.t));
+                    if (new_max_t < 0)
+                        return;
+                    clamp_var_max(max_t, new_max_t);
                 }
                 else
                 {
-                    if (lambda(self, node.children[0], check_collision, func))
-                        return true;
-                    if (lambda(self, node.children[1], check_collision, func))
-                        return true;
+                    const PackedNode &node = packed_nodes[cur.index];
+                    Entry children[2] = {{.index = node.children[0]}, {.index = node.children[1]}};
+                    bool hits[2] = {RayEntersAabb(node.ChildAabb(0), children[0].t), RayEntersAabb(node.ChildAabb(1), children[1].t)};
+
+                    if (hits[0] && hits[1])
+                    {
+                        // Visit the closer child first.
+                        bool swap = children[1].t < children[0].t;
+                        stack.Push(children[!swap]);
+                        cur = children[swap];
+                        continue;
+                    }
+                    if (hits[0] || hits[1])
+                    {
+                        cur = children[hits[1]];
+                        continue;
+                    }
                 }
             }
-            return false;
+
+            if (stack.IsEmpty())
+                return;
+            cur = stack.Pop();
+        }
+    }
+
+    // Finds all pairs of overlapping leaf nodes in this tree. Each unordered pair is reported once, in an unspecified order.
+    // `func` is `bool func(int node_a, int node_b)`. If it returns true, the function stops immediately and also returns true.
+    // This traverses the tree against itself, which is cheaper than calling `CollideAabb()` for every leaf.
+    // Since we expand AABBs, you might get false positive pairs. Manually check if the collision is exact.
+    template <typename F>
+    bool CollidePairs(F &&func) const
+    {
+        static constexpr bool (*lambda)(const AabbTree &, int, F &) =
+        [](const AabbTree &self, int node_index, F &func) -> bool
+        {
+            const Node &node = self.nodes[node_index];
+            if (node.IsLeaf())
+                return false;
+            return lambda(self, node.children[0], func) || lambda(self, node.children[1], func) || CollideNodePairs(self, node.children[0], self, node.children[1], func);
         };
-        return root_index == null_index ? false : lambda(*this, root_index, check_collision, func);
+        return root_index == null_index ? false : lambda(*this, root_index, func);
+    }
+
+    // Same as `CollidePairs()`, but only reports the pairs where at least one of the nodes is marked as moved (see `NodeMoved()`).
+    // This is what Box2D does with its move buffer: if you remember the pairs from the previous call, only the new ones need to be found.
+    // Since nodes are only marked as moved when they're reinserted or enlarged, an overlap can't start between two nodes that aren't marked.
+    template <typename F>
+    bool CollideMovedPairs(F &&func) const
+    {
+        for (int i = 0; i < node_set.ElemCount(); i++)
+        {
+            int node_index = node_set.GetElem(i);
+            const Node &node = nodes[node_index];
+            if (!node.IsLeaf() || !node.moved)
+                continue;
+
+            bool stop = CollideCustom([&node](const Aabb &other_aabb){return node.aabb.Intersects(other_aabb);}, [&](int other_index)
+            {
+                // If both nodes are marked, report the pair only once.
+                if (other_index == node_index || (nodes[other_index].moved && other_index < node_index))
+                    return false;
+                return bool(func(std::as_const(node_index), std::as_const(other_index)));
+            });
+            if (stop)
+                return true;
+        }
+        return false;
     }
 
-    // Performs some internal tests. Throws on failure.
-    // In the debug builds this is called automatically as needed.
-    void Validate()
+    // Finds all pairs of overlapping leaf nodes between this tree and `other`, by traversing both at the same time.
+    // `func` is `bool func(int this_node, int other_node)`. If it returns true, the function stops immediately and also returns true.
+    // Since we expand AABBs, you might get false positive pairs. Manually check if the collision is exact.
+    template <typename F>
+    bool CollidePairsWithTree(const AabbTree &other, F &&func) const
+    {
+        if (root_index == null_index || other.root_index == null_index)
+            return false;
+        return CollideNodePairs(*this, root_index, other, other.root_index, func);
+    }
+
+    // Performs some internal tests on the whole tree. Throws on failure.
+    // In the debug builds, the parts of the tree affected by each change are validated automatically, see `IMP_AUTO_VALIDATE_AABB_TREES`.
+    void Validate() const
     {
         if (root_index != null_index)
             ValidateNode(root_index);
     }
 
+    // How much time the automatic validation took so far, in seconds. Zero if it's disabled.
+    [[nodiscard]] double ValidationTime() const
+    {
+        return validation_time;
+    }
+
     // Reserves memory for a specific number of nodes.
     void Reserve(int new_capacity)
     {
@@ -419,6 +727,8 @@ class AabbTree
 
         node_set.Reserve(new_capacity);
         nodes.resize(new_capacity);
+        packed_nodes.resize(new_capacity);
+        userdata.resize(new_capacity);
     }
     // Lets you look at the node set, mostly for debug purposes.
     [[nodiscard]] const SparseSet<int> &Nodes() const
@@ -456,6 +766,11 @@ class AabbTree
 
     int root_index = null_index;
 
+    // See `ValidationTime()`.
+    double validation_time = 0;
+    // For `IMP_AUTO_VALIDATE_AABB_TREES_FULL_INTERVAL`.
+    int changes_since_full_validation = 0;
+
     struct Node
     {
         Aabb aabb;
@@ -463,15 +778,12 @@ class AabbTree
         int height = 0;
 
         // Box2d sets this to true when a leaf node is created or moved.
-        // I don't see any use for it yet, so it's commented out.
-        // bool moved = false;
+        // We also set it in `EnlargeNode()`. It's used by `CollideMovedPairs()`.
+        bool moved = false;
 
         int parent = null_index;
         int children[2] = {null_index, null_index};
 
-        // Arbitrary data.
-        [[no_unique_address]] user_data userdata;
-
         [[nodiscard]] bool IsLeaf() const
         {
             return children[0] == null_index;
@@ -479,6 +791,128 @@ class AabbTree
     };
     std::vector<Node> nodes;
 
+    // The parts of the internal nodes needed for the queries, packed together. Indexed in the same way as `nodes`, unused for the leaves.
+    // Updated by `UpdatePackedNode()` whenever the children or their AABBs change.
+    struct PackedNode
+    {
+        // The AABBs of both children, in the SoA layout: `a[axis][child]`.
+        scalar a[T::size][2];
+        scalar b[T::size][2];
+
+        // Same as in `Node`, but the leaves are stored as `~index`, which is always negative.
+        int children[2];
+
+        [[nodiscard]] Aabb ChildAabb(int child) const
+        {
+            Aabb ret;
+            for (int i = 0; i < T::size; i++)
+            {
+                ret.a[i] = a[i][child];
+                ret.b[i] = b[i][child];
+            }
+            return ret;
+        }
+    };
+    std::vector<PackedNode> packed_nodes;
+
+    // Indexed in the same way as `nodes`, unused for the internal nodes.
+    std::vector<user_data> userdata;
+
+    // A stack of nodes for the tree traversal. Doesn't allocate unless the tree is very deep.
+    template <typename E>
+    class TraversalStack
+    {
+        static constexpr int fixed_capacity = 64;
+        E fixed[fixed_capacity];
+        int fixed_size = 0;
+        std::vector<E> overflow;
+
+      public:
+        [[nodiscard]] bool IsEmpty() const
+        {
+            return fixed_size == 0;
+        }
+
+        void Push(const E &elem)
+        {
+            if (fixed_size < fixed_capacity)
+                fixed[fixed_size++] = elem;
+            else
+                overflow.push_back(elem);
+        }
+
+        // The stack must not be empty.
+        [[nodiscard]] E Pop()
+        {
+            if (!overflow.empty())
+            {
+                E ret = overflow.back();
+                overflow.pop_back();
+                return ret;
+            }
+            return fixed[--fixed_size];
+        }
+    };
+
+    // The common part of all queries. Visits the nodes in the same order as a recursive depth-first traversal.
+    // `check_collision` is `bool check_collision(const Aabb &aabb)`, only used for the root.
+    // `check_children` is `int check_children(const PackedNode &node)`, a faster way of calling `check_collision` on both children.
+    // Must return a bit mask: 1 for the first child, 2 for the second one.
+    // `func` is the same as in `CollideCustom()`.
+    template <typename C, typename CC, typename F>
+    bool CollidePacked(C &&check_collision, CC &&check_children, F &&func) const
+    {
+        if (root_index == null_index || !check_collision(std::as_const(nodes[root_index].aabb)))
+            return false;
+        if (nodes[root_index].IsLeaf())
+            return bool(func(std::as_const(root_index)));
+
+        TraversalStack<int> stack;
+        int index = root_index;
+        while (true)
+        {
+            const PackedNode &node = packed_nodes[index];
+            int mask = check_children(node);
+
+            // Go to the first child right away, and remember the second one for later.
+            if (mask & 2)
+                stack.Push(node.children[1]);
+            if (mask & 1)
+                index = node.children[0];
+            else if (stack.IsEmpty())
+                return false;
+            else
+                index = stack.Pop();
+
+            while (index < 0)
+            {
+                const int leaf_index = ~index;
+                if (func(leaf_index))
+                    return true;
+                if (stack.IsEmpty())
+                    return false;
+                index = stack.Pop();
+            }
+        }
+    }
+
+    // Updates `packed_nodes[index]` from `nodes`. The node must be internal.
+    void UpdatePackedNode(int index)
+    {
+        const Node &node = nodes[index];
+        PackedNode &packed = packed_nodes[index];
+        for (int i = 0; i < 2; i++)
+        {
+            const Node &child = nodes[node.children[i]];
+            packed.children[i] = child.IsLeaf() ? ~node.children[i] : node.children[i];
+            for (int j = 0; j < T::size; j++)
+            {
+                packed.a[j][i] = child.aabb.a[j];
+                packed.b[j][i] = child.aabb.b[j];
+            }
+        }
+    }
+
     // Increases the capacity if we're full.
     void ReserveMoreIfFull()
     {
@@ -550,6 +984,7 @@ class AabbTree
 
     			a.height = 1 + max(b.height, e.height);
     			c.height = 1 + max(a.height, d.height);
+    			UpdatePackedNode(ia);
     		}
     		else
     		{
@@ -561,6 +996,7 @@ class AabbTree
 
     			a.height = 1 + max(b.height, d.height);
     			c.height = 1 + max(a.height, e.height);
+    			UpdatePackedNode(ia);
     		}
 
     		return ic;
@@ -610,6 +1046,7 @@ class AabbTree
 
     			a.height = 1 + max(c.height, e.height);
     			b.height = 1 + max(a.height, d.height);
+    			UpdatePackedNode(ia);
     		}
     		else
     		{
@@ -621,6 +1058,7 @@ class AabbTree
 
     			a.height = 1 + max(c.height, d.height);
     			b.height = 1 + max(a.height, e.height);
+    			UpdatePackedNode(ia);
     		}
 
     		return ib;
@@ -642,20 +1080,227 @@ class AabbTree
 
             node.height = 1 + max(child0.height, child1.height);
             node.aabb = child0.aabb.Combine(child1.aabb);
+            UpdatePackedNode(index);
 
             index = node.parent;
         }
     }
 
+    // Builds a subtree from the existing leaves `leaf_indices`, and returns its root. Used by `Build()` and `Rebuild()`.
+    // The internal nodes are taken from `internal_indices` starting at `next_internal`, which is incremented. They must already be in `node_set`.
+    // Reorders the `leaf_indices`. Sets the parent of the resulting root to null.
+    // The leaves are split using the surface area heuristic (with perimeters instead of areas, as in `AddNode()`),
+    // approximated by sorting the leaf centers into bins. If that fails (e.g. all centers are the same), splits in halves by the median.
+    [[nodiscard]] int BuildSubtree(std::span<int> leaf_indices, std::span<const int> internal_indices, int &next_internal)
+    {
+        if (leaf_indices.size() == 1)
+        {
+            nodes[leaf_indices.front()].parent = null_index;
+            return leaf_indices.front();
+        }
+
+        // The doubled centers of the leaves, to avoid dividing.
+        auto Center = [&](int index) {return nodes[index].aabb.a + nodes[index].aabb.b;};
+
+        T center_min = Center(leaf_indices.front()), center_max = center_min;
+        for (int index : leaf_indices)
+        {
+            T center = Center(index);
+            center_min = min(center_min, center);
+            center_max = max(center_max, center);
+        }
+        T extent = center_max - center_min;
+
+        static constexpr int max_bins = 16;
+        int num_bins = min(max_bins, int(leaf_indices.size()));
+        auto GetBin = [&](int index, int axis)
+        {
+            return clamp(int((Center(index)[axis] - center_min[axis]) * num_bins / extent[axis]), 0, num_bins - 1);
+        };
+
+        // Find the best split: along which axis, and how many bins go to the first half.
+        int best_axis = -1, best_split = 0;
+        double best_cost = 0;
+        for (int axis = 0; axis < T::size; axis++)
+        {
+            if (extent[axis] <= 0)
+                continue;
+
+            struct Bin
+            {
+                Aabb aabb;
+                int count = 0;
+            };
+            Bin bins[max_bins];
+            for (int index : leaf_indices)
+            {
+                Bin &bin = bins[GetBin(index, axis)];
+                bin.aabb = bin.count == 0 ? nodes[index].aabb : bin.aabb.Combine(nodes[index].aabb);
+                bin.count++;
+            }
+
+            // The costs of the second halves, for each split.
+            double suffix_costs[max_bins] = {};
+            Aabb suffix_aabb;
+            int suffix_count = 0;
+            for (int i = num_bins - 1; i > 0; i--)
+            {
+                if (bins[i].count > 0)
+                {
+                    suffix_aabb = suffix_count == 0 ? bins[i].aabb : suffix_aabb.Combine(bins[i].aabb);
+                    suffix_count += bins[i].count;
+                }
+                suffix_costs[i] = suffix_count == 0 ? -1 : double(suffix_aabb.GetPerimeter()) * suffix_count;
+            }
+
+            Aabb prefix_aabb;
+            int prefix_count = 0;
+            for (int i = 1; i < num_bins; i++)
+            {
+                if (bins[i - 1].count > 0)
+                {
+                    prefix_aabb = prefix_count == 0 ? bins[i - 1].aabb : prefix_aabb.Combine(bins[i - 1].aabb);
+                    prefix_count += bins[i - 1].count;
+                }
+                if (prefix_count == 0 || suffix_costs[i] < 0)
+                    continue;
+
+                double cost = double(prefix_aabb.GetPerimeter()) * prefix_count + suffix_costs[i];
+                if (best_axis == -1 || cost < best_cost)
+                {
+                    best_axis = axis;
+                    best_split = i;
+                    best_cost = cost;
+                }
+            }
+        }
+
+        std::span<int>::iterator mid;
+        if (best_axis != -1)
+        {
+            mid = std::partition(leaf_indices.begin(), leaf_indices.end(), [&](int index){return GetBin(index, best_axis) < best_split;});
+        }
+        else
+        {
+            int axis = 0;
+            for (int i = 1; i < T::size; i++)
+            {
+                if (extent[i] > extent[axis])
+                    axis = i;
+            }
+
+            // Compare the indices too, to make the result deterministic.
+            mid = leaf_indices.begin() + leaf_indices.size() / 2;
+            std::nth_element(leaf_indices.begin(), mid, leaf_indices.end(), [&](int a, int b)
+            {
+                return std::pair(Center(a)[axis], a) < std::pair(Center(b)[axis], b);
+            });
+        }
+
+        int index = internal_indices[next_internal++];
+
+        int child_a = BuildSubtree(std::span(leaf_indices.begin(), mid), internal_indices, next_internal);
+        int child_b = BuildSubtree(std::span(mid, leaf_indices.end()), internal_indices, next_internal);
+
+        Node &node = nodes[index];
+        node = {};
+        node.children[0] = child_a;
+        node.children[1] = child_b;
+        node.aabb = nodes[child_a].aabb.Combine(nodes[child_b].aabb);
+        node.height = 1 + max(nodes[child_a].height, nodes[child_b].height);
+        nodes[child_a].parent = index;
+        nodes[child_b].parent = index;
+        UpdatePackedNode(index);
+        return index;
+    }
+
+    // Reports all overlapping leaf pairs between the subtree `a_index` of `a_tree` and the subtree `b_index` of `b_tree`.
+    // The two subtrees must not overlap, if they are in the same tree. `func` is the same as in `CollidePairsWithTree()`.
+    template <typename F>
+    static bool CollideNodePairs(const AabbTree &a_tree, int a_index, const AabbTree &b_tree, int b_index, F &func)
+    {
+        const Node &a = a_tree.nodes[a_index];
+        const Node &b = b_tree.nodes[b_index];
+        if (!a.aabb.Intersects(b.aabb))
+            return false;
+
+        if (a.IsLeaf() && b.IsLeaf())
+            return bool(func(std::as_const(a_index), std::as_const(b_index)));
+
+        // Descend into the larger node, to keep the tested AABBs of similar sizes.
+        if (b.IsLeaf() || (!a.IsLeaf() && a.aabb.GetPerimeter() >= b.aabb.GetPerimeter()))
+        {
+            return CollideNodePairs(a_tree, a.children[0], b_tree, b_index, func)
+                || CollideNodePairs(a_tree, a.children[1], b_tree, b_index, func);
+        }
+        else
+        {
+            return CollideNodePairs(a_tree, a_index, b_tree, b.children[0], func)
+                || CollideNodePairs(a_tree, a_index, b_tree, b.children[1], func);
+        }
+    }
+
+    // Called after every change when `IMP_AUTO_VALIDATE_AABB_TREES` is enabled.
+    // Validates the path from `touched_index` to the root, or the whole tree if it's null.
+    void AutoValidate(int touched_index)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        if (touched_index == null_index || (IMP_AUTO_VALIDATE_AABB_TREES_FULL_INTERVAL > 0 && ++changes_since_full_validation >= IMP_AUTO_VALIDATE_AABB_TREES_FULL_INTERVAL))
+        {
+            changes_since_full_validation = 0;
+            Validate();
+        }
+        else
+        {
+            ValidatePath(touched_index);
+        }
+
+        validation_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Validates the nodes from `index` to the root, and their immediate children, which covers everything changed by an insertion or a removal,
+    // including the rotations. Throws on failure.
+    void ValidatePath(int index) const
+    {
+        ASSERT_ALWAYS(node_set.Contains(index));
+        while (index != null_index)
+        {
+            const Node &node = nodes[index];
+            ValidateOneNode(index);
+            if (!node.IsLeaf())
+            {
+                ValidateOneNode(node.children[0]);
+                ValidateOneNode(node.children[1]);
+            }
+            index = node.parent;
+        }
+    }
+
     // Performs some internal tests on a node, recursively. Throws on failure.
     // Don't call direclty, use the `Validate()` function.
     void ValidateNode(int index) const
     {
-        ASSERT_ALWAYS(index != null_index);
+        ValidateOneNode(index);
+
+        const Node &node = nodes[index];
+        if (!node.IsLeaf())
+        {
+            ValidateNode(node.children[0]);
+            ValidateNode(node.children[1]);
+        }
+    }
+
+    // Performs some internal tests on a node, and how it links to its children and parent. Throws on failure.
+    void ValidateOneNode(int index) const
+    {
+        ASSERT_ALWAYS(node_set.Contains(index));
 
         const Node &node = nodes[index];
 
         ASSERT_ALWAYS((index == root_index) == (node.parent == null_index));
+        if (node.parent != null_index)
+            ASSERT_ALWAYS(nodes[node.parent].children[0] == index || nodes[node.parent].children[1] == index);
 
         if (node.IsLeaf())
         {
@@ -677,8 +1322,12 @@ class AabbTree
             ASSERT_ALWAYS(node.height == 1 + max(child0.height, child1.height));
             ASSERT_ALWAYS(node.aabb == child0.aabb.Combine(child1.aabb));
 
-            ValidateNode(node.children[0]);
-            ValidateNode(node.children[1]);
+            const PackedNode &packed = packed_nodes[index];
+            for (int i = 0; i < 2; i++)
+            {
+                ASSERT_ALWAYS(packed.children[i] == (nodes[node.children[i]].IsLeaf() ? ~node.children[i] : node.children[i]));
+                ASSERT_ALWAYS(packed.ChildAabb(i) == nodes[node.children[i]].aabb);
+            }
         }
     }
 };
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "program/errors.h"
+#include "utils/mat.h"
+
+// A 2D array of bits, stored as rows of 64-bit words.
+// The bits past the end of each row are always zero, which lets us test rows for overlap word by word.
+class BitMatrix
+{
+  public:
+    using word_t = std::uint64_t;
+    static constexpr int word_bits = 64;
+
+  private:
+    ivec2 size_bits;
+    int row_words = 0;
+    std::vector<word_t> words;
+
+    [[nodiscard]] const word_t *RowPtr(int y) const {return words.data() + std::size_t(y) * std::size_t(row_words);}
+    [[nodiscard]] word_t *RowPtr(int y) {return words.data() + std::size_t(y) * std::size_t(row_words);}
+
+    // Returns 64 bits of the row starting at bit `x`, which can be out of range. Out-of-range bits are zero.
+    [[nodiscard]] static word_t ReadWordUnaligned(const word_t *row, int row_words, int x)
+    {
+        int index = x >> 6; // Rounds towards negative infinity.
+        int shift = x & (word_bits - 1);
+        word_t lo = index >= 0 && index < row_words ? row[index] : 0;
+        if (shift == 0)
+            return lo;
+        word_t hi = index + 1 >= 0 && index + 1 < row_words ? row[index + 1] : 0;
+        return lo >> shift | hi << (word_bits - shift);
+    }
+
+  public:
+    BitMatrix() {}
+    BitMatrix(ivec2 new_size) {Resize(new_size);}
+
+    [[nodiscard]] ivec2 Size() const {return size_bits;}
+    [[nodiscard]] bool IsEmpty() const {return (size_bits <= 0).any();}
+
+    // Changes the size and zeroes all bits.
+    void Resize(ivec2 new_size)
+    {
+        if (new_size(any) <= 0)
+            new_size = ivec2();
+        size_bits = new_size;
+        row_words = (new_size.x + word_bits - 1) / word_bits;
+        words.assign(std::size_t(row_words) * std::size_t(new_size.y), 0);
+    }
+
+    [[nodiscard]] bool PosInRange(ivec2 pos) const
+    {
+        return pos(all) >= 0 && pos(all) < size_bits;
+    }
+
+    // Returns the bit at `pos`, or false if out of range.
+    [[nodiscard]] bool Get(ivec2 pos) const
+    {
+        if (!PosInRange(pos))
+            return false;
+        return RowPtr(pos.y)[pos.x / word_bits] >> (pos.x % word_bits) & 1;
+    }
+
+    // Sets the bit at `pos`. The position must be in range.
+    void Set(ivec2 pos, bool value = true)
+    {
+        ASSERT(PosInRange(pos), "Bit matrix position is out of range.");
+        word_t &word = RowPtr(pos.y)[pos.x / word_bits];
+        word_t mask = word_t(1) << (pos.x % word_bits);
+        if (value)
+            word |= mask;
+        else
+            word &= ~mask;
+    }
+
+    // Assigns `value` to the bits in row `y`, in the half-open range `[x_begin, x_end)`. The range is clamped to the matrix bounds.
+    void SetRowRange(int y, int x_begin, int x_end, bool value)
+    {
+        ASSERT(y >= 0 && y < size_bits.y, "Bit matrix row is out of range.");
+        clamp_var_min(x_begin, 0);
+        clamp_var_max(x_end, size_bits.x);
+        if (x_begin >= x_end)
+            return;
+
+        word_t *row = RowPtr(y);
+        int first = x_begin / word_bits, last = (x_end - 1) / word_bits;
+        for (int i = first; i <= last; i++)
+        {
+            word_t mask = ~word_t(0);
+            if (i == first)
+                mask &= ~word_t(0) << (x_begin % word_bits);
+            if (i == last && x_end % word_bits != 0)
+                mask &= ~word_t(0) >> (word_bits - x_end % word_bits);
+            if (value)
+                row[i] |= mask;
+            else
+                row[i] &= ~mask;
+        }
+    }
+
+    // Zeroes all bits in a rect. The rect is clamped to the matrix bounds.
+    void ClearRect(ivec2 pos, ivec2 size)
+    {
+        for (int y = max(pos.y, 0); y < min(pos.y + size.y, size_bits.y); y++)
+            SetRowRange(y, pos.x, pos.x + size.x, false);
+    }
+
+    // Returns true if any bit is set in both this matrix and `other`, where `other` is positioned at `other_offset` relative to this matrix.
+    // I.e. checks if there's a `pos` for which `Get(pos) && other.Get(pos - other_offset)`.
+    [[nodiscard]] bool Intersects(const BitMatrix &other, ivec2 other_offset) const
+    {
+        int y_begin = max(0, other_offset.y);
+        int y_end = min(size_bits.y, other_offset.y + other.size_bits.y);
+
+        // Our words that can possibly overlap `other`.
+        int x_begin = max(0, other_offset.x);
+        int x_end = min(size_bits.x, other_offset.x + other.size_bits.x);
+        if (y_begin >= y_end || x_begin >= x_end)
+            return false;
+        int word_begin = x_begin / word_bits;
+        int word_end = (x_end + word_bits - 1) / word_bits;
+
+        // The range of our words for which the two `other` words we read are both in range. Those don't need bounds checks.
+        // Our word `i` reads `other` words starting from `(i * word_bits - other_offset.x) >> 6`.
+        int fast_begin = word_begin, fast_end = word_begin;
+        if (other_offset.x % word_bits == 0)
+        {
+            // Aligned case, only one `other` word per our word.
+            fast_begin = clamp(other_offset.x / word_bits, word_begin, word_end);
+            fast_end = clamp(other_offset.x / word_bits + other.row_words, fast_begin, word_end);
+        }
+        else
+        {
+            int base = other_offset.x >> 6; // Rounds towards negative infinity.
+            fast_begin = clamp(base + 1, word_begin, word_end);
+            fast_end = clamp(base + other.row_words, fast_begin, word_end);
+        }
+
+        for (int y = y_begin; y < y_end; y++)
+        {
+            const word_t *row = RowPtr(y);
+            const word_t *other_row = other.RowPtr(y - other_offset.y);
+
+            for (int i = word_begin; i < fast_begin; i++)
+            {
+                if (row[i] & ReadWordUnaligned(other_row, other.row_words, i * word_bits - other_offset.x))
+                    return true;
+            }
+
+            if (RowsIntersectUnchecked(row + fast_begin, other_row, fast_end - fast_begin, fast_begin * word_bits - other_offset.x))
+                return true;
+
+            for (int i = fast_end; i < word_end; i++)
+            {
+                if (row[i] & ReadWordUnaligned(other_row, other.row_words, i * word_bits - other_offset.x))
+                    return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Returns the smallest `i` in `[1, max_steps]` for which `Intersects(other, other_offset + step * i)` is true, or `max_steps + 1` if there's none.
+    // This is done in a single pass over our non-zero words. For each of them, we check all the steps until the first intersection found so far.
+    // Works best when this matrix is sparse.
+    [[nodiscard]] int FirstIntersectionAlongPath(const BitMatrix &other, ivec2 other_offset, ivec2 step, int max_steps) const
+    {
+        int best = max(max_steps, 0) + 1;
+        if (best == 1 || IsEmpty() || other.IsEmpty())
+            return best;
+
+        // Our rows and words that can possibly overlap `other` at any of the steps.
+        ivec2 first_offset = other_offset + step, last_offset = other_offset + step * max_steps;
+        int y_begin = max(0, min(first_offset.y, last_offset.y));
+        int y_end = min(size_bits.y, max(first_offset.y, last_offset.y) + other.size_bits.y);
+        int x_begin = max(0, min(first_offset.x, last_offset.x));
+        int x_end = min(size_bits.x, max(first_offset.x, last_offset.x) + other.size_bits.x);
+        if (y_begin >= y_end || x_begin >= x_end)
+            return best;
+        int word_begin = x_begin / word_bits;
+        int word_end = (x_end + word_bits - 1) / word_bits;
+
+        for (int y = y_begin; y < y_end; y++)
+        {
+            const word_t *row = RowPtr(y);
+            for (int i = word_begin; i < word_end; i++)
+            {
+                if (row[i] == 0)
+                    continue;
+
+                ivec2 offset = other_offset;
+                for (int j = 1; j < best; j++)
+                {
+                    offset += step;
+                    int other_y = y - offset.y;
+                    if (other_y < 0 || other_y >= other.size_bits.y)
+                        continue;
+                    if (row[i] & ReadWordUnaligned(other.RowPtr(other_y), other.row_words, i * word_bits - offset.x))
+                    {
+                        best = j;
+                        break;
+                    }
+                }
+
+                if (best == 1)
+                    return best;
+            }
+        }
+
+        return best;
+    }
+
+  private:
+    // Tests `count` words of `row` against the bits of `other_row` starting from `other_x`, without bounds checks.
+    // All `other_row` words touched by this must be in range.
+    [[nodiscard]] static bool RowsIntersectUnchecked(const word_t *row, const word_t *other_row, int count, int other_x)
+    {
+        if (count <= 0)
+            return false;
+
+        const word_t *other_words = other_row + (other_x >> 6);
+        int shift = other_x & (word_bits - 1);
+        int i = 0;
+
+        #if defined(__AVX2__)
+        // Four words at a time. The shifts are the same for all lanes.
+        __m128i shift_lo = _mm_cvtsi32_si128(shift);
+        __m128i shift_hi = _mm_cvtsi32_si128(word_bits - shift);
+        for (; i + 4 <= count; i += 4)
+        {
+            __m256i ours = _mm256_loadu_si256((const __m256i *)(row + i));
+            __m256i theirs = _mm256_srl_epi64(_mm256_loadu_si256((const __m256i *)(other_words + i)), shift_lo);
+            if (shift != 0)
+                theirs = _mm256_or_si256(theirs, _mm256_sll_epi64(_mm256_loadu_si256((const __m256i *)(other_words + i + 1)), shift_hi));
+            if (!_mm256_testz_si256(ours, theirs))
+                return true;
+        }
+        #endif
+
+        for (; i < count; i++)
+        {
+            word_t theirs = other_words[i] >> shift;
+            if (shift != 0)
+                theirs |= other_words[i + 1] << (word_bits - shift);
+            if (row[i] & theirs)
+                return true;
+        }
+
+        return false;
+    }
+};
@@ -0,0 +1,612 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "macros/finally.h"
+#include "program/errors.h"
+#include "utils/aabb_tree.h"
+#include "utils/mat.h"
+#include "utils/sparse_set.h"
+
+// A uniform grid of cells, hashed into a fixed number of buckets. An alternative broadphase to `AabbTree`, with the same interface.
+// Each node is listed in every cell it overlaps, so moving a node is O(1) as long as it doesn't cross a cell border, and there's no tree to rebalance.
+// This works best when most objects are about the same size as a cell (e.g. a lot of small debris).
+// Large objects overlap a lot of cells, and make insertions and queries slower, for those prefer `AabbTree`.
+//
+// `T` is an integral 2D vector type.
+// `UserData` is an arbitrary type, an instance of which will be stored in each node.
+// The second corner of AABBs is exclusive, like in `AabbTree<T, UserData, false>`.
+template <Math::vector T, typename UserData = void>
+class SpatialHash
+{
+    struct Empty {};
+  public:
+    using vector = T;
+    using scalar = typename T::type;
+    using user_data = std::conditional_t<std::is_void_v<UserData>, Empty, UserData>;
+    // The vector type for `RayCast()`.
+    using ray_vector = Math::vec<T::size, float>;
+    using ray_scalar = float;
+
+    static_assert(T::size == 2 && std::is_integral_v<scalar>, "Only integral 2D vectors are supported.");
+
+    // The same type as in `AabbTree`, see the comments there.
+    using Aabb = typename AabbTree<T, void, false>::Aabb;
+
+    struct Params
+    {
+        Params() {}
+        Params(T cell_size, T extra_margin = {}) : cell_size(cell_size), extra_margin(extra_margin) {}
+
+        // The size of one cell. Should be comparable to the typical object size.
+        T cell_size;
+
+        // AABBs are extended by this margin. Unlike in `AabbTree`, this is rarely useful, since moving within a cell is free anyway.
+        T extra_margin;
+
+        // You can pass velocity to `ModifyNode` to predictively extend the AABB in the specified direction. The extension is multiplied by this amount.
+        T velocity_margin_factor = T(1);
+    };
+
+    // Constructs an null/invalid hash. Use the other constructor to make a proper one.
+    constexpr SpatialHash() {}
+
+    // Makes an empty hash.
+    SpatialHash(Params params) : params(std::move(params))
+    {
+        ASSERT(this->params.cell_size(all) > 0, "The cell size must be positive.");
+        Rehash(min_bucket_bits);
+    }
+
+    // Creates a new node. Returns the node index.
+    // `suggested_index` allows you to force a specific index. Mostly for internal use.
+    [[nodiscard]] int AddNode(Aabb new_aabb, user_data new_data = {}, int new_index = null_index) noexcept
+    {
+        #if IMP_AUTO_VALIDATE_AABB_TREES
+        FINALLY{AutoValidate(new_index);};
+        #endif
+
+        sort_two_var(new_aabb.a, new_aabb.b);
+        new_aabb = new_aabb.Expand(params.extra_margin);
+
+        ASSERT(new_index == null_index || !node_set.Contains(new_index));
+        if (new_index == null_index)
+        {
+            if (node_set.IsFull())
+                Reserve((node_set.Capacity() + 1) * 3 / 2);
+            new_index = node_set.InsertAny();
+        }
+        else
+        {
+            if (new_index >= node_set.Capacity())
+                Reserve(new_index + 1);
+            // Not inside of `ASSERT()`, since that's removed in prod builds.
+            [[maybe_unused]] bool inserted = node_set.Insert(new_index);
+            ASSERT(inserted);
+        }
+
+        Node &node = nodes[new_index];
+        node.aabb = new_aabb;
+        std::tie(node.cell_a, node.cell_b) = CellRange(new_aabb);
+        userdata[new_index] = std::move(new_data);
+
+        if (std::size_t(node_set.ElemCount()) * 2 > buckets.size())
+            Rehash(bucket_bits + 1); // This also inserts the new node.
+        else
+            InsertIntoCells(new_index);
+
+        return new_index;
+    }
+
+    // Replaces the contents of the hash with the specified nodes.
+    // The nodes get indices `0 .. nodes.size()-1`, in the same order, like in `AabbTree::Build()`.
+    void Build(std::span<const std::pair<Aabb, user_data>> new_nodes)
+    {
+        #if IMP_AUTO_VALIDATE_AABB_TREES
+        FINALLY{AutoValidate(null_index);};
+        #endif
+
+        node_set.EraseAllElements();
+        Reserve(int(new_nodes.size()));
+
+        for (int i = 0; i < int(new_nodes.size()); i++)
+        {
+            node_set.Insert(i);
+
+            Aabb aabb = new_nodes[i].first;
+            sort_two_var(aabb.a, aabb.b);
+
+            Node &node = nodes[i];
+            node.aabb = aabb.Expand(params.extra_margin);
+            std::tie(node.cell_a, node.cell_b) = CellRange(node.aabb);
+            userdata[i] = new_nodes[i].second;
+        }
+
+        int new_bucket_bits = min_bucket_bits;
+        while ((std::size_t(1) << new_bucket_bits) < new_nodes.size() * 2)
+            new_bucket_bits++;
+        Rehash(new_bucket_bits);
+    }
+
+    // Does nothing, this is for compatibility with `AabbTree`. The hash doesn't degrade over time.
+    void Rebuild() {}
+
+    // Removes a node. Returns false if the index is invalid.
+    bool RemoveNode(int target_index) noexcept
+    {
+        if (!node_set.Contains(target_index))
+            return false;
+
+        #if IMP_AUTO_VALIDATE_AABB_TREES
+        FINALLY{AutoValidate(target_index);};
+        #endif
+
+        EraseFromCells(target_index);
+        node_set.EraseUnordered(target_index);
+        return true;
+    }
+
+    // Modifies a node.
+    // `new_velocity` is used to predictively expand AABB in the specified direction,
+    // it's multiplied by `params.velocity_margin_factor`.
+    void ModifyNode(int target_index, Aabb new_aabb, T new_velocity)
+    {
+        ASSERT(node_set.Contains(target_index));
+
+        sort_two_var(new_aabb.a, new_aabb.b);
+        SetNodeAabb(target_index, new_aabb.ExpandInDir(new_velocity * params.velocity_margin_factor).Expand(params.extra_margin));
+    }
+
+    // Enlarges the AABB of a node to contain `aabb` (expanded by `params.extra_margin`).
+    // Returns false if the node already contained `aabb`, in which case nothing is changed.
+    // Unlike in `AabbTree`, this isn't any cheaper than `ModifyNode()`, but is provided for compatibility.
+    bool EnlargeNode(int target_index, Aabb aabb)
+    {
+        ASSERT(node_set.Contains(target_index));
+
+        sort_two_var(aabb.a, aabb.b);
+        if (nodes[target_index].aabb.Contains(aabb))
+            return false;
+
+        SetNodeAabb(target_index, nodes[target_index].aabb.Combine(aabb.Expand(params.extra_margin)));
+        return true;
+    }
+
+    // Returns arbitrary user data for the node.
+    [[nodiscard]] user_data &GetNodeUserData(int node_index)
+    {
+        return const_cast<user_data &>(std::as_const(*this).GetNodeUserData(node_index));
+    }
+    [[nodiscard]] const user_data &GetNodeUserData(int node_index) const
+    {
+        ASSERT(node_set.Contains(node_index));
+        return userdata[node_index];
+    }
+
+    // Returns the AABB of a node. It might be larger than the requested AABB.
+    [[nodiscard]] Aabb GetNodeAabb(int node_index) const
+    {
+        ASSERT(node_set.Contains(node_index));
+        return nodes[node_index].aabb;
+    }
+
+    // A point collision test.
+    // `func` is `bool func(int node)`. It's called for all colliding nodes. If it returns true, the function stops immediately and also returns true.
+    // If you use margins, you might get false positive nodes. Manually check if the collision is exact.
+    template <typename F>
+    bool CollidePoint(T point, F &&func) const
+    {
+        T cell = div_ex(point, params.cell_size);
+        for (const CellEntry &entry : buckets[BucketIndex(cell)])
+        {
+            // The bucket can contain nodes from other cells.
+            if (entry.cell != cell || !nodes[entry.index].aabb.ContainsPoint(point))
+                continue;
+            if (func(std::as_const(entry.index)))
+                return true;
+        }
+        return false;
+    }
+
+    // An AABB collision test.
+    // `func` is `bool func(int node)`. It's called for all colliding nodes. If it returns true, the function stops immediately and also returns true.
+    // If you use margins, you might get false positive nodes. Manually check if the collision is exact.
+    template <typename F>
+    bool CollideAabb(Aabb aabb, F &&func) const
+    {
+        sort_two_var(aabb.a, aabb.b);
+
+        auto [cell_a, cell_b] = CellRange(aabb);
+
+        // If the AABB covers more cells than there are nodes, it's cheaper to check every node.
+        if (std::int64_t(cell_b.x - cell_a.x + 1) * std::int64_t(cell_b.y - cell_a.y + 1) > std::int64_t(node_set.ElemCount()))
+            return CollideCustom([&aabb](const Aabb &node_aabb){return aabb.Intersects(node_aabb);}, std::forward<F>(func));
+
+        for (T cell : cell_a <= vector_range <= cell_b)
+        {
+            for (const CellEntry &entry : buckets[BucketIndex(cell)])
+            {
+                // The bucket can contain nodes from other cells.
+                if (entry.cell != cell)
+                    continue;
+
+                // A node can overlap several cells of the AABB, report it only from the first one.
+                const Node &node = nodes[entry.index];
+                if (max(node.cell_a, cell_a) != cell || !node.aabb.Intersects(aabb))
+                    continue;
+
+                if (func(std::as_const(entry.index)))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // A custom collision test.
+    // `check_collision` is `bool check_collision(const Aabb &aabb)`. If it returns true for a node AABB, the node is reported.
+    // `func` is `bool func(int node)`. It's called for all colliding nodes. If it returns true, the function stops immediately and also returns true.
+    // Since the hash knows nothing about the shape of the area, this checks every node.
+    template <typename C, typename F>
+    bool CollideCustom(C &&check_collision, F &&func) const
+    {
+        for (int i = 0; i < node_set.ElemCount(); i++)
+        {
+            int node_index = node_set.GetElem(i);
+            if (check_collision(std::as_const(nodes[node_index].aabb)) && func(std::as_const(node_index)))
+                return true;
+        }
+        return false;
+    }
+
+    // Casts a ray `origin + dir * t` for `t` in `[0, max_t]`, and reports the nodes it hits. `dir` doesn't have to be normalized.
+    // The AABBs are treated as closed continuous boxes `[a, b]`, but a ray that only grazes the far edge of a node might miss it.
+    // `func` is `ray_scalar func(int node, ray_scalar t)`, where `t` is the distance at which the ray enters the node AABB.
+    // It should return the new `max_t`: either the same one to continue, or the distance to the exact hit to only look for closer hits after it,
+    // or a negative value to stop immediately. The cells are visited front to back, so clipping the ray skips most of the remaining nodes.
+    // Different threads can cast rays at the same time, but `func` must not cast rays into a hash of the same type.
+    // If you use margins, you might get false positive nodes. Manually check if the collision is exact.
+    template <typename F>
+    void RayCast(ray_vector origin, ray_vector dir, ray_scalar max_t, F &&func) const
+    {
+        if (node_set.ElemCount() == 0)
+            return;
+
+        ray_vector inv_dir;
+        for (int i = 0; i < 2; i++)
+            inv_dir[i] = dir[i] == 0 ? 0 : 1 / dir[i];
+
+        // Computes the distance at which the ray enters `aabb`, returns false if it doesn't hit it before `max_t`.
+        auto RayEntersAabb = [&](const Aabb &aabb, ray_scalar &t) -> bool
+        {
+            ray_scalar t_enter = 0, t_exit = max_t;
+            for (int i = 0; i < 2; i++)
+            {
+                if (dir[i] == 0)
+                {
+                    if (origin[i] < ray_scalar(aabb.a[i]) || origin[i] > ray_scalar(aabb.b[i]))
+                        return false;
+                    continue;
+                }
+
+                ray_scalar t_a = (ray_scalar(aabb.a[i]) - origin[i]) * inv_dir[i];
+                ray_scalar t_b = (ray_scalar(aabb.b[i]) - origin[i]) * inv_dir[i];
+                if (t_a > t_b)
+                    std::swap(t_a, t_b);
+                clamp_var_min(t_enter, t_a);
+                clamp_var_max(t_exit, t_b);
+            }
+            t = t_enter;
+            return t_enter <= t_exit;
+        };
+
+        ray_vector cell_size(params.cell_size);
+
+        // If the ray crosses more cells than there are nodes, it's cheaper to check every node, then report them sorted by distance.
+        ray_scalar num_cells = (abs(dir * max_t) / cell_size).sum();
+        if (!(num_cells < ray_scalar(node_set.ElemCount())))
+        {
+            std::vector<std::pair<ray_scalar, int>> hits;
+            for (int i = 0; i < node_set.ElemCount(); i++)
+            {
+                int node_index = node_set.GetElem(i);
+                ray_scalar t = 0;
+                if (RayEntersAabb(nodes[node_index].aabb, t))
+                    hits.emplace_back(t, node_index);
+            }
+            std::sort(hits.begin(), hits.end());
+
+            for (const auto &[t, node_index] : hits)
+            {
+                if (t > max_t)
+                    return;
+                ray_scalar new_max_t = func(std::as_const(node_index), std::as_const(t));
+                if (new_max_t < 0)
+                    return;
+                clamp_var_max(max_t, new_max_t);
+            }
+            return;
+        }
+
+        // A node can overlap several cells along the ray, so we stamp the nodes we've already checked.
+        RayScratch &scratch = ThisThreadRayScratch();
+        if (scratch.stamps.size() < nodes.size())
+            scratch.stamps.resize(nodes.size());
+        if (++scratch.stamp == 0)
+        {
+            // The counter wrapped around, forget the old stamps.
+            std::fill(scratch.stamps.begin(), scratch.stamps.end(), 0);
+            scratch.stamp = 1;
+        }
+
+        // Walk the cells along the ray, see "A Fast Voxel Traversal Algorithm for Ray Tracing" by Amanatides and Woo.
+        T cell = T(floor(origin / cell_size));
+        T step;
+        ray_vector t_next, t_delta;
+        for (int i = 0; i < 2; i++)
+        {
+            step[i] = dir[i] > 0 ? 1 : dir[i] < 0 ? -1 : 0;
+            if (step[i] == 0)
+            {
+                t_next[i] = std::numeric_limits<ray_scalar>::infinity();
+                continue;
+            }
+            t_next[i] = (ray_scalar(cell[i] + (step[i] > 0)) * cell_size[i] - origin[i]) * inv_dir[i];
+            t_delta[i] = cell_size[i] * abs(inv_dir[i]);
+        }
+
+        while (true)
+        {
+            for (const CellEntry &entry : buckets[BucketIndex(cell)])
+            {
+                if (entry.cell != cell || scratch.stamps[entry.index] == scratch.stamp)
+                    continue;
+                scratch.stamps[entry.index] = scratch.stamp;
+
+                ray_scalar t = 0;
+                if (!RayEntersAabb(nodes[entry.index].aabb, t))
+                    continue;
+
+                ray_scalar new_max_t = func(std::as_const(entry.index), std::as_const(t));
+                if (new_max_t < 0)
+                    return;
+                clamp_var_max(max_t, new_max_t);
+            }
+
+            int axis = t_next.x < t_next.y ? 0 : 1;
+            if (!(t_next[axis] <= max_t))
+                return;
+            cell[axis] += step[axis];
+            t_next[axis] += t_delta[axis];
+        }
+    }
+
+    // Finds all pairs of overlapping nodes. Each unordered pair is reported once, in an unspecified order.
+    // `func` is `bool func(int node_a, int node_b)`. If it returns true, the function stops immediately and also returns true.
+    // This walks the buckets once, which is cheaper than calling `CollideAabb()` for every node.
+    // If you use margins, you might get false positive pairs. Manually check if the collision is exact.
+    template <typename F>
+    bool CollidePairs(F &&func) const
+    {
+        for (const std::vector<CellEntry> &bucket : buckets)
+        {
+            for (std::size_t i = 0; i < bucket.size(); i++)
+            {
+                const CellEntry &entry_a = bucket[i];
+                const Node &node_a = nodes[entry_a.index];
+
+                for (std::size_t j = i + 1; j < bucket.size(); j++)
+                {
+                    const CellEntry &entry_b = bucket[j];
+                    // The bucket can contain nodes from other cells.
+                    if (entry_b.cell != entry_a.cell)
+                        continue;
+
+                    // Two nodes can share several cells, report them only from the first one.
+                    const Node &node_b = nodes[entry_b.index];
+                    if (max(node_a.cell_a, node_b.cell_a) != entry_a.cell || !node_a.aabb.Intersects(node_b.aabb))
+                        continue;
+
+                    if (func(std::as_const(entry_a.index), std::as_const(entry_b.index)))
+                        return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Performs some internal tests on the whole hash. Throws on failure.
+    // In the debug builds, the nodes affected by each change are validated automatically, like in `AabbTree`.
+    void Validate() const
+    {
+        std::size_t num_entries = 0;
+        for (int i = 0; i < node_set.ElemCount(); i++)
+        {
+            int node_index = node_set.GetElem(i);
+            ValidateNode(node_index);
+            const Node &node = nodes[node_index];
+            num_entries += std::size_t(node.cell_b.x - node.cell_a.x + 1) * std::size_t(node.cell_b.y - node.cell_a.y + 1);
+        }
+
+        for (const std::vector<CellEntry> &bucket : buckets)
+            num_entries -= bucket.size();
+        ASSERT_ALWAYS(num_entries == 0);
+    }
+
+    // How much time the automatic validation took so far, in seconds. Zero if it's disabled.
+    [[nodiscard]] double ValidationTime() const
+    {
+        return validation_time;
+    }
+
+    // Reserves memory for a specific number of nodes.
+    void Reserve(int new_capacity)
+    {
+        if (new_capacity < node_set.Capacity())
+            return; // Can't decrease capacity.
+
+        node_set.Reserve(new_capacity);
+        nodes.resize(new_capacity);
+        userdata.resize(new_capacity);
+    }
+    // Lets you look at the node set, mostly for debug purposes.
+    [[nodiscard]] const SparseSet<int> &Nodes() const
+    {
+        return node_set;
+    }
+
+  private:
+    static constexpr int null_index = -1;
+
+    // The smallest `bucket_bits`.
+    static constexpr int min_bucket_bits = 6;
+
+    Params params;
+
+    SparseSet<int> node_set;
+
+    struct Node
+    {
+        Aabb aabb;
+        // The range of cells overlapped by `aabb`, inclusive.
+        T cell_a, cell_b;
+    };
+    std::vector<Node> nodes;
+
+    std::vector<user_data> userdata;
+
+    struct CellEntry
+    {
+        int index = null_index;
+        // Different cells can share a bucket, so we store the cell to tell them apart.
+        T cell;
+
+        [[nodiscard]] friend constexpr bool operator==(const CellEntry &, const CellEntry &) = default;
+    };
+
+    // Each cell is mapped to one of those buckets. A node is listed once per cell it overlaps, in the buckets of those cells.
+    // The size is `1 << bucket_bits`, and is kept at least twice the number of nodes.
+    std::vector<std::vector<CellEntry>> buckets;
+    int bucket_bits = 0;
+
+    // Used by `RayCast()` to skip the nodes it has already checked.
+    // This is per thread rather than per hash, to keep concurrent casts safe, and shared by all hashes of the same type.
+    struct RayScratch
+    {
+        // For each node index, the `stamp` of the last cast that checked it.
+        std::vector<std::uint32_t> stamps;
+        // Incremented for every cast.
+        std::uint32_t stamp = 0;
+    };
+    [[nodiscard]] static RayScratch &ThisThreadRayScratch()
+    {
+        thread_local RayScratch ret;
+        return ret;
+    }
+
+    // See `ValidationTime()`.
+    double validation_time = 0;
+    // For `IMP_AUTO_VALIDATE_AABB_TREES_FULL_INTERVAL`.
+    int changes_since_full_validation = 0;
+
+    // Called after every change when `IMP_AUTO_VALIDATE_AABB_TREES` is enabled.
+    // Validates the node `touched_index` (which could've just been removed), or the whole hash if it's null.
+    void AutoValidate(int touched_index)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        if (touched_index == null_index || (IMP_AUTO_VALIDATE_AABB_TREES_FULL_INTERVAL > 0 && ++changes_since_full_validation >= IMP_AUTO_VALIDATE_AABB_TREES_FULL_INTERVAL))
+        {
+            changes_since_full_validation = 0;
+            Validate();
+        }
+        else
+        {
+            ValidateNode(touched_index);
+        }
+
+        validation_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Checks that the node is listed exactly once in each of its cells, or not listed at all if it was removed. Throws on failure.
+    void ValidateNode(int node_index) const
+    {
+        const Node &node = nodes[node_index];
+        bool exists = node_set.Contains(node_index);
+        if (exists)
+            ASSERT_ALWAYS(CellRange(node.aabb) == std::pair(node.cell_a, node.cell_b));
+
+        for (T cell : node.cell_a <= vector_range <= node.cell_b)
+        {
+            const std::vector<CellEntry> &bucket = buckets[BucketIndex(cell)];
+            ASSERT_ALWAYS(std::count(bucket.begin(), bucket.end(), CellEntry{.index = node_index, .cell = cell}) == exists);
+        }
+    }
+
+    // Returns the range of cells overlapped by `aabb`, inclusive. An empty AABB still gets one cell.
+    [[nodiscard]] std::pair<T, T> CellRange(const Aabb &aabb) const
+    {
+        return {div_ex(aabb.a, params.cell_size), div_ex(max(aabb.a, aabb.b - 1), params.cell_size)};
+    }
+
+    // Fibonacci hashing, the top bits of the product are the best mixed.
+    [[nodiscard]] std::size_t BucketIndex(T cell) const
+    {
+        std::uint64_t key = std::uint64_t(std::uint32_t(cell.x)) << 32 | std::uint32_t(cell.y);
+        return std::size_t(key * 0x9e3779b97f4a7c15ull >> (64 - bucket_bits));
+    }
+
+    void InsertIntoCells(int node_index)
+    {
+        const Node &node = nodes[node_index];
+        for (T cell : node.cell_a <= vector_range <= node.cell_b)
+            buckets[BucketIndex(cell)].push_back({.index = node_index, .cell = cell});
+    }
+
+    void EraseFromCells(int node_index)
+    {
+        const Node &node = nodes[node_index];
+        for (T cell : node.cell_a <= vector_range <= node.cell_b)
+        {
+            std::vector<CellEntry> &bucket = buckets[BucketIndex(cell)];
+            auto it = std::find(bucket.begin(), bucket.end(), CellEntry{.index = node_index, .cell = cell});
+            ASSERT(it != bucket.end());
+            *it = bucket.back();
+            bucket.pop_back();
+        }
+    }
+
+    // Changes the AABB of a node. Only touches the buckets if the node moves to different cells.
+    void SetNodeAabb(int node_index, Aabb aabb)
+    {
+        #if IMP_AUTO_VALIDATE_AABB_TREES
+        FINALLY{AutoValidate(node_index);};
+        #endif
+
+        Node &node = nodes[node_index];
+        node.aabb = aabb;
+        std::pair<T, T> cells = CellRange(aabb);
+        if (cells == std::pair(node.cell_a, node.cell_b))
+            return;
+
+        EraseFromCells(node_index);
+        std::tie(node.cell_a, node.cell_b) = cells;
+        InsertIntoCells(node_index);
+    }
+
+    // Changes the number of buckets to `1 << new_bucket_bits`, and redistributes all nodes between them.
+    void Rehash(int new_bucket_bits)
+    {
+        bucket_bits = new_bucket_bits;
+        buckets.clear();
+        buckets.resize(std::size_t(1) << bucket_bits);
+        for (int i = 0; i < node_set.ElemCount(); i++)
+            InsertIntoCells(node_set.GetElem(i));
+    }
+};
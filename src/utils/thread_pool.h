@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A simple work-stealing thread pool.
+// Each worker has its own task queue. Workers take tasks from the back of their own queue, and steal from the front of the other queues when theirs is empty.
+// The thread calling `ParallelFor()` also helps with the work until it's done, so a pool with zero workers is valid and runs everything on the calling thread.
+class ThreadPool
+{
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    // One queue per worker, plus one for the external threads.
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::jthread> workers;
+
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+    std::atomic<std::size_t> num_pending_tasks = 0;
+    bool stopping = false; // Protected by `sleep_mutex`.
+
+    // The worker index of the current thread, or -1 if this thread doesn't belong to any pool.
+    inline static thread_local int this_worker_index = -1;
+    inline static thread_local const ThreadPool *this_worker_pool = nullptr;
+
+    // Tries to run a single task. Prefers the queue `preferred_queue`, steals from other queues if it's empty.
+    // Returns false if there was nothing to do.
+    bool RunOneTask(std::size_t preferred_queue)
+    {
+        std::function<void()> task;
+        for (std::size_t i = 0; i < queues.size() && !task; i++)
+        {
+            Queue &queue = *queues[(preferred_queue + i) % queues.size()];
+            std::lock_guard lock(queue.mutex);
+            if (queue.tasks.empty())
+                continue;
+            if (i == 0)
+            {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            else
+            {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+        }
+        if (!task)
+            return false;
+
+        num_pending_tasks--;
+        task();
+        return true;
+    }
+
+    void WorkerLoop(int index)
+    {
+        this_worker_index = index;
+        this_worker_pool = this;
+
+        while (true)
+        {
+            if (RunOneTask(index))
+                continue;
+
+            std::unique_lock lock(sleep_mutex);
+            sleep_cv.wait(lock, [&]{return stopping || num_pending_tasks.load() > 0;});
+            if (stopping)
+                return;
+        }
+    }
+
+    void Push(std::size_t queue_index, std::function<void()> task)
+    {
+        {
+            // Increment this first, to make sure it never underflows when a task is popped right after pushing it.
+            std::lock_guard lock(sleep_mutex);
+            num_pending_tasks++;
+        }
+        {
+            Queue &queue = *queues[queue_index % queues.size()];
+            std::lock_guard lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        sleep_cv.notify_one();
+    }
+
+  public:
+    // Creates a pool with no workers. Everything runs on the calling thread.
+    ThreadPool() : ThreadPool(0) {}
+
+    // Creates a pool with the specified number of worker threads.
+    // The calling thread also does work in `ParallelFor()`, so `std::thread::hardware_concurrency() - 1` is a good value.
+    explicit ThreadPool(int num_workers)
+    {
+        num_workers = std::max(num_workers, 0);
+        queues.reserve(num_workers + 1);
+        for (int i = 0; i < num_workers + 1; i++)
+            queues.push_back(std::make_unique<Queue>());
+        workers.reserve(num_workers);
+        for (int i = 0; i < num_workers; i++)
+            workers.emplace_back([this, i]{WorkerLoop(i);});
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard lock(sleep_mutex);
+            stopping = true;
+        }
+        sleep_cv.notify_all();
+        workers.clear(); // Join.
+    }
+
+    // Returns the number of threads that can work at the same time, including the calling thread.
+    [[nodiscard]] int ThreadCount() const {return int(workers.size()) + 1;}
+
+    // Returns an index in `[0, ThreadCount())` for the current thread, unique among the threads working in this pool.
+    // The external threads get `ThreadCount() - 1`, so don't call `ParallelFor()` on the same pool from several external threads at the same time if you rely on this.
+    [[nodiscard]] int ThisThreadIndex() const
+    {
+        return this_worker_pool == this ? this_worker_index : int(workers.size());
+    }
+
+    // Calls `func(i)` for every `i` in `[0, count)`, possibly in parallel, in an unspecified order.
+    // The indices are grouped into chunks of `grain_size`, each chunk is processed on a single thread.
+    // Blocks until everything is done. The calling thread participates in the work.
+    // If any of the calls throw, the first exception is rethrown after all the chunks finish.
+    template <typename F>
+    void ParallelFor(std::size_t count, F &&func, std::size_t grain_size = 1)
+    {
+        if (count == 0)
+            return;
+        grain_size = std::max(grain_size, std::size_t(1));
+
+        std::size_t num_chunks = (count + grain_size - 1) / grain_size;
+
+        // Run small jobs in place.
+        if (num_chunks == 1 || workers.empty())
+        {
+            for (std::size_t i = 0; i < count; i++)
+                func(std::as_const(i));
+            return;
+        }
+
+        std::atomic<std::size_t> remaining_chunks = num_chunks;
+        std::mutex exception_mutex;
+        std::exception_ptr exception;
+
+        std::size_t this_queue = this_worker_pool == this ? std::size_t(this_worker_index) : workers.size();
+
+        for (std::size_t chunk = 0; chunk < num_chunks; chunk++)
+        {
+            // Distribute the chunks round-robin, the calling thread gets the first one.
+            Push(this_queue + chunk, [&, chunk]
+            {
+                try
+                {
+                    std::size_t end = std::min(count, (chunk + 1) * grain_size);
+                    for (std::size_t i = chunk * grain_size; i < end; i++)
+                        func(std::as_const(i));
+                }
+                catch (...)
+                {
+                    std::lock_guard lock(exception_mutex);
+                    if (!exception)
+                        exception = std::current_exception();
+                }
+                remaining_chunks--;
+            });
+        }
+
+        // Help until our chunks are done. We might end up running unrelated tasks too, that's fine.
+        while (remaining_chunks.load() > 0)
+        {
+            if (!RunOneTask(this_queue))
+                std::this_thread::yield();
+        }
+
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+};
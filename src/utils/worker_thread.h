@@ -0,0 +1,99 @@
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "program/errors.h"
+
+// A single persistent thread that runs one job at a time.
+// Unlike `std::async()`, this doesn't create a new thread for every job, so it's fine to start a job every frame.
+// The destructor waits for the current job to finish.
+class WorkerThread
+{
+    std::mutex mutex;
+    // Notified both when a job is started and when it finishes.
+    std::condition_variable cv;
+    std::function<void()> job; // Protected by `mutex`.
+    bool busy = false; // Protected by `mutex`. Set from `Start()` until the job finishes.
+    bool stopping = false; // Protected by `mutex`.
+    std::exception_ptr exception; // Protected by `mutex`.
+
+    // This is declared last, to start the thread after everything else is initialized.
+    std::jthread thread;
+
+    void Loop()
+    {
+        std::unique_lock lock(mutex);
+        while (true)
+        {
+            cv.wait(lock, [&]{return busy || stopping;});
+            if (!busy)
+                return;
+
+            std::function<void()> func = std::move(job);
+            lock.unlock();
+            std::exception_ptr new_exception;
+            try
+            {
+                func();
+            }
+            catch (...)
+            {
+                new_exception = std::current_exception();
+            }
+            lock.lock();
+
+            exception = std::move(new_exception);
+            busy = false;
+            cv.notify_all();
+        }
+    }
+
+  public:
+    WorkerThread() : thread([this]{Loop();}) {}
+
+    WorkerThread(const WorkerThread &) = delete;
+    WorkerThread &operator=(const WorkerThread &) = delete;
+
+    ~WorkerThread()
+    {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        // `std::jthread` joins automatically. A job that was already started still runs to completion.
+    }
+
+    // Starts running `func()` on the thread. The previous job must be finished, call `Wait()` first.
+    void Start(std::function<void()> func)
+    {
+        {
+            std::lock_guard lock(mutex);
+            ASSERT(!busy, "The previous job of this worker thread is still running.");
+            job = std::move(func);
+            busy = true;
+        }
+        cv.notify_all();
+    }
+
+    // Blocks until the current job (if any) finishes. If it threw, rethrows the exception.
+    void Wait()
+    {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&]{return !busy;});
+        if (exception)
+            std::rethrow_exception(std::exchange(exception, nullptr));
+    }
+
+    // Returns true if a job is running or about to start.
+    [[nodiscard]] bool IsBusy()
+    {
+        std::lock_guard lock(mutex);
+        return busy;
+    }
+};